@@ -0,0 +1,105 @@
+/* Copyright 2017 PrismTech Limited
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#include <stddef.h>
+#include <errno.h>
+
+#include "allocstats.h"
+
+/* Counting allocator for use with LD_PRELOAD, e.g.:
+
+     LD_PRELOAD=./liballocstats.so pubsub ...
+
+   It forwards to the glibc implementations without taking any locks,
+   the counters being thread-local.  Frees are not interposed and hence
+   not counted. */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t align, size_t size);
+
+static __thread struct {
+  int phase;
+  unsigned long long n[AP_N], bytes[AP_N];
+} counts __attribute__ ((tls_model ("initial-exec")));
+
+static void count (size_t size)
+{
+  counts.n[counts.phase]++;
+  counts.bytes[counts.phase] += size;
+}
+
+void *malloc (size_t size)
+{
+  count (size);
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+  /* an overflowing request fails without allocating anything */
+  size_t total;
+  count (__builtin_mul_overflow (n, size, &total) ? 0 : total);
+  return __libc_calloc (n, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+  /* realloc (ptr, 0) is a free */
+  if (size > 0)
+    count (size);
+  return __libc_realloc (ptr, size);
+}
+
+void *memalign (size_t align, size_t size)
+{
+  count (size);
+  return __libc_memalign (align, size);
+}
+
+void *aligned_alloc (size_t align, size_t size)
+{
+  count (size);
+  return __libc_memalign (align, size);
+}
+
+int posix_memalign (void **ptr, size_t align, size_t size)
+{
+  void *p;
+  if (align == 0 || (align & (align - 1)) != 0 || align % sizeof (void *) != 0)
+    return EINVAL;
+  count (size);
+  if ((p = __libc_memalign (align, size)) == NULL)
+    return ENOMEM;
+  *ptr = p;
+  return 0;
+}
+
+int allocstats_setphase (int phase)
+{
+  const int old = counts.phase;
+  counts.phase = (phase >= 0 && phase < AP_N) ? phase : AP_OTHER;
+  return old;
+}
+
+int allocstats_get (unsigned long long *n, unsigned long long *bytes, int nphases)
+{
+  int i;
+  for (i = 0; i < nphases && i < AP_N; i++)
+  {
+    n[i] = counts.n[i];
+    bytes[i] = counts.bytes[i];
+  }
+  return 1;
+}
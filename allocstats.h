@@ -0,0 +1,33 @@
+/* Copyright 2017 PrismTech Limited
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#ifndef __ospli_osplo__allocstats__
+#define __ospli_osplo__allocstats__
+
+/* Interface between the tools and liballocstats.so, which, when
+   preloaded, counts the allocations and the requested bytes per thread,
+   attributed to the phase set last by that thread */
+enum alloc_phase {
+  AP_OTHER,
+  AP_WRITE,
+  AP_TAKE,
+  AP_PRINT,
+  AP_PARSE
+};
+#define AP_N 5
+
+/* exported by liballocstats.so, looked up by common.c */
+int allocstats_setphase (int phase);
+int allocstats_get (unsigned long long *n, unsigned long long *bytes, int nphases);
+
+#endif
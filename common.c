@@ -15,6 +15,7 @@
 #include <time.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -22,6 +23,13 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#if __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "dds_dcps.h"
 #include "testtype.h"
@@ -89,57 +97,465 @@ void nowll_as_ddstime (DDS_Time_t *t)
   t->nanosec = (DDS_unsigned_long) ost.tv_nsec;
 }
 
-void bindelta (unsigned long long *bins, unsigned long long d, unsigned repeat)
+/* Interval timing: nowmono returns nanoseconds on a clock that is not
+   affected by adjustments of the wall clock, using the time-stamp counter
+   when it is invariant and its rate can be calibrated at start-up, else
+   the (raw, if available) monotonic clock of the OS.  The epoch is
+   arbitrary, so the values are meaningful only as differences, and DDS
+   time (nowll) remains the only choice where source timestamps are
+   involved. */
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#define HAVE_TSC 1
+#include <cpuid.h>
+static double tsc_scale = 0.0; /* ns per tick, 0 if not using the TSC */
+static unsigned long long tsc_base, tsc_base_ns;
+#else
+#define HAVE_TSC 0
+#endif
+
+static unsigned long long clock_mono_ns (void)
+{
+#if defined CLOCK_MONOTONIC_RAW || defined CLOCK_MONOTONIC
+  struct timespec ts;
+#if defined CLOCK_MONOTONIC_RAW
+  clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+#else
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+#endif
+  return (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
+#elif defined __sun
+  return (unsigned long long) gethrtime ();
+#else
+  return nowll ();
+#endif
+}
+
+#if HAVE_TSC
+static int tsc_invariant (void)
+{
+  unsigned a, b, c, d;
+  if (!__get_cpuid (0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+    return 0;
+  if (!__get_cpuid (0x80000007, &a, &b, &c, &d))
+    return 0;
+  return (d & (1u << 8)) != 0;
+}
+#endif
+
+void clock_init (void)
+{
+  /* calibrates the TSC against the OS monotonic clock over a short
+     interval, then checks the calibrated TSC against the wall clock over
+     a second one: if they disagree by more than 1%, something is
+     adjusting the wall clock or the TSC is not what it claims to be, and
+     the TSC is not used */
+#if HAVE_TSC
+  const struct timespec delay = { 0, 20000000 };
+  unsigned long long m0, m1, c0, c1, c2, w1, w2;
+  double scale, dw;
+  if (tsc_scale > 0 || !tsc_invariant ())
+    return;
+  m0 = clock_mono_ns ();
+  c0 = __builtin_ia32_rdtsc ();
+  nanosleep (&delay, NULL);
+  m1 = clock_mono_ns ();
+  c1 = __builtin_ia32_rdtsc ();
+  w1 = nowll ();
+  nanosleep (&delay, NULL);
+  c2 = __builtin_ia32_rdtsc ();
+  w2 = nowll ();
+  if (c1 <= c0 || m1 <= m0 || c2 <= c1)
+    return;
+  scale = (double) (m1 - m0) / (double) (c1 - c0);
+  dw = (double) (w2 - w1) - (double) (c2 - c1) * scale;
+  if (dw < 0)
+    dw = -dw;
+  if (dw > 0.01 * (double) (w2 - w1))
+  {
+    fprintf (stderr, "%s: TSC disagrees with wall clock, using OS monotonic clock\n", saved_argv0 ? saved_argv0 : "clock_init");
+    return;
+  }
+  tsc_base = c1;
+  tsc_base_ns = m1;
+  tsc_scale = scale;
+#endif
+}
+
+unsigned long long nowmono (void)
+{
+#if HAVE_TSC
+  if (tsc_scale > 0)
+    return tsc_base_ns + (unsigned long long) ((double) (__builtin_ia32_rdtsc () - tsc_base) * tsc_scale);
+#endif
+  return clock_mono_ns ();
+}
+
+void rusage_sample (struct rusage_sample *s)
+{
+  struct rusage ru;
+#if defined CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  s->cpu_ns = (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
+#endif
+#if defined RUSAGE_THREAD
+  getrusage (RUSAGE_THREAD, &ru);
+  s->nvcsw = (unsigned long long) ru.ru_nvcsw;
+  s->nivcsw = (unsigned long long) ru.ru_nivcsw;
+#endif
+  getrusage (RUSAGE_SELF, &ru);
+  s->proc_cpu_ns =
+    ((unsigned long long) ru.ru_utime.tv_sec + (unsigned long long) ru.ru_stime.tv_sec) * 1000000000ull +
+    ((unsigned long long) ru.ru_utime.tv_usec + (unsigned long long) ru.ru_stime.tv_usec) * 1000ull;
+#if ! defined CLOCK_THREAD_CPUTIME_ID
+  s->cpu_ns = s->proc_cpu_ns;
+#endif
+#if ! defined RUSAGE_THREAD
+  s->nvcsw = (unsigned long long) ru.ru_nvcsw;
+  s->nivcsw = (unsigned long long) ru.ru_nivcsw;
+#endif
+#if __APPLE__
+  s->maxrss_kb = (unsigned long long) ru.ru_maxrss / 1024;
+#else
+  s->maxrss_kb = (unsigned long long) ru.ru_maxrss;
+#endif
+  s->rss_kb = s->maxrss_kb;
+#if __linux__
+  {
+    /* second field is the resident set size in pages */
+    FILE *fp;
+    unsigned long long size, resident;
+    if ((fp = fopen ("/proc/self/statm", "r")) != NULL)
+    {
+      if (fscanf (fp, "%llu %llu", &size, &resident) == 2)
+        s->rss_kb = resident * (unsigned long long) sysconf (_SC_PAGESIZE) / 1024;
+      fclose (fp);
+    }
+  }
+#endif
+}
+
+const char *perfctrs_names[PERFCTRS_N] = {
+  "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+struct perfctrs {
+  int fd[PERFCTRS_N]; /* fd[0] is the group leader, -1 if unavailable */
+  unsigned pos[PERFCTRS_N]; /* position in the group's read buffer */
+  unsigned n;
+};
+
+#if __linux__
+static int perfctrs_open1 (unsigned long long config, int group, int exclude_kernel)
 {
-  int bin = 0;
-  while (d)
+  struct perf_event_attr attr;
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = (group == -1);
+  attr.exclude_kernel = (unsigned) exclude_kernel;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int) syscall (__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+struct perfctrs *perfctrs_new (void)
+{
+#if __linux__
+  /* kernel time is included when allowed, with perf_event_paranoid = 2
+     only user space can be counted */
+  static const unsigned long long config[PERFCTRS_N] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  struct perfctrs *pc;
+  int exclude_kernel = 0, fd, i;
+  if ((fd = perfctrs_open1 (config[0], -1, exclude_kernel)) == -1 && (errno == EACCES || errno == EPERM))
+    fd = perfctrs_open1 (config[0], -1, exclude_kernel = 1);
+  if (fd == -1)
+    return NULL;
+  pc = malloc (sizeof (*pc));
+  pc->fd[0] = fd;
+  pc->pos[0] = 0;
+  pc->n = 1;
+  for (i = 1; i < PERFCTRS_N; i++)
   {
-    bin++;
-    d >>= 1;
+    if ((pc->fd[i] = perfctrs_open1 (config[i], pc->fd[0], exclude_kernel)) != -1)
+      pc->pos[i] = pc->n++;
   }
-  bins[bin] += repeat;
+  return pc;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+void perfctrs_free (struct perfctrs *pc)
+{
+  int i;
+  if (pc == NULL)
+    return;
+  for (i = 0; i < PERFCTRS_N; i++)
+    if (pc->fd[i] != -1)
+      close (pc->fd[i]);
+  free (pc);
+}
+
+void perfctrs_start (struct perfctrs *pc)
+{
+#if __linux__
+  if (pc)
+    (void) ioctl (pc->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void perfctrs_stop (struct perfctrs *pc)
+{
+#if __linux__
+  if (pc)
+    (void) ioctl (pc->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+int perfctrs_read (struct perfctrs *pc, unsigned long long v[PERFCTRS_N])
+{
+  /* nr, time enabled, time running, values; the values are scaled up
+     if the kernel had to multiplex the counters */
+  uint64_t buf[3 + PERFCTRS_N];
+  double scale;
+  int i;
+  for (i = 0; i < PERFCTRS_N; i++)
+    v[i] = PERFCTRS_NA;
+  if (pc == NULL || read (pc->fd[0], buf, sizeof (buf)) < (ssize_t) (3 * sizeof (buf[0])) || buf[0] != pc->n)
+    return -1;
+  if (buf[2] > 0)
+    scale = (double) buf[1] / (double) buf[2];
+  else if (buf[1] == 0)
+    scale = 1.0; /* never enabled, all counts are 0 */
+  else
+    return -1; /* enabled but never got a hardware counter */
+  for (i = 0; i < PERFCTRS_N; i++)
+    if (pc->fd[i] != -1)
+      v[i] = (unsigned long long) ((double) buf[3 + pc->pos[i]] * scale);
+  return 0;
+}
+
+const char *alloc_phase_names[AP_N] = {
+  "other", "write", "take", "print", "parse"
+};
+
+static int (*allocstats_setphase_fn) (int phase);
+static int (*allocstats_get_fn) (unsigned long long *n, unsigned long long *bytes, int nphases);
+
+static void alloc_init (void)
+{
+  allocstats_setphase_fn = (int (*) (int)) dlsym (RTLD_DEFAULT, "allocstats_setphase");
+  allocstats_get_fn = (int (*) (unsigned long long *, unsigned long long *, int)) dlsym (RTLD_DEFAULT, "allocstats_get");
+}
+
+enum alloc_phase alloc_phase_set (enum alloc_phase phase)
+{
+  if (allocstats_setphase_fn == 0)
+    return AP_OTHER;
+  return (enum alloc_phase) allocstats_setphase_fn ((int) phase);
+}
+
+int alloc_counts_get (struct alloc_counts *c)
+{
+  memset (c, 0, sizeof (*c));
+  if (allocstats_get_fn == 0)
+    return 0;
+  return allocstats_get_fn (c->n, c->bytes, AP_N);
+}
+
+struct trace_event {
+  unsigned long long t0, t1;
+  unsigned kind, arg;
+};
+
+struct trace_ring {
+  struct trace_ring *next;
+  unsigned tid;
+  char name[64];
+  unsigned count[TK_N]; /* for sampling every trace_every-th */
+  unsigned long long n; /* events recorded, the last trace_size kept */
+  struct trace_event ev[];
+};
+
+static const char *trace_names[TK_N] = { "write", "wait", "take", "print", "sleep" };
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings;
+static __thread struct trace_ring *trace_self;
+static char *trace_file;
+static unsigned trace_every, trace_size, trace_ntids;
+static unsigned long long trace_t0;
+
+int trace_init (const char *arg)
+{
+  const char *colon = strchr (arg, ':');
+  unsigned every = 1, size = 65536;
+  int pos = 0;
+  if (colon && !((sscanf (colon + 1, "%u%n", &every, &pos) == 1 && colon[1 + pos] == 0) ||
+                 (sscanf (colon + 1, "%u:%u%n", &every, &size, &pos) == 2 && colon[1 + pos] == 0)))
+    return 0;
+  if (colon == arg || every == 0 || size == 0)
+    return 0;
+  free (trace_file);
+  trace_file = colon ? strndup (arg, (size_t) (colon - arg)) : strdup (arg);
+  trace_size = size;
+  trace_t0 = nowmono ();
+  trace_every = every;
+  return 1;
+}
+
+static struct trace_ring *trace_ring_self (void)
+{
+  struct trace_ring *r;
+  if ((r = trace_self) != NULL)
+    return r;
+  r = calloc (1, sizeof (*r) + trace_size * sizeof (r->ev[0]));
+  pthread_mutex_lock (&trace_lock);
+  r->tid = ++trace_ntids;
+  snprintf (r->name, sizeof (r->name), "thread %u", r->tid);
+  r->next = trace_rings;
+  trace_rings = r;
+  pthread_mutex_unlock (&trace_lock);
+  return trace_self = r;
+}
+
+void trace_thread (const char *name)
+{
+  if (trace_every)
+    snprintf (trace_ring_self ()->name, sizeof (trace_self->name), "%s", name);
+}
+
+unsigned long long trace_begin (enum trace_kind kind)
+{
+  struct trace_ring *r;
+  if (trace_every == 0)
+    return 0;
+  r = trace_ring_self ();
+  if (r->count[kind]++ % trace_every != 0)
+    return 0;
+  return nowmono ();
 }
 
-void binprint (unsigned long long *bins, unsigned long long telapsed)
+void trace_end (enum trace_kind kind, unsigned long long t0, unsigned arg)
 {
-  unsigned long long n;
-  unsigned i, minbin = BINS_LENGTH- 1, maxbin = 0;
-  n = 0;
-  for (i = 0; i < BINS_LENGTH; i++)
+  struct trace_event *e;
+  if (t0 == 0)
+    return;
+  e = &trace_self->ev[trace_self->n++ % trace_size];
+  e->t0 = t0;
+  e->t1 = nowmono ();
+  e->kind = (unsigned) kind;
+  e->arg = arg;
+}
+
+static void trace_putname (FILE *fp, const char *s)
+{
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\')
+      fprintf (fp, "\\%c", *s);
+    else if ((unsigned char) *s >= ' ')
+      fputc (*s, fp);
+}
+
+void trace_fini (void)
+{
+  /* the threads must have stopped tracing; timestamps in the output are
+     in microseconds since trace_init, durations likewise */
+  const int pid = (int) getpid ();
+  struct trace_ring *r;
+  const char *sep = "";
+  FILE *fp;
+  if (trace_every == 0)
+    return;
+  trace_every = 0;
+  if ((fp = fopen (trace_file, "w")) == NULL)
+    fprintf (stderr, "%s: can't open for writing\n", trace_file);
+  else
   {
-    n += bins[i];
-    if (bins[i] && i < minbin)
-      minbin = i;
-    if (bins[i] && i > maxbin)
-      maxbin = i;
+    fprintf (fp, "{\"traceEvents\":[");
+    for (r = trace_rings; r; r = r->next)
+    {
+      unsigned long long i = (r->n > trace_size) ? r->n - trace_size : 0;
+      fprintf (fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"", sep, pid, r->tid);
+      trace_putname (fp, r->name);
+      fprintf (fp, "\"}}");
+      sep = ",";
+      for (; i < r->n; i++)
+      {
+        const struct trace_event *e = &r->ev[i % trace_size];
+        fprintf (fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%u}}",
+                 trace_names[e->kind], pid, r->tid, (double) (e->t0 - trace_t0) / 1e3, (double) (e->t1 - e->t0) / 1e3, e->arg);
+      }
+    }
+    fprintf (fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose (fp);
   }
-  printf ("< 2**n | %llu in %.06fs avg %.1f/s\n", n, telapsed * 1e-9, n / (telapsed * 1e-9));
-  for (i = minbin; i <= maxbin; i++)
+  while ((r = trace_rings) != NULL)
   {
-    static const char ats[] = "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@";
-    double pct = 100.0 * (double) bins[i] / n;
-    int nats = (int) ((pct / 100.0) * (sizeof (ats) - 1));
-    printf ("%2d: %6.2f%% %*.*s\n", i, pct, nats, nats, ats);
+    trace_rings = r->next;
+    free (r);
   }
+  free (trace_file);
+  trace_file = NULL;
 }
 
+/* Log-linear histogram: values below HIST_SUB are counted exactly, above
+   that each power-of-two range [2^e,2^(e+1)) is split into HIST_SUB
+   equal-width bins, bounding the relative error to 1/HIST_SUB over the
+   full 64-bit range */
+#define HIST_SUBBITS 7
+#define HIST_SUB (1u << HIST_SUBBITS)
+#define HIST_NBINS ((65 - HIST_SUBBITS) * HIST_SUB)
+
 struct hist {
-  unsigned nbins;
-  uint64_t binwidth;
-  uint64_t bin0; /* bins are [bin0,bin0+binwidth),[bin0+binwidth,bin0+2*binwidth) */
-  uint64_t binN; /* bin0 + nbins*binwidth */
   uint64_t min, max; /* min and max observed since last reset */
-  uint64_t under, over; /* < bin0, >= binN */
-  uint64_t bins[];
+  uint64_t count, sum;
+  uint64_t bins[HIST_NBINS];
 };
 
-struct hist *hist_new (unsigned nbins, uint64_t binwidth, uint64_t bin0)
+static unsigned hist_msb (uint64_t x)
+{
+#if defined __GNUC__
+  return 63 - (unsigned) __builtin_clzll (x);
+#else
+  unsigned e = 0;
+  if (x >> 32) { e += 32; x >>= 32; }
+  if (x >> 16) { e += 16; x >>= 16; }
+  if (x >> 8) { e += 8; x >>= 8; }
+  if (x >> 4) { e += 4; x >>= 4; }
+  if (x >> 2) { e += 2; x >>= 2; }
+  if (x >> 1) { e += 1; }
+  return e;
+#endif
+}
+
+static unsigned hist_index (uint64_t x)
+{
+  unsigned e;
+  if (x < HIST_SUB)
+    return (unsigned) x;
+  e = hist_msb (x);
+  return ((e - HIST_SUBBITS + 1) << HIST_SUBBITS) + (unsigned) ((x >> (e - HIST_SUBBITS)) - HIST_SUB);
+}
+
+static uint64_t hist_bin_upper (unsigned i)
+{
+  /* largest value mapping to bin i */
+  const unsigned b = i >> HIST_SUBBITS, sub = i & (HIST_SUB - 1);
+  if (b == 0)
+    return sub;
+  return (((uint64_t) (HIST_SUB + sub) + 1) << (b - 1)) - 1;
+}
+
+struct hist *hist_new (void)
 {
-  struct hist *h = malloc (sizeof (*h) + nbins * sizeof (*h->bins));
-  h->nbins = nbins;
-  h->binwidth = binwidth;
-  h->bin0 = bin0;
-  h->binN = h->bin0 + h->nbins * h->binwidth;
+  struct hist *h = malloc (sizeof (*h));
   hist_reset (h);
   return h;
 }
@@ -149,18 +565,13 @@ void hist_free (struct hist *h)
   free (h);
 }
 
-void hist_reset_minmax (struct hist *h)
+void hist_reset (struct hist *h)
 {
   h->min = UINT64_MAX;
   h->max = 0;
-}
-
-void hist_reset (struct hist *h)
-{
-  hist_reset_minmax (h);
-  h->under = 0;
-  h->over = 0;
-  memset (h->bins, 0, h->nbins * sizeof (*h->bins));
+  h->count = 0;
+  h->sum = 0;
+  memset (h->bins, 0, sizeof (h->bins));
 }
 
 void hist_record (struct hist *h, uint64_t x, unsigned weight)
@@ -169,12 +580,145 @@ void hist_record (struct hist *h, uint64_t x, unsigned weight)
     h->min = x;
   if (x > h->max)
     h->max = x;
-  if (x < h->bin0)
-    h->under += weight;
-  else if (x >= h->binN)
-    h->over += weight;
-  else
-    h->bins[(x - h->bin0) / h->binwidth] += weight;
+  h->count += weight;
+  h->sum += x * weight;
+  h->bins[hist_index (x)] += weight;
+}
+
+void hist_merge (struct hist *h, const struct hist *x)
+{
+  unsigned i;
+  if (x->count == 0)
+    return;
+  if (x->min < h->min)
+    h->min = x->min;
+  if (x->max > h->max)
+    h->max = x->max;
+  h->count += x->count;
+  h->sum += x->sum;
+  for (i = 0; i < HIST_NBINS; i++)
+    h->bins[i] += x->bins[i];
+}
+
+uint64_t hist_count (const struct hist *h)
+{
+  return h->count;
+}
+
+double hist_mean (const struct hist *h)
+{
+  return (h->count == 0) ? 0.0 : (double) h->sum / (double) h->count;
+}
+
+uint64_t hist_quantile (const struct hist *h, double q)
+{
+  /* the smallest bin upper bound such that a fraction q of the values
+     is less or equal, so never under-estimating, within [min,max] */
+  uint64_t rank, cum = 0, v = 0;
+  unsigned i;
+  if (h->count == 0)
+    return 0;
+  if (q <= 0)
+    return h->min;
+  if (q >= 1)
+    return h->max;
+  rank = (uint64_t) (q * (double) h->count);
+  if ((double) rank < q * (double) h->count || rank == 0)
+    rank++;
+  for (i = 0; i < HIST_NBINS; i++)
+  {
+    if ((cum += h->bins[i]) >= rank)
+    {
+      v = hist_bin_upper (i);
+      break;
+    }
+  }
+  if (v > h->max)
+    v = h->max;
+  if (v < h->min)
+    v = h->min;
+  return v;
+}
+
+/* Serialized form: a version byte, then count, sum, min and max and
+   pairs of (number of skipped empty bins, bin count) for the non-empty
+   bins, all as LEB128 varints */
+static size_t hist_put (unsigned char *buf, size_t size, size_t pos, uint64_t x)
+{
+  do {
+    const unsigned char b = (unsigned char) ((x & 0x7f) | ((x >= 0x80) ? 0x80 : 0));
+    if (pos < size)
+      buf[pos] = b;
+    pos++;
+    x >>= 7;
+  } while (x);
+  return pos;
+}
+
+static int hist_get (const unsigned char *buf, size_t size, size_t *pos, uint64_t *x)
+{
+  unsigned shift = 0;
+  *x = 0;
+  while (*pos < size && shift < 64)
+  {
+    const unsigned char b = buf[(*pos)++];
+    *x |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+size_t hist_serialize (const struct hist *h, void *vbuf, size_t size)
+{
+  /* returns the number of bytes required, as snprintf */
+  unsigned char *buf = vbuf;
+  size_t pos = 0;
+  unsigned i, last = 0;
+  if (size > 0)
+    buf[0] = HIST_SUBBITS;
+  pos = 1;
+  pos = hist_put (buf, size, pos, h->count);
+  pos = hist_put (buf, size, pos, h->sum);
+  pos = hist_put (buf, size, pos, h->min);
+  pos = hist_put (buf, size, pos, h->max);
+  for (i = 0; i < HIST_NBINS; i++)
+  {
+    if (h->bins[i])
+    {
+      pos = hist_put (buf, size, pos, i - last);
+      pos = hist_put (buf, size, pos, h->bins[i]);
+      last = i;
+    }
+  }
+  return pos;
+}
+
+struct hist *hist_deserialize (const void *vbuf, size_t size)
+{
+  const unsigned char *buf = vbuf;
+  struct hist *h;
+  size_t pos = 1;
+  uint64_t idx = 0, gap, n;
+  if (size == 0 || buf[0] != HIST_SUBBITS)
+    return NULL;
+  h = hist_new ();
+  if (!hist_get (buf, size, &pos, &h->count) || !hist_get (buf, size, &pos, &h->sum) ||
+      !hist_get (buf, size, &pos, &h->min) || !hist_get (buf, size, &pos, &h->max))
+    goto err;
+  while (pos < size)
+  {
+    if (!hist_get (buf, size, &pos, &gap) || !hist_get (buf, size, &pos, &n))
+      goto err;
+    if ((idx += gap) >= HIST_NBINS)
+      goto err;
+    h->bins[idx] = n;
+  }
+  return h;
+ err:
+  hist_free (h);
+  return NULL;
 }
 
 static void xsnprintf (char *buf, size_t bufsz, size_t *p, const char *fmt, ...)
@@ -190,40 +734,50 @@ static void xsnprintf (char *buf, size_t bufsz, size_t *p, const char *fmt, ...)
   }
 }
 
-void hist_print (struct hist *h, uint64_t dt, int reset)
+static void xsnprintf_time (char *buf, size_t bufsz, size_t *p, uint64_t x)
 {
-  char l[h->nbins + 200];
-  char hist[h->nbins+1];
-  double dt_s = dt / 1e9, avg;
-  uint64_t peak = 0, cnt = h->under + h->over;
+  if (x < 1000)
+    xsnprintf (buf, bufsz, p, "%3"PRIu64"n", x);
+  else if (x + 500 < 1000000)
+    xsnprintf (buf, bufsz, p, "%3"PRIu64"u", (x + 500) / 1000);
+  else if (x + 500000 < 1000000000)
+    xsnprintf (buf, bufsz, p, "%3"PRIu64"m", (x + 500000) / 1000000);
+  else
+    xsnprintf (buf, bufsz, p, "%3"PRIu64"s", (x + 500000000) / 1000000000);
+}
+
+void hist_format (char *buf, size_t size, const struct hist *h)
+{
+  static const struct { const char *name; double q; } qs[] = {
+    { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 }, { "p99.99", 0.9999 }
+  };
   size_t p = 0;
-  hist[h->nbins] = 0;
-  for (unsigned i = 0; i < h->nbins; i++)
+  unsigned i;
+  if (size > 0)
+    buf[0] = 0;
+  if (h->count == 0)
   {
-    cnt += h->bins[i];
-    if (h->bins[i] > peak)
-      peak = h->bins[i];
+    xsnprintf (buf, size, &p, "min inf max inf");
+    return;
   }
-
-  const uint64_t p1 = peak / 100;
-  const uint64_t p10 = peak / 10;
-  const uint64_t p20 = 1 * peak / 5;
-  const uint64_t p40 = 2 * peak / 5;
-  const uint64_t p60 = 3 * peak / 5;
-  const uint64_t p80 = 4 * peak / 5;
-  for (unsigned i = 0; i < h->nbins; i++)
+  xsnprintf (buf, size, &p, "min ");
+  xsnprintf_time (buf, size, &p, h->min);
+  for (i = 0; i < sizeof (qs) / sizeof (qs[0]); i++)
   {
-    if (h->bins[i] == 0) hist[i] = ' ';
-    else if (h->bins[i] <= p1) hist[i] = '.';
-    else if (h->bins[i] <= p10) hist[i] = '_';
-    else if (h->bins[i] <= p20) hist[i] = '-';
-    else if (h->bins[i] <= p40) hist[i] = '=';
-    else if (h->bins[i] <= p60) hist[i] = 'x';
-    else if (h->bins[i] <= p80) hist[i] = 'X';
-    else hist[i] = '@';
+    xsnprintf (buf, size, &p, " %s ", qs[i].name);
+    xsnprintf_time (buf, size, &p, hist_quantile (h, qs[i].q));
   }
+  xsnprintf (buf, size, &p, " max ");
+  xsnprintf_time (buf, size, &p, h->max);
+}
 
-  avg = cnt / dt_s;
+void hist_print (struct hist *h, uint64_t dt, int reset)
+{
+  char l[256];
+  double dt_s = dt / 1e9, avg;
+  size_t p = 0;
+
+  avg = h->count / dt_s;
   if (avg < 999.5)
     xsnprintf (l, sizeof(l), &p, "%5.3g", avg);
   else if (avg < 1e6)
@@ -232,47 +786,16 @@ void hist_print (struct hist *h, uint64_t dt, int reset)
     xsnprintf (l, sizeof(l), &p, "%4.3gM", avg / 1e6);
   xsnprintf (l, sizeof(l), &p, "/s (");
 
-  if (cnt < (uint64_t) 10e3)
-    xsnprintf (l, sizeof(l), &p, "%5"PRIu64" ", cnt);
-  else if (cnt < (uint64_t) 1e6)
-    xsnprintf (l, sizeof(l), &p, "%5.1fk", cnt / 1e3);
+  if (h->count < (uint64_t) 10e3)
+    xsnprintf (l, sizeof(l), &p, "%5"PRIu64" ", h->count);
+  else if (h->count < (uint64_t) 1e6)
+    xsnprintf (l, sizeof(l), &p, "%5.1fk", h->count / 1e3);
   else
-    xsnprintf (l, sizeof(l), &p, "%5.1fM", cnt / 1e6);
+    xsnprintf (l, sizeof(l), &p, "%5.1fM", h->count / 1e6);
 
   xsnprintf (l, sizeof(l), &p, " in %.1fs) ", dt_s);
-
-  if (h->min == UINT64_MAX)
-    xsnprintf (l, sizeof(l), &p, " inf ");
-  else if (h->min < 1000)
-    xsnprintf (l, sizeof(l), &p, "%3"PRIu64"n ", h->min);
-  else if (h->min + 500 < 1000000)
-    xsnprintf (l, sizeof(l), &p, "%3"PRIu64"u ", (h->min + 500) / 1000);
-  else if (h->min + 500000 < 1000000000)
-    xsnprintf (l, sizeof(l), &p, "%3"PRIu64"m ", (h->min + 500000) / 1000000);
-  else
-    xsnprintf (l, sizeof(l), &p, "%3"PRIu64"s ", (h->min + 500000000) / 1000000000);
-
-  if (h->bin0 > 0)
-  {
-    int pct = (cnt == 0) ? 0 : 100 * (int) ((h->under + cnt/2) / cnt);
-    xsnprintf (l, sizeof(l), &p, "%3d%% ", pct);
-  }
-
-  {
-    int pct = (cnt == 0) ? 0 : 100 * (int) ((h->over + cnt/2) / cnt);
-    xsnprintf (l, sizeof(l), &p, "|%s| %3d%%", hist, pct);
-  }
-
-  if (h->max < 1000)
-    xsnprintf (l, sizeof(l), &p, " %3"PRIu64"n", h->max);
-  else if (h->max + 500 < 1000000)
-    xsnprintf (l, sizeof(l), &p, " %3"PRIu64"u", (h->max + 500) / 1000);
-  else if (h->max + 500000 < 1000000000)
-    xsnprintf (l, sizeof(l), &p, " %3"PRIu64"m", (h->max + 500000) / 1000000);
-  else
-    xsnprintf (l, sizeof(l), &p, " %3"PRIu64"s", (h->max + 500000000) / 1000000000);
-
-  (void) p;
+  if (p < sizeof (l))
+    hist_format (l + p, sizeof (l) - p, h);
   puts (l);
   if (reset)
     hist_reset (h);
@@ -349,6 +872,8 @@ static void register_default_types (void)
 int common_init (const char *argv0)
 {
   save_argv0 (argv0);
+  clock_init ();
+  alloc_init ();
   if ((dpf = DDS_DomainParticipantFactory_get_instance ()) == NULL)
     error ("DDS_DomainParticipantFactory_get_instance\n");
   dp = DDS_DomainParticipantFactory_create_participant (dpf, DDS_DOMAIN_ID_DEFAULT, DDS_PARTICIPANT_QOS_DEFAULT, NULL, DDS_STATUS_MASK_NONE);
@@ -362,6 +887,8 @@ int common_init (const char *argv0)
 int common_init_domainid (const char *argv0, DDS_DomainId_t domainid)
 {
   save_argv0 (argv0);
+  clock_init ();
+  alloc_init ();
   if ((dpf = DDS_DomainParticipantFactory_get_instance ()) == NULL)
     error ("DDS_DomainParticipantFactory_get_instance\n");
   dp = DDS_DomainParticipantFactory_create_participant (dpf, domainid, DDS_PARTICIPANT_QOS_DEFAULT, NULL, DDS_STATUS_MASK_NONE);
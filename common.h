@@ -15,6 +15,7 @@
 #define COMMON_H
 
 #include "dds_dcps.h"
+#include "allocstats.h"
 
 extern DDS_DomainParticipantFactory dpf;
 extern DDS_DomainParticipant dp;
@@ -30,20 +31,81 @@ extern const char *qos_arg_usagestr;
 
 struct qos;
 
-#define BINS_LENGTH (8 * sizeof (unsigned long long) + 1)
-
 unsigned long long nowll (void);
 void nowll_as_ddstime (DDS_Time_t *t);
+/* Nanoseconds on a monotonic clock for measuring intervals, calibrated
+   by clock_init (called by common_init) */
+void clock_init (void);
+unsigned long long nowmono (void);
+
+/* Resource usage: CPU time and context switches of the calling thread
+   (of the process where the OS has no per-thread accounting), CPU time
+   of the process and its current and peak resident set size */
+struct rusage_sample {
+  unsigned long long cpu_ns, proc_cpu_ns;
+  unsigned long long nvcsw, nivcsw;
+  unsigned long long rss_kb, maxrss_kb;
+};
+void rusage_sample (struct rusage_sample *s);
+
+/* Hardware performance counters of the calling thread, counting only
+   between perfctrs_start and perfctrs_stop; perfctrs_new returns NULL
+   (with errno set) if the OS or the (virtual) machine doesn't provide
+   them, and perfctrs_read gives PERFCTRS_NA for the individual counters
+   that are unavailable */
+#define PERFCTRS_N 4
+#define PERFCTRS_NA (~0ull)
+extern const char *perfctrs_names[PERFCTRS_N];
+struct perfctrs;
+struct perfctrs *perfctrs_new (void);
+void perfctrs_free (struct perfctrs *pc);
+void perfctrs_start (struct perfctrs *pc);
+void perfctrs_stop (struct perfctrs *pc);
+int perfctrs_read (struct perfctrs *pc, unsigned long long v[PERFCTRS_N]);
+
+/* Allocation counts of the calling thread per phase, available only with
+   liballocstats.so preloaded (alloc_counts_get returns 0 otherwise);
+   alloc_phase_set returns the previous phase so that phases can nest */
+struct alloc_counts {
+  unsigned long long n[AP_N], bytes[AP_N];
+};
+extern const char *alloc_phase_names[AP_N];
+enum alloc_phase alloc_phase_set (enum alloc_phase phase);
+int alloc_counts_get (struct alloc_counts *c);
 
-void bindelta (unsigned long long *bins, unsigned long long d, unsigned repeat);
-void binprint (unsigned long long *bins, unsigned long long telapsed);
+/* Tracing of (every Nth) write, wait, take, print and sleep into
+   per-thread rings of the most recent events, written as Chrome
+   trace-event JSON by trace_fini; trace_init parses FILE[:N[:SIZE]] and
+   returns 0 if that fails.  trace_begin returns 0 when the event is not
+   traced, trace_end ignores those */
+enum trace_kind {
+  TK_WRITE,
+  TK_WAIT,
+  TK_TAKE,
+  TK_PRINT,
+  TK_SLEEP
+};
+#define TK_N 5
+int trace_init (const char *arg);
+void trace_thread (const char *name);
+unsigned long long trace_begin (enum trace_kind kind);
+void trace_end (enum trace_kind kind, unsigned long long t0, unsigned arg);
+void trace_fini (void);
 
+/* Log-linear histogram of (typically) nanosecond values with a bounded
+   relative error, per-thread instances can be combined with hist_merge */
 struct hist;
-struct hist *hist_new (unsigned nbins, uint64_t binwidth, uint64_t bin0);
+struct hist *hist_new (void);
 void hist_free (struct hist *h);
-void hist_reset_minmax (struct hist *h);
 void hist_reset (struct hist *h);
 void hist_record (struct hist *h, uint64_t x, unsigned weight);
+void hist_merge (struct hist *h, const struct hist *x);
+uint64_t hist_count (const struct hist *h);
+double hist_mean (const struct hist *h);
+uint64_t hist_quantile (const struct hist *h, double q);
+size_t hist_serialize (const struct hist *h, void *buf, size_t size);
+struct hist *hist_deserialize (const void *buf, size_t size);
+void hist_format (char *buf, size_t size, const struct hist *h);
 void hist_print (struct hist *h, uint64_t dt, int reset);
 
 void save_argv0 (const char *argv0);
@@ -7,13 +7,6 @@
 #include "common.h"
 #include "testtype.h"
 
-static int cmp_double (const void *va, const void *vb)
-{
-  const double *a = va;
-  const double *b = vb;
-  return (*a == *b) ? 0 : (*a < *b) ? -1 : 1;
-}
-
 int main (int argc, char **argv)
 {
   DDS_Topic topic;
@@ -24,6 +17,7 @@ int main (int argc, char **argv)
   JustSeq d;
   DDS_sequence_JustSeq *mseq = DDS_sequence_JustSeq__alloc ();
   DDS_SampleInfoSeq *iseq = DDS_SampleInfoSeq__alloc ();
+  struct hist *hwrite = hist_new (), *hread = hist_new ();
 
   (void) argc;
   common_init (argv[0]);
@@ -45,38 +39,34 @@ int main (int argc, char **argv)
     if (size)
       memset (d.baggage._buffer, 0, size);
 
-    double twrite[1001]; /* in us */
-    double tread[sizeof (twrite) / sizeof (twrite[0])];  /* in us */
-    const int rounds = (int) (sizeof (twrite) / sizeof (*twrite));
+    const int rounds = 1001;
+    hist_reset (hwrite);
+    hist_reset (hread);
     for (int k = 0; k < rounds; k++)
     {
-      DDS_Time_t twrite1;
-      DDS_DomainParticipant_get_current_time (dp, &twrite1);
+      const unsigned long long twrite1 = nowmono ();
       if (JustSeqDataWriter_write (writer, &d, DDS_HANDLE_NIL) != DDS_RETCODE_OK)
         abort ();
-      DDS_Time_t tread1;
-      DDS_DomainParticipant_get_current_time (dp, &tread1);
+      const unsigned long long tread1 = nowmono ();
       if (JustSeqDataReader_read (reader, mseq, iseq, 1, DDS_ANY_SAMPLE_STATE, DDS_ANY_VIEW_STATE, DDS_ANY_INSTANCE_STATE) != DDS_RETCODE_OK)
         abort ();
-      DDS_Time_t tdone;
-      DDS_DomainParticipant_get_current_time (dp, &tdone);
-      long long x = 1000000000;
-      tread[k] = ((x * tdone.sec + tdone.nanosec) - (x * tread1.sec + tread1.nanosec)) / 1e3;
-      twrite[k] = ((x * tread1.sec + tread1.nanosec) - (x * twrite1.sec + twrite1.nanosec)) / 1e3;
+      const unsigned long long tdone = nowmono ();
+      hist_record (hread, tdone - tread1, 1);
+      hist_record (hwrite, tread1 - twrite1, 1);
       JustSeqDataReader_return_loan (reader, mseq, iseq);
     }
 
     DDS_free (d.baggage._buffer);
 
-    qsort (twrite, rounds, sizeof (*twrite), cmp_double);
-    qsort (tread, rounds, sizeof (*tread), cmp_double);
-    assert (rounds >= 100); /* for 99% case */
     printf ("%7zu %5s %6.0f %6.0f %6.0f %6.0f | %4s %6.0f %6.0f %6.0f %6.0f\n",
             size,
-            "", twrite[0], twrite[rounds / 2], twrite[rounds - rounds / 100], twrite[rounds - 1],
-            "", tread[0], tread[rounds / 2], tread[rounds - rounds / 100], tread[rounds - 1]);
+            "", hist_quantile (hwrite, 0) / 1e3, hist_quantile (hwrite, 0.5) / 1e3, hist_quantile (hwrite, 0.99) / 1e3, hist_quantile (hwrite, 1) / 1e3,
+            "", hist_quantile (hread, 0) / 1e3, hist_quantile (hread, 0.5) / 1e3, hist_quantile (hread, 0.99) / 1e3, hist_quantile (hread, 1) / 1e3);
   }
 
+  hist_free (hwrite);
+  hist_free (hread);
+
   common_fini ();
   return 0;
 }
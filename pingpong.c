@@ -104,6 +104,11 @@ Ping-specific options:\n\
   -z SIZE   ping payload size in bytes\n\
   -Z SIZE   random ping payload sizes, but at most SIZE bytes\n\
 \n\
+Tracing:\n\
+  -t FILE[:N[:M]]  trace every Nth write, wait, take and sleep of each\n\
+            side (default: 1), keeping the last M of each (default:\n\
+            65536), written to FILE as Chrome trace-event JSON on exit\n\
+\n\
 %s\
 \n\
 Partitions used are PING_WR_PART and PONG_WR_PART: ping publishes in\n\
@@ -122,27 +127,20 @@ If SIDE = both, only PING_WR_PART is used.\n\
 #define MAX_PONGS 16
 
 struct latency_admin {
-  double dtsum, dtmin;
-  int count;
+  struct hist *hist; /* since last print */
   uint32_t seq;
 };
 
 struct pings_pong_admin {
   DDS_InstanceHandle_t pubhandles[MAX_PONGS];
   struct latency_admin lats[MAX_PONGS];
+  struct hist *total; /* all pongs, whole run */
   unsigned long long tprint;
 };
 
-static void reinit_latency_admin (struct latency_admin *la)
-{
-  la->dtsum = 0;
-  la->dtmin = 1e10;
-  la->count = 0;
-}
-
 static void init_latency_admin (struct latency_admin *la)
 {
-  reinit_latency_admin (la);
+  hist_reset (la->hist);
   la->seq = 0;
 }
 
@@ -152,11 +150,51 @@ static void init_pings_pong_admin (struct pings_pong_admin *ppa)
   for (i = 0; i < MAX_PONGS; i++)
   {
     ppa->pubhandles[i] = DDS_HANDLE_NIL;
+    ppa->lats[i].hist = hist_new ();
     init_latency_admin(&ppa->lats[i]);
   }
+  ppa->total = hist_new ();
   ppa->tprint = 0;
 }
 
+#ifndef NDEBUG
+static int hist_roundtrip_ok (const struct hist *h)
+{
+  /* serializing the result of deserializing H must give the same bytes */
+  const size_t n = hist_serialize (h, NULL, 0);
+  unsigned char *buf0 = malloc (n), *buf1 = malloc (n);
+  struct hist *h1;
+  int ok = 0;
+  hist_serialize (h, buf0, n);
+  if ((h1 = hist_deserialize (buf0, n)) != NULL)
+  {
+    ok = (hist_serialize (h1, buf1, n) == n && memcmp (buf0, buf1, n) == 0);
+    hist_free (h1);
+  }
+  free (buf0);
+  free (buf1);
+  return ok;
+}
+#endif
+
+static void fini_pings_pong_admin (struct pings_pong_admin *ppa)
+{
+  int i;
+  for (i = 0; i < MAX_PONGS; i++)
+  {
+    hist_merge (ppa->total, ppa->lats[i].hist);
+    hist_free (ppa->lats[i].hist);
+  }
+  if (hist_count (ppa->total) > 0)
+  {
+    char l[256];
+    hist_format (l, sizeof (l), ppa->total);
+    printf ("all:  %" PRIu64 " rtts %g us avg %s\n", hist_count (ppa->total), hist_mean (ppa->total) / 1e3, l);
+    assert (hist_roundtrip_ok (ppa->total));
+  }
+  hist_free (ppa->total);
+}
+
 static void instancehandle_to_id (uint32_t *systemId, uint32_t *localId, DDS_InstanceHandle_t h)
 {
   /* Undocumented and unsupported trick */
@@ -168,7 +206,7 @@ static void instancehandle_to_id (uint32_t *systemId, uint32_t *localId, DDS_Ins
 
 static void print_latencies (struct pings_pong_admin *ppa)
 {
-  unsigned long long t = nowll ();
+  unsigned long long t = nowmono ();
   if (ppa->tprint == 0)
     ppa->tprint = t;
   else if (t >= ppa->tprint + 1000000000)
@@ -180,22 +218,22 @@ static void print_latencies (struct pings_pong_admin *ppa)
       {
         struct latency_admin *la = &ppa->lats[i];
         uint32_t systemId, localId;
+        char l[256];
         instancehandle_to_id (&systemId, &localId, ppa->pubhandles[i]);
-        printf ("%" PRIx32 ":%" PRIx32 ":  %d rtts %g us avg %g us min\n", systemId, localId, la->count, 1e6 * la->dtsum / la->count, la->dtmin * 1e6);
-        reinit_latency_admin (la);
+        hist_format (l, sizeof (l), la->hist);
+        printf ("%" PRIx32 ":%" PRIx32 ":  %" PRIu64 " rtts %g us avg %s\n", systemId, localId, hist_count (la->hist), hist_mean (la->hist) / 1e3, l);
+        hist_merge (ppa->total, la->hist);
+        hist_reset (la->hist);
       }
   }
 }
 
-static void record_latency (struct latency_admin *la, unsigned sz, double dt, uint32_t seq)
+static void record_latency (struct latency_admin *la, unsigned sz, unsigned long long dt, uint32_t seq)
 {
   if (outfp)
-    fprintf (outfp, "%u %.9e\n", sz, dt);
+    fprintf (outfp, "%u %.9e\n", sz, dt / 1e9);
 
-  if (dt < la->dtmin)
-    la->dtmin = dt;
-  la->dtsum += dt;
-  la->count++;
+  hist_record (la->hist, dt, 1);
   la->seq = seq;
 }
 
@@ -210,11 +248,15 @@ static DDS_ReturnCode_t ping_once (KeyedSeqDataWriter wr, KeyedSeq *d0, DDS_Inst
 {
   DDS_Time_t tstamp;
   DDS_ReturnCode_t result;
+  unsigned long long ttr;
   if (randomize_payloadsize)
     d0->baggage._length = randomsize (d0->baggage._maximum);
   d0->seq++;
   nowll_as_ddstime (&tstamp);
-  if ((result = KeyedSeqDataWriter_write_w_timestamp (wr, d0, handle, &tstamp)) != DDS_RETCODE_OK)
+  ttr = trace_begin (TK_WRITE);
+  result = KeyedSeqDataWriter_write_w_timestamp (wr, d0, handle, &tstamp);
+  trace_end (TK_WRITE, ttr, 1);
+  if (result != DDS_RETCODE_OK)
     fprintf (stderr, "write: error %d (%s)\n", (int) result, dds_strerror (result));
   return result;
 }
@@ -253,6 +295,7 @@ static int lookup_pong (struct pings_pong_admin *ppa, DDS_InstanceHandle_t pubha
   if (newidx == -1)
     error ("max pongs reached\n");
   ppa->pubhandles[newidx] = pubhandle;
+  hist_merge (ppa->total, ppa->lats[newidx].hist);
   init_latency_admin (&ppa->lats[newidx]);
   return newidx;
 }
@@ -298,13 +341,16 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
     case SIDE_PING:
       partwr = ping_wr_part;
       partrd = pong_wr_part;
+      trace_thread ("ping");
       break;
     case SIDE_PONG:
       partwr = pong_wr_part;
       partrd = ping_wr_part;
+      trace_thread ("pong");
       break;
     case SIDE_BOTH:
       partwr = partrd = ping_wr_part;
+      trace_thread ("both");
       break;
   }
   p = new_publisher (NULL, 1, &partwr);
@@ -382,9 +428,13 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
 
     while (!terminate)
     {
+      unsigned long long ttr;
       unsigned gi;
 
-      if ((result = DDS_WaitSet_wait (ws, glist, &timeout)) != DDS_RETCODE_OK && result != DDS_RETCODE_TIMEOUT) {
+      ttr = trace_begin (TK_WAIT);
+      result = DDS_WaitSet_wait (ws, glist, &timeout);
+      trace_end (TK_WAIT, ttr, (unsigned) glist->_length);
+      if (result != DDS_RETCODE_OK && result != DDS_RETCODE_TIMEOUT) {
         fprintf (stderr, "%s: wait: error %d (%s)\n", argv0, (int) result, dds_strerror (result));
         goto out;
       }
@@ -408,7 +458,9 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
 
         if (glist->_buffer[gi] == cond)
         {
+          ttr = trace_begin (TK_TAKE);
           result = KeyedSeqDataReader_take (rd, mseq, iseq, DDS_LENGTH_UNLIMITED, DDS_ANY_SAMPLE_STATE, DDS_ANY_VIEW_STATE, DDS_ANY_INSTANCE_STATE);
+          trace_end (TK_TAKE, ttr, (result == DDS_RETCODE_OK) ? (unsigned) iseq->_length : 0);
           if (result != DDS_RETCODE_OK)
           {
             fprintf (stderr, "%s: take: error %d (%s)\n", argv0, (int) result, dds_strerror (result));
@@ -431,7 +483,9 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
               if (d1->seq != last_seq + 1)
                 printf ("seq input: %u expected: %u\n", (unsigned) d1->seq, (unsigned) (last_seq + 1));
               last_seq = d1->seq;
+              ttr = trace_begin (TK_WRITE);
               result = KeyedSeqDataWriter_write_w_timestamp (wr, d1, handle, &iseq->_buffer[i].source_timestamp);
+              trace_end (TK_WRITE, ttr, 1);
             }
             else
             {
@@ -441,7 +495,8 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
               t1 = nowll ();
               t0 = (unsigned long long) (iseq->_buffer[i].source_timestamp.sec * 1000000000ll + iseq->_buffer[i].source_timestamp.nanosec);
               pongidx = lookup_pong (&ppa, iseq->_buffer[i].publication_handle);
-              record_latency (&ppa.lats[pongidx], d1->baggage._length, (t1 - t0) / 1e9, d1->seq);
+              /* a step of the wall clock can put t1 before t0 */
+              record_latency (&ppa.lats[pongidx], d1->baggage._length, (t1 > t0) ? t1 - t0 : 0, d1->seq);
             }
           }
           KeyedSeqDataReader_return_loan (rd, mseq, iseq);
@@ -449,12 +504,14 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
           print_latencies (&ppa);
           if (side != SIDE_PONG && all_pongs_responded(&ppa))
           {
-            if ((nroundtrips > 0 && --nroundtrips == 0) || nowll() >= tend)
+            if ((nroundtrips > 0 && --nroundtrips == 0) || nowmono() >= tend)
               terminate = 1;
             if (do_sleeps)
             {
               struct timespec ts = { 0, 10 * 1000 * 1000 };
+              ttr = trace_begin (TK_SLEEP);
               nanosleep (&ts, NULL);
+              trace_end (TK_SLEEP, ttr, 0);
             }
             result = ping_once (wr, d0, handle);
             if (result != DDS_RETCODE_OK)
@@ -486,6 +543,7 @@ static void pingpong (enum side side, DDS_GuardCondition sigguard)
     DDS_DataReader_delete_readcondition (rd, cond);
   DDS_free (ws);
 
+  fini_pings_pong_admin (&ppa);
   DDS_Subscriber_delete_datareader (s, rd);
   DDS_Publisher_delete_datawriter (p, wr);
   DDS_DomainParticipant_delete_subscriber (dp, s);
@@ -509,11 +567,11 @@ int main (int argc, char *argv[])
   int i, opt;
 
   argv0 = argv[0];
-  tstart = nowll ();
+  tstart = nowmono ();
 
   a0.side = a1.side = SIDE_UNSET;
 
-  while ((opt = getopt (argc, argv, "D:nN:o:Q:Rs:ST:uz:Z:")) != EOF)
+  while ((opt = getopt (argc, argv, "D:nN:o:Q:Rs:St:T:uz:Z:")) != EOF)
     switch (opt)
     {
       case 'T':
@@ -559,6 +617,13 @@ int main (int argc, char *argv[])
       case 'S':
         do_sleeps = 1;
         break;
+      case 't':
+        if (!trace_init (optarg))
+        {
+          fprintf (stderr, "-t %s: invalid trace specification\n", optarg);
+          return 1;
+        }
+        break;
       case 'R':
         use_statuscondition = 0;
         break;
@@ -661,6 +726,7 @@ int main (int argc, char *argv[])
   for (i = 0; i < 2; i++)
     DDS_free (sigguard[i]);
 
+  trace_fini ();
   common_fini ();
   return 0;
 }
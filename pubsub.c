@@ -25,14 +25,20 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <limits.h>
 #include <errno.h>
 #include <ctype.h>
+#include <math.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/fcntl.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -84,7 +90,13 @@ enum readermode { MODE_PRINT, MODE_CHECK, MODE_ZEROLOAD, MODE_DUMP, MODE_NONE };
 #define PM_STATE 1024u
 
 static int fdservsock = -1;
+static char *servsock_path = NULL; /* UNIX domain socket, removed on close */
 static volatile sig_atomic_t termflag = 0;
+static volatile sig_atomic_t snapshot_gen = 0;
+static volatile sig_atomic_t flightrec_gen = 0;
+static unsigned flightrec_size = 1024;
+#define FLIGHTREC_MAXSIZE (1u << 24)
+static unsigned long long flightrec_latency = 0;
 static int pid;
 static DDS_GuardCondition termcond;
 static unsigned nkeyvals = 1;
@@ -96,14 +108,24 @@ static double dur = 0.0;
 static int sigpipe[2];
 static int termpipe[2];
 static int fdin = 0;
+static int fdin_map = 0; /* 1: mmap fdin, 2: also madvise sequential */
 static int print_latency = 0;
+static int print_perf = 0;
 static FILE *latlog_fp = NULL;
 static enum tgprint_mode print_mode = TGPM_FIELDS;
 static unsigned print_metadata = PM_STATE;
 static unsigned print_chop = 0xffffffff;
 static int printtype = 0;
+static char *print_proj = NULL;
+static unsigned print_delta = 0;
+static unsigned keycache_size = 10000;
+static unsigned print_every = 0;
+static double print_maxrate = 0.0;
+static double print_latest = 0.0;
 static int print_final_take_notice = 1;
 static int print_tcp = 0;
+static int print_binary = 0;
+static int binary_input = 0;
 static DDS_Topic ddsi_control_topic = DDS_HANDLE_NIL;
 static DDS_Publisher ddsi_control_pub;
 static q_osplserModule_ddsi_controlDataWriter ddsi_control_wr;
@@ -114,10 +136,34 @@ struct tstamp_t {
   int64_t t;
 };
 
+/* Per-reader output: either stdout (shared, so lines are printed
+   under flockfile) or a file private to the reader thread */
+struct sink {
+  FILE *fp;
+  char *pattern; /* NULL for stdout */
+  unsigned idx;
+  char *topic;
+  unsigned long long maxsize; /* 0 if no rotation */
+  unsigned seq;
+  int has_seq; /* pattern contains %r */
+};
+
+struct metrics_tags {
+  const char *role; /* reader or writer */
+  unsigned idx;
+  const char *topic;
+  const char *qos;
+};
+
 struct readerspec {
   DDS_DataReader rd;
   enum topicsel topicsel;
   struct tgtopic *tgtp;
+  struct tgproj *tgproj;
+  struct tgdelta *tgdelta;
+  const char *outpattern;
+  unsigned long long outmaxsize;
+  struct sink *sink;
   enum readermode mode;
   int exit_on_out_of_seq;
   int use_take;
@@ -127,6 +173,7 @@ struct readerspec {
   int print_match_pre_read;
   int do_final_take;
   unsigned idx;
+  struct metrics_tags tags;
 };
 
 enum writermode {
@@ -141,18 +188,25 @@ struct writerspec {
   enum topicsel topicsel;
   DDS_string tpname;
   struct tgtopic *tgtp;
+  struct tgkeycache *keycache;
   double writerate;
   unsigned baggagesize;
   int register_instances;
   int duplicate_writer_flag;
   unsigned burstsize;
   enum writermode mode;
+  struct metrics_tags tags;
 };
 
 static const struct readerspec def_readerspec = {
   .rd = DDS_HANDLE_NIL,
   .topicsel = UNSPEC,
   .tgtp = NULL,
+  .tgproj = NULL,
+  .tgdelta = NULL,
+  .outpattern = NULL,
+  .outmaxsize = 0,
+  .sink = NULL,
   .mode = MODE_PRINT,
   .exit_on_out_of_seq = 0,
   .use_take = 1,
@@ -169,6 +223,7 @@ static const struct writerspec def_writerspec = {
   .topicsel = UNSPEC,
   .tpname = NULL,
   .tgtp = NULL,
+  .keycache = NULL,
   .writerate = 0.0,
   .baggagesize = 0,
   .register_instances = 0,
@@ -177,6 +232,730 @@ static const struct writerspec def_writerspec = {
   .mode = WM_INPUT
 };
 
+/* Machine-readable copies of the periodic reports and final totals, as
+   JSON Lines appended to a file, or as a Prometheus text-format file
+   rewritten (atomically, via rename) with the latest value of every
+   series on each report, for a node-exporter textfile collector */
+enum metrics_format {
+  MF_NONE,
+  MF_JSON,
+  MF_PROM
+};
+
+struct metric {
+  const char *name;
+  double value;
+};
+
+#define METRICS_MAX 16
+
+struct metrics_series {
+  struct metrics_series *next;
+  const char *event;
+  const struct metrics_tags *tags;
+  unsigned n;
+  struct metric ms[METRICS_MAX];
+};
+
+static enum metrics_format metrics_format = MF_NONE;
+static char *metrics_file = NULL;
+static FILE *metrics_fp = NULL;
+static char *metrics_runid = NULL;
+static char *metrics_qos_rd = NULL, *metrics_qos_wr = NULL;
+static struct metrics_series *metrics_series = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void metrics_putstr (FILE *fp, const char *s)
+{
+  /* the escapes needed for Prometheus label values are a subset of
+     those for JSON strings */
+  putc ('"', fp);
+  for (; *s; s++)
+  {
+    switch (*s)
+    {
+      case '"': fputs ("\\\"", fp); break;
+      case '\\': fputs ("\\\\", fp); break;
+      case '\n': fputs ("\\n", fp); break;
+      default:
+        if ((unsigned char) *s < 0x20)
+          fprintf (fp, (metrics_format == MF_JSON) ? "\\u%04x" : " ", (unsigned char) *s);
+        else
+          putc (*s, fp);
+        break;
+    }
+  }
+  putc ('"', fp);
+}
+
+static void metrics_json (const char *event, const struct metrics_tags *tags, const struct metric *ms, unsigned n)
+{
+  unsigned i;
+  fprintf (metrics_fp, "{\"time\":%.6f,\"run\":", (double) nowll () / 1e9);
+  metrics_putstr (metrics_fp, metrics_runid);
+  fprintf (metrics_fp, ",\"event\":\"%s\",\"role\":\"%s\",\"idx\":%u,\"topic\":", event, tags->role, tags->idx);
+  metrics_putstr (metrics_fp, tags->topic);
+  fprintf (metrics_fp, ",\"qos\":");
+  metrics_putstr (metrics_fp, tags->qos);
+  for (i = 0; i < n; i++)
+    fprintf (metrics_fp, ",\"%s\":%.15g", ms[i].name, ms[i].value);
+  fprintf (metrics_fp, "}\n");
+  fflush (metrics_fp);
+}
+
+static void metrics_prom_labels (FILE *fp, const struct metrics_tags *tags)
+{
+  fprintf (fp, "{run=");
+  metrics_putstr (fp, metrics_runid);
+  fprintf (fp, ",role=\"%s\",idx=\"%u\",topic=", tags->role, tags->idx);
+  metrics_putstr (fp, tags->topic);
+  fprintf (fp, ",qos=");
+  metrics_putstr (fp, tags->qos);
+  fprintf (fp, "}");
+}
+
+static int metrics_prom_seen (const struct metrics_series *upto, const char *event, const char *name)
+{
+  /* whether the family event_name was already written for a series
+     preceding upto */
+  const struct metrics_series *s;
+  unsigned i;
+  for (s = metrics_series; s != upto; s = s->next)
+    if (strcmp (s->event, event) == 0)
+      for (i = 0; i < s->n; i++)
+        if (strcmp (s->ms[i].name, name) == 0)
+          return 1;
+  return 0;
+}
+
+static void metrics_prom (const char *event, const struct metrics_tags *tags, const struct metric *ms, unsigned n)
+{
+  struct metrics_series *s, **ps;
+  char *tmp;
+  FILE *fp;
+  for (ps = &metrics_series; (s = *ps) != NULL; ps = &s->next)
+    if (s->tags == tags && strcmp (s->event, event) == 0)
+      break;
+  if (s == NULL)
+  {
+    s = *ps = malloc (sizeof (*s));
+    s->next = NULL;
+    s->event = event;
+    s->tags = tags;
+  }
+  s->n = n;
+  memcpy (s->ms, ms, n * sizeof (*ms));
+
+  /* all samples of a family must be consecutive */
+  if (asprintf (&tmp, "%s.tmp", metrics_file) < 0)
+    return;
+  if ((fp = fopen (tmp, "w")) == NULL)
+  {
+    fprintf (stderr, "%s: can't open for writing\n", tmp);
+    free (tmp);
+    return;
+  }
+  for (s = metrics_series; s; s = s->next)
+  {
+    unsigned i;
+    for (i = 0; i < s->n; i++)
+    {
+      const struct metrics_series *t;
+      unsigned j;
+      if (metrics_prom_seen (s, s->event, s->ms[i].name))
+        continue;
+      fprintf (fp, "# TYPE pubsub_%s_%s gauge\n", s->event, s->ms[i].name);
+      for (t = s; t; t = t->next)
+      {
+        if (strcmp (t->event, s->event) != 0)
+          continue;
+        for (j = 0; j < t->n; j++)
+        {
+          if (strcmp (t->ms[j].name, s->ms[i].name) == 0)
+          {
+            fprintf (fp, "pubsub_%s_%s", t->event, t->ms[j].name);
+            metrics_prom_labels (fp, t->tags);
+            fprintf (fp, " %.15g\n", t->ms[j].value);
+          }
+        }
+      }
+    }
+  }
+  fclose (fp);
+  if (rename (tmp, metrics_file) != 0)
+    fprintf (stderr, "%s: rename failed: %s\n", tmp, strerror (errno));
+  free (tmp);
+}
+
+static void metrics_emit (const char *event, const struct metrics_tags *tags, const struct metric *ms, unsigned n)
+{
+  assert (n <= METRICS_MAX);
+  if (metrics_format == MF_NONE)
+    return;
+  pthread_mutex_lock (&metrics_lock);
+  if (metrics_format == MF_JSON)
+    metrics_json (event, tags, ms, n);
+  else
+    metrics_prom (event, tags, ms, n);
+  pthread_mutex_unlock (&metrics_lock);
+}
+
+static unsigned metrics_hist (struct metric *ms, const struct hist *h)
+{
+  /* count, mean and percentiles in ns: 9 entries */
+  static const struct { const char *name; double q; } qs[] = {
+    { "min_ns", 0 }, { "p50_ns", 0.5 }, { "p90_ns", 0.9 }, { "p99_ns", 0.99 },
+    { "p999_ns", 0.999 }, { "p9999_ns", 0.9999 }, { "max_ns", 1 }
+  };
+  unsigned i, n = 0;
+  ms[n].name = "count"; ms[n++].value = (double) hist_count (h);
+  ms[n].name = "mean_ns"; ms[n++].value = hist_mean (h);
+  for (i = 0; i < sizeof (qs) / sizeof (qs[0]); i++)
+  {
+    ms[n].name = qs[i].name;
+    ms[n++].value = (double) hist_quantile (h, qs[i].q);
+  }
+  return n;
+}
+
+/* latencies: prefix the names to keep them apart from the counts */
+static const char *metrics_latency_names[] = {
+  "latency_count", "latency_mean_ns", "latency_min_ns", "latency_p50_ns", "latency_p90_ns",
+  "latency_p99_ns", "latency_p999_ns", "latency_p9999_ns", "latency_max_ns"
+};
+
+static unsigned metrics_latency (struct metric *ms, const struct hist *lat)
+{
+  unsigned i, n = metrics_hist (ms, lat);
+  assert (n == sizeof (metrics_latency_names) / sizeof (metrics_latency_names[0]));
+  for (i = 0; i < n; i++)
+    ms[i].name = metrics_latency_names[i];
+  return n;
+}
+
+static void metrics_writes (const char *event, const struct metrics_tags *tags, const struct hist *h, uint64_t dt)
+{
+  struct metric ms[METRICS_MAX];
+  unsigned n = metrics_hist (ms, h);
+  ms[n].name = "rate";
+  ms[n++].value = (dt == 0) ? 0.0 : (double) hist_count (h) / ((double) dt / 1e9);
+  metrics_emit (event, tags, ms, n);
+}
+
+static void metrics_reads (const char *event, const struct metrics_tags *tags, long long ntot, long long nseq, long long ndelta, double rate_Mbps, const struct hist *lat)
+{
+  struct metric ms[METRICS_MAX];
+  unsigned n = 0;
+  ms[n].name = "ntot"; ms[n++].value = (double) ntot;
+  ms[n].name = "nseq"; ms[n++].value = (double) nseq;
+  if (ndelta >= 0)
+  {
+    ms[n].name = "ndelta"; ms[n++].value = (double) ndelta;
+    ms[n].name = "rate_mbps"; ms[n++].value = rate_Mbps;
+  }
+  if (lat)
+    n += metrics_latency (ms + n, lat);
+  metrics_emit (event, tags, ms, n);
+}
+
+static char *metrics_joinqos (int n, const char *args[])
+{
+  size_t len = 1;
+  char *s;
+  int i;
+  for (i = 0; i < n; i++)
+    len += strlen (args[i]) + 1;
+  s = malloc (len);
+  s[0] = 0;
+  for (i = 0; i < n; i++)
+  {
+    if (i > 0)
+      strcat (s, ",");
+    strcat (s, args[i]);
+  }
+  return s;
+}
+
+static void metrics_init (const char *arg, const char *runid, int nqtopic, const char *qtopic[], int nqreader, const char *qreader[], int nqwriter, const char *qwriter[])
+{
+  /* arg is FORMAT:FILE; the QoS tags are the -q arguments that apply */
+  const char *tqos[nqtopic + nqreader + nqwriter + 1];
+  if (strncmp (arg, "json:", 5) == 0)
+    metrics_format = MF_JSON;
+  else if (strncmp (arg, "prom:", 5) == 0)
+    metrics_format = MF_PROM;
+  else
+  {
+    fprintf (stderr, "-X %s: invalid format\n", arg);
+    exit (3);
+  }
+  metrics_file = strdup (arg + 5);
+  if (metrics_format == MF_JSON && (metrics_fp = fopen (metrics_file, "w")) == NULL)
+  {
+    fprintf (stderr, "%s: can't open for writing\n", metrics_file);
+    exit (3);
+  }
+  if (runid)
+    metrics_runid = strdup (runid);
+  else
+  {
+    char host[256];
+    if (gethostname (host, sizeof (host)) != 0)
+      strcpy (host, "unknown");
+    host[sizeof (host) - 1] = 0;
+    if (asprintf (&metrics_runid, "%s-%d-%llu", host, (int) getpid (), nowll () / 1000000000) < 0)
+      metrics_runid = strdup ("unknown");
+  }
+  memcpy (tqos, qtopic, (size_t) nqtopic * sizeof (*tqos));
+  memcpy (tqos + nqtopic, qreader, (size_t) nqreader * sizeof (*tqos));
+  metrics_qos_rd = metrics_joinqos (nqtopic + nqreader, tqos);
+  memcpy (tqos + nqtopic, qwriter, (size_t) nqwriter * sizeof (*tqos));
+  metrics_qos_wr = metrics_joinqos (nqtopic + nqwriter, tqos);
+}
+
+static void metrics_fini (void)
+{
+  while (metrics_series)
+  {
+    struct metrics_series *s = metrics_series;
+    metrics_series = s->next;
+    free (s);
+  }
+  if (metrics_fp)
+    fclose (metrics_fp);
+  free (metrics_qos_rd);
+  free (metrics_qos_wr);
+  free (metrics_runid);
+  free (metrics_file);
+}
+
+/* Run totals of the per-thread histograms: the write-to-write times of
+   the automatic writers and the latencies measured by the readers */
+struct hist_total {
+  pthread_mutex_t lock;
+  struct hist *h;
+  unsigned nthreads;
+};
+
+static struct hist_total wrhist_total = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+static struct hist_total lathist_total = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static void hist_total_add (struct hist_total *t, const struct hist *h)
+{
+  pthread_mutex_lock (&t->lock);
+  if (t->h == NULL)
+    t->h = hist_new ();
+  hist_merge (t->h, h);
+  t->nthreads++;
+  pthread_mutex_unlock (&t->lock);
+}
+
+static void hist_total_print (struct hist_total *t, const char *what)
+{
+  /* only interesting if there is more than one thread contributing */
+  if (t->nthreads > 1)
+  {
+    char l[256];
+    hist_format (l, sizeof (l), t->h);
+    printf ("%s: %" PRIu64 " in %u threads %s\n", what, hist_count (t->h), t->nthreads, l);
+  }
+  if (t->h)
+    hist_free (t->h);
+}
+
+/* SIGUSR1 makes each reader and writer thread print a snapshot of its
+   cumulative counters the next time it checks snapshot_gen, with the run
+   continuing: all counters are private to the thread, so the snapshot is
+   consistent without any locking */
+static void snapshot_print (const char *event, const struct metrics_tags *tags, const char *counts, const struct hist *cum, const struct hist *cur, int latency, uint64_t tblocked, struct metric *ms, unsigned n)
+{
+  /* cum and cur are both NULL or both non-NULL; latency selects the
+     "latency_" metric names for the reader side */
+  struct hist *h = NULL;
+  char l[256] = "";
+  if (cum)
+  {
+    h = hist_new ();
+    hist_merge (h, cum);
+    hist_merge (h, cur);
+    hist_format (l, sizeof (l), h);
+  }
+  flockfile (stdout);
+  printf ("snapshot %s %u %s: %s blocked %.3fs%s%s\n", tags->role, tags->idx, tags->topic, counts, (double) tblocked / 1e9, h ? " " : "", l);
+  funlockfile (stdout);
+  ms[n].name = "blocked_s";
+  ms[n++].value = (double) tblocked / 1e9;
+  if (h)
+  {
+    n += latency ? metrics_latency (ms + n, h) : metrics_hist (ms + n, h);
+    hist_free (h);
+  }
+  metrics_emit (event, tags, ms, n);
+}
+
+/* CPU and memory cost of a reader or writer thread, reported after
+   every periodic report and with the peaks of those at the end */
+struct cpustats {
+  struct rusage_sample prev;
+  unsigned long long tprev;
+  double peak_util, peak_proc_util, peak_us_per_sample;
+  double peak_vcsw_rate, peak_ivcsw_rate;
+};
+
+static void cpustats_init (struct cpustats *cs)
+{
+  memset (cs, 0, sizeof (*cs));
+  rusage_sample (&cs->prev);
+  cs->tprev = nowmono ();
+}
+
+static void cpustats_report (struct cpustats *cs, const struct metrics_tags *tags, uint64_t nsamples)
+{
+  struct rusage_sample s;
+  struct metric ms[METRICS_MAX];
+  unsigned long long t, nvcsw, nivcsw;
+  double dt, util, proc_util, us_per_sample;
+  unsigned n = 0;
+  rusage_sample (&s);
+  t = nowmono ();
+  dt = (t > cs->tprev) ? (double) (t - cs->tprev) : 1.0;
+  util = 100.0 * (double) (s.cpu_ns - cs->prev.cpu_ns) / dt;
+  proc_util = 100.0 * (double) (s.proc_cpu_ns - cs->prev.proc_cpu_ns) / dt;
+  us_per_sample = (nsamples == 0) ? 0.0 : (double) (s.cpu_ns - cs->prev.cpu_ns) / 1e3 / (double) nsamples;
+  nvcsw = s.nvcsw - cs->prev.nvcsw;
+  nivcsw = s.nivcsw - cs->prev.nivcsw;
+  printf ("  cpu %.1f%% (process %.1f%%) %.3fus/sample rss %.1fMB csw %llu/%llu\n",
+          util, proc_util, us_per_sample, (double) s.rss_kb / 1024.0, nvcsw, nivcsw);
+  if (util > cs->peak_util)
+    cs->peak_util = util;
+  if (proc_util > cs->peak_proc_util)
+    cs->peak_proc_util = proc_util;
+  if (us_per_sample > cs->peak_us_per_sample)
+    cs->peak_us_per_sample = us_per_sample;
+  if (1e9 * (double) nvcsw / dt > cs->peak_vcsw_rate)
+    cs->peak_vcsw_rate = 1e9 * (double) nvcsw / dt;
+  if (1e9 * (double) nivcsw / dt > cs->peak_ivcsw_rate)
+    cs->peak_ivcsw_rate = 1e9 * (double) nivcsw / dt;
+  ms[n].name = "cpu_pct"; ms[n++].value = util;
+  ms[n].name = "process_cpu_pct"; ms[n++].value = proc_util;
+  ms[n].name = "cpu_us_per_sample"; ms[n++].value = us_per_sample;
+  ms[n].name = "rss_kb"; ms[n++].value = (double) s.rss_kb;
+  ms[n].name = "nvcsw"; ms[n++].value = (double) nvcsw;
+  ms[n].name = "nivcsw"; ms[n++].value = (double) nivcsw;
+  metrics_emit ("cpu", tags, ms, n);
+  cs->prev = s;
+  cs->tprev = t;
+}
+
+static void cpustats_peak (const struct cpustats *cs, const struct metrics_tags *tags)
+{
+  struct rusage_sample s;
+  struct metric ms[METRICS_MAX];
+  unsigned n = 0;
+  rusage_sample (&s);
+  printf ("peak cpu %.1f%% (process %.1f%%) %.3fus/sample rss %.1fMB csw %.0f/%.0f per s\n",
+          cs->peak_util, cs->peak_proc_util, cs->peak_us_per_sample, (double) s.maxrss_kb / 1024.0,
+          cs->peak_vcsw_rate, cs->peak_ivcsw_rate);
+  ms[n].name = "cpu_pct"; ms[n++].value = cs->peak_util;
+  ms[n].name = "process_cpu_pct"; ms[n++].value = cs->peak_proc_util;
+  ms[n].name = "cpu_us_per_sample"; ms[n++].value = cs->peak_us_per_sample;
+  ms[n].name = "rss_kb"; ms[n++].value = (double) s.maxrss_kb;
+  ms[n].name = "nvcsw_per_s"; ms[n++].value = cs->peak_vcsw_rate;
+  ms[n].name = "nivcsw_per_s"; ms[n++].value = cs->peak_ivcsw_rate;
+  metrics_emit ("cpu_peak", tags, ms, n);
+}
+
+/* Hardware performance counters of a reader or writer thread, counting
+   only in the write loop or while taking and processing data */
+struct perfstats {
+  struct perfctrs *pc;
+  unsigned long long prev[PERFCTRS_N];
+};
+
+static void perfstats_init (struct perfstats *ps, int enable)
+{
+  int i;
+  ps->pc = NULL;
+  for (i = 0; i < PERFCTRS_N; i++)
+    ps->prev[i] = 0;
+  if (print_perf && enable && (ps->pc = perfctrs_new ()) == NULL)
+    fprintf (stderr, "perf: hardware performance counters unavailable (%s), continuing without\n", strerror (errno));
+}
+
+static void perfstats_report (struct perfstats *ps, const char *event, const struct metrics_tags *tags, uint64_t nsamples, int delta)
+{
+  /* delta: per sample over the interval since the previous report
+     (and advance), else per sample since the start */
+  unsigned long long v[PERFCTRS_N];
+  struct metric ms[METRICS_MAX];
+  char names[PERFCTRS_N][32];
+  double x[PERFCTRS_N];
+  unsigned n = 0;
+  int i;
+  if (ps->pc == NULL || perfctrs_read (ps->pc, v) < 0)
+    return;
+  flockfile (stdout);
+  printf ("  perf");
+  for (i = 0; i < PERFCTRS_N; i++)
+  {
+    if (v[i] == PERFCTRS_NA)
+    {
+      printf (" %s n/a", perfctrs_names[i]);
+      continue;
+    }
+    x[i] = (double) (v[i] - (delta ? ps->prev[i] : 0)) / (double) (nsamples ? nsamples : 1);
+    printf (" %s %.1f", perfctrs_names[i], x[i]);
+    snprintf (names[i], sizeof (names[i]), "%s_per_sample", perfctrs_names[i]);
+    ms[n].name = names[i]; ms[n++].value = x[i];
+  }
+  if (v[0] != PERFCTRS_NA && v[1] != PERFCTRS_NA && x[0] > 0)
+  {
+    printf (" ipc %.2f", x[1] / x[0]);
+    ms[n].name = "ipc"; ms[n++].value = x[1] / x[0];
+  }
+  printf (" per sample\n");
+  funlockfile (stdout);
+  metrics_emit (event, tags, ms, n);
+  if (delta)
+    for (i = 0; i < PERFCTRS_N; i++)
+      ps->prev[i] = v[i];
+}
+
+/* Allocations by a thread per phase, if liballocstats.so is preloaded;
+   totals are relative to allocstats_init */
+struct allocstats {
+  struct alloc_counts first, prev;
+};
+
+static void allocstats_init (struct allocstats *as)
+{
+  (void) alloc_counts_get (&as->first);
+  as->prev = as->first;
+}
+
+static void allocstats_report (struct allocstats *as, const char *who, const char *event, const struct metrics_tags *tags, uint64_t nsamples, int delta)
+{
+  /* per sample if NSAMPLES > 0, over the interval since the previous
+     report if DELTA (and advance), else since allocstats_init; WHO
+     (if not NULL) is included in the totals line */
+  static const char *names[AP_N][2] = {
+    { "other_allocs", "other_bytes" }, { "write_allocs", "write_bytes" },
+    { "take_allocs", "take_bytes" }, { "print_allocs", "print_bytes" },
+    { "parse_allocs", "parse_bytes" }
+  };
+  const struct alloc_counts *ref = delta ? &as->prev : &as->first;
+  const double div = (nsamples > 0) ? (double) nsamples : 1.0;
+  struct alloc_counts c;
+  struct metric ms[METRICS_MAX];
+  unsigned n = 0;
+  int i;
+  if (!alloc_counts_get (&c))
+    return;
+  flockfile (stdout);
+  printf ("%s%s%s", delta ? "  alloc" : "alloc total", who ? " " : "", who ? who : "");
+  for (i = 0; i < AP_N; i++)
+  {
+    const double na = (double) (c.n[i] - ref->n[i]) / div;
+    const double nb = (double) (c.bytes[i] - ref->bytes[i]) / div;
+    if (c.n[i] != ref->n[i])
+      printf (" %s %.*f (%.0fB)", alloc_phase_names[i], (nsamples > 0) ? 2 : 0, na, nb);
+    ms[n].name = names[i][0]; ms[n++].value = na;
+    ms[n].name = names[i][1]; ms[n++].value = nb;
+  }
+  printf ("%s\n", (nsamples > 0) ? " per sample" : "");
+  funlockfile (stdout);
+  if (event)
+    metrics_emit (event, tags, ms, n);
+  if (delta)
+    as->prev = c;
+}
+
+/* Run-level assertions (-G): every reader in check mode and every
+   automatic writer measures over its own window, starting at the first
+   sample once the warmup has passed, checks the assertions that apply to
+   it when it stops and records the violations in gate_failed, which ends
+   up in the exit status; each kind of violation has its own bit */
+enum gate_kind { GK_RATE, GK_LOSS, GK_LATENCY, GK_BLOCKED, GK_CPU };
+#define GK_N 5
+#define GATE_EXIT_SHIFT 3 /* below are 1 (out-of-seq), 2 (error), 3 (usage) */
+
+static const char *gate_names[GK_N] = { "rate", "loss", "latency", "blocked", "cpu" };
+
+static struct {
+  unsigned set; /* bit per enum gate_kind */
+  double limit[GK_N];
+  double quantile; /* for GK_LATENCY */
+  unsigned long long warmup; /* ns */
+  pthread_mutex_t lock;
+  unsigned checked, failed; /* bit per enum gate_kind */
+} gate = { .set = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct gate_window {
+  int enabled, started;
+  unsigned long long tstart; /* start of warmup, then of the window */
+  unsigned long long tlast; /* last sample in the window */
+  unsigned long long cpu0; /* thread CPU time at the start of the window */
+  uint64_t n, nlost, tblocked;
+  struct hist *lat;
+};
+
+static int gate_parse (const char *optarg)
+{
+  char *copy = strdup (optarg), *cursor = copy, *tok;
+  int ok = 1;
+  while (ok && (tok = strsep (&cursor, ",")) != NULL)
+  {
+    char digits[8];
+    double v;
+    int pos, k;
+    if (sscanf (tok, "warmup:%lf%n", &v, &pos) == 1 && tok[pos] == 0 && v >= 0)
+    {
+      gate.warmup = (unsigned long long) (v * 1e9);
+      continue;
+    }
+    if (sscanf (tok, "p%7[0-9]:%lf%n", digits, &v, &pos) == 2 && tok[pos] == 0)
+    {
+      /* p50, p99, p999, ...: the digits are the fraction */
+      gate.quantile = atof (digits) / pow (10.0, (double) strlen (digits));
+      k = GK_LATENCY;
+    }
+    else
+    {
+      for (k = 0; k < GK_N; k++)
+      {
+        const size_t len = strlen (gate_names[k]);
+        if (k != GK_LATENCY && strncmp (tok, gate_names[k], len) == 0 && tok[len] == ':' &&
+            sscanf (tok + len + 1, "%lf%n", &v, &pos) == 1 && tok[len + 1 + pos] == 0)
+          break;
+      }
+      if (k == GK_N)
+      {
+        ok = 0;
+        break;
+      }
+    }
+    if (v < 0 || (k == GK_LOSS && v > 1) || (k == GK_LATENCY && gate.quantile == 0))
+      ok = 0;
+    gate.set |= 1u << k;
+    gate.limit[k] = v;
+  }
+  free (copy);
+  return ok && gate.set != 0;
+}
+
+static void gate_window_init (struct gate_window *w, int enable)
+{
+  w->enabled = enable && gate.set != 0;
+  w->started = 0;
+  w->tstart = w->tlast = 0;
+  w->cpu0 = 0;
+  w->n = w->nlost = w->tblocked = 0;
+  w->lat = (w->enabled && (gate.set & (1u << GK_LATENCY))) ? hist_new () : NULL;
+}
+
+static void gate_window_begin (struct gate_window *w, unsigned long long tnow)
+{
+  /* the warmup starts at the first sample (readers) or write (writers) */
+  w->tstart = tnow + gate.warmup;
+}
+
+static int gate_window_account (struct gate_window *w, unsigned long long tnow)
+{
+  /* returns whether the sample at tnow falls in the window, which opens
+     with the first sample after the warmup (not itself included) */
+  struct rusage_sample s;
+  if (!w->enabled || tnow < w->tstart)
+    return 0;
+  else if (w->started)
+  {
+    w->tlast = tnow;
+    return 1;
+  }
+  rusage_sample (&s);
+  w->started = 1;
+  w->tstart = tnow;
+  w->cpu0 = s.cpu_ns;
+  return 0;
+}
+
+static void gate_window_fini (struct gate_window *w, const struct metrics_tags *tags, unsigned long long tend)
+{
+  /* applies to readers: rate, loss, latency, cpu; to writers: rate, blocked, cpu */
+  const unsigned applies = (1u << GK_RATE) | (1u << GK_CPU) |
+    ((strcmp (tags->role, "reader") == 0) ? ((1u << GK_LOSS) | (1u << GK_LATENCY)) : (1u << GK_BLOCKED));
+  const unsigned check = gate.set & applies;
+  struct metric ms[METRICS_MAX];
+  double val[GK_N];
+  unsigned failed = 0, n = 0;
+  char l[256];
+  size_t pos;
+  int k;
+  if (!w->enabled)
+    return;
+  if (check == 0)
+  {
+    if (w->lat)
+      hist_free (w->lat);
+    return;
+  }
+  if (w->started && w->n > 0 && tend > w->tstart)
+  {
+    struct rusage_sample s;
+    rusage_sample (&s);
+    val[GK_RATE] = (double) w->n * 1e9 / (double) (tend - w->tstart);
+    val[GK_LOSS] = (double) w->nlost / (double) (w->n + w->nlost);
+    val[GK_LATENCY] = w->lat ? (double) hist_quantile (w->lat, gate.quantile) / 1e9 : 0.0;
+    val[GK_BLOCKED] = (double) w->tblocked / (double) (tend - w->tstart);
+    val[GK_CPU] = (double) (s.cpu_ns - w->cpu0) / 1e3 / (double) w->n;
+    for (k = 0; k < GK_N; k++)
+    {
+      if (!(check & (1u << k)))
+        continue;
+      if (k == GK_RATE ? (val[k] < gate.limit[k]) : (val[k] > gate.limit[k]))
+        failed |= 1u << k;
+      ms[n].name = gate_names[k];
+      ms[n++].value = val[k];
+    }
+    pos = (size_t) snprintf (l, sizeof (l), "over %.1fs:", (double) (tend - w->tstart) / 1e9);
+    for (k = 0; k < GK_N && pos < sizeof (l); k++)
+      if (check & (1u << k))
+        pos += (size_t) snprintf (l + pos, sizeof (l) - pos, " %s %g %s %g %s", gate_names[k], val[k],
+                                  (k == GK_RATE) ? ">=" : "<=", gate.limit[k], (failed & (1u << k)) ? "FAIL" : "pass");
+  }
+  else
+  {
+    /* nothing measured: a gate can't pass on an empty window */
+    failed = check;
+    snprintf (l, sizeof (l), "no samples after warmup: FAIL");
+  }
+  printf ("gate %s %u %s %s\n", tags->role, tags->idx, tags->topic, l);
+  ms[n].name = "failed";
+  ms[n++].value = (double) (failed << GATE_EXIT_SHIFT);
+  metrics_emit ("gate", tags, ms, n);
+  pthread_mutex_lock (&gate.lock);
+  gate.checked |= check;
+  gate.failed |= failed;
+  pthread_mutex_unlock (&gate.lock);
+  if (w->lat)
+    hist_free (w->lat);
+}
+
+static unsigned gate_result (void)
+{
+  /* an assertion that no thread could check also fails */
+  unsigned failed;
+  int k;
+  if (gate.set == 0)
+    return 0;
+  failed = gate.failed | (gate.set & ~gate.checked);
+  printf ("gate: %s", failed ? "FAIL" : "pass");
+  for (k = 0; k < GK_N; k++)
+    if (failed & (1u << k))
+      printf (" %s%s", gate_names[k], (gate.checked & (1u << k)) ? "" : " (not measured)");
+  printf ("\n");
+  return failed << GATE_EXIT_SHIFT;
+}
+
 struct wrspeclist {
   struct writerspec *spec;
   struct wrspeclist *prev, *next; /* circular */
@@ -190,9 +969,9 @@ static void terminate (void)
   DDS_GuardCondition_set_trigger_value(termcond, 1);
 }
 
-static void sigh (int sig __attribute__ ((unused)))
+static void sigh (int sig)
 {
-  const char c = 1;
+  const char c = (sig == SIGUSR1) ? 2 : (sig == SIGUSR2) ? 3 : 1;
   ssize_t r;
   do {
     r = write (sigpipe[1], &c, 1);
@@ -215,6 +994,10 @@ static void *sigthread(void *varg __attribute__ ((unused)))
       error ("sigthread: unexpected eof\n");
     else if (c == 0)
       break;
+    else if (c == 2)
+      snapshot_gen++; /* picked up by the reader and writer threads */
+    else if (c == 3)
+      flightrec_gen++; /* likewise, by the readers */
     else
       terminate();
   }
@@ -241,7 +1024,51 @@ static int open_tcpserver_sock (int port)
     perror ("bind()");
     exit (2); /* will kill any waiting threads */
   }
-  if (listen (fd, 1) == -1)
+  if (listen (fd, SOMAXCONN) == -1)
+  {
+    perror ("listen()");
+    exit (2); /* will kill any waiting threads */
+  }
+  if (print_tcp)
+    printf ("listening ... ");
+  fflush (stdout);
+  return fd;
+}
+
+static int open_unixserver_sock (const char *path)
+{
+  struct sockaddr_un saddr;
+  struct stat st;
+  int fd;
+  if (strlen (path) >= sizeof (saddr.sun_path))
+  {
+    fprintf (stderr, "%s: socket path too long\n", path);
+    exit (3);
+  }
+  memset (&saddr, 0, sizeof (saddr));
+  saddr.sun_family = AF_UNIX;
+  strcpy (saddr.sun_path, path);
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+  {
+    perror ("socket()");
+    exit (2); /* will kill any waiting threads */
+  }
+  /* only replace a stale socket, never anything else */
+  if (lstat (path, &st) == 0)
+  {
+    if (!S_ISSOCK (st.st_mode))
+    {
+      fprintf (stderr, "%s: exists and is not a socket\n", path);
+      exit (2);
+    }
+    (void) unlink (path);
+  }
+  if (bind (fd, (struct sockaddr *) &saddr, sizeof (saddr)) == -1)
+  {
+    perror ("bind()");
+    exit (2); /* will kill any waiting threads */
+  }
+  if (listen (fd, SOMAXCONN) == -1)
   {
     perror ("listen()");
     exit (2); /* will kill any waiting threads */
@@ -249,9 +1076,24 @@ static int open_tcpserver_sock (int port)
   if (print_tcp)
     printf ("listening ... ");
   fflush (stdout);
+  servsock_path = strdup (path);
   return fd;
 }
 
+static void close_servsock (void)
+{
+  if (fdservsock == -1)
+    return;
+  close (fdservsock);
+  fdservsock = -1;
+  if (servsock_path)
+  {
+    (void) unlink (servsock_path);
+    free (servsock_path);
+    servsock_path = NULL;
+  }
+}
+
 static void usage (const char *argv0)
 {
   fprintf (stderr, "\
@@ -306,6 +1148,12 @@ OPTIONS:\n\
   -M TO:U         wait for matching reader with user_data U and not owned\n\
                   by this instance of pubsub\n\
   -n N            limit take/read to N samples\n\
+  -o PATH[:SIZE]  write printed samples of this reader to PATH instead of\n\
+                  stdout, %%i, %%t, %%p in PATH are replaced by reader index,\n\
+                  topic name and process id; if SIZE is given (k, M, G\n\
+                  suffixes allowed), switch to a new file once it exceeds SIZE\n\
+                  bytes, replacing %%r by the file number, or appending\n\
+                  .N if there is no %%r; set per-reader\n\
   -O              take/read once then exit 0 if samples present, or 1 if not\n\
   -P MODES        printing control (prefixing with \"no\" disables):\n\
                     meta           enable printing of all metadata\n\
@@ -324,12 +1172,35 @@ OPTIONS:\n\
                     latency[=F]    show latency information for -mc[p] mode\n\
                                    =F: write raw 64-bit current & source\n\
                                        timestamps to file F\n\
+                    perf           show hardware performance counters per\n\
+                                   sample for -mc mode and auto writers\n\
                   additionally, for ARB types the following have effect:\n\
                     type           print type definition at start up\n\
                     dense          no additional white space, no field names\n\
                     fields         field names, some white space\n\
                     multiline      field names, one field per line\n\
+                    json           JSON Lines, metadata as members\n\
+                    bin            binary frames as accepted by -b (only\n\
+                                   for ARB; best combined with -o)\n\
+                    csv            CSV with a header line, one column per\n\
+                                   metadata item and per primitive field\n\
+                                   (sequences and unions as JSON)\n\
                     chop:N         chop to N characters (N = 0 is allowed)\n\
+                    delta[:N]      print only fields that changed since the\n\
+                                   previous sample of the instance, skip\n\
+                                   unchanged ones (nested objects in\n\
+                                   JSON); tracks at most N instances\n\
+                                   (default: 10000)\n\
+                    every:N        print only every Nth sample\n\
+                    maxrate:R      print at most R samples/s per instance\n\
+                    latest:T       print at most one sample per instance\n\
+                                   every T seconds, the latest one received\n\
+                                   (every, maxrate and latest print a summary\n\
+                                   of skipped samples every second on\n\
+                                   stderr, with -X also as event decimation)\n\
+                    proj:P,...     print only fields with member paths P (e.g.,\n\
+                                   pos.x, a[2].b; keys are not included unless\n\
+                                   listed); consumes rest of MODES\n\
                   for non-once mode:\n\
                     finaltake      print a \"final take\" notice before the\n\
                                    results of the optional final take just\n\
@@ -338,7 +1209,11 @@ OPTIONS:\n\
                     tcp            print when listening for or accepting a new\n\
                                    connection\n\
                   default is \"nometa,state,fields,finalttake\".\n\
-  -r              register instances (-wN mode only)\n\
+  -r              register instances (-wN mode); for ARB writers, register\n\
+                  each instance on first use and write using its handle\n\
+  -H N            for -r with ARB writers, remember the handles of at most\n\
+                  N instances, least-recently used first forgotten (default:\n\
+                  10000, at most 16777216; 0 disables the cache)\n\
   -R              use 'read' instead of 'take'\n\
   -$              perform one final take-all just before stopping\n\
   -s MS           sleep MS ms after each read/take (default: 0)\n\
@@ -349,12 +1224,47 @@ OPTIONS:\n\
                     N:R*B cycle through N keys at R bursts/second, each burst\n\
                           consisting of B samples\n\
                     N:R   as above, B=1\n\
-                    :P    listen on TCP port P\n\
+                    :P    listen on TCP port P, serving any number of\n\
+                          clients concurrently\n\
+                    :PATH as :P, but on UNIX domain socket PATH, which\n\
+                          must contain a / (e.g. :./sock)\n\
+                    FILE  read from FILE\n\
+                    @FILE read from FILE using mmap, parsing in place and\n\
+                          reporting progress on stderr; @@FILE also advises\n\
+                          the kernel of sequential access\n\
                     H:P   connect to TCP host H, port P\n\
                   no writer is created if -w0 and no writer listener\n\
                   automatic specifications can be given per writer; final\n\
                   interactive specification determines input used for non-\n\
                   automatic ones\n\
+  -B N            parse ARB input in a separate thread from writing it, with\n\
+                  up to N parsed operations queued (default: 0, no pipeline)\n\
+  -b              input consists of binary frames for ARB writers instead\n\
+                  of text (see README)\n\
+  -X FMT:FILE     also write the periodic reports and final totals to FILE,\n\
+                  FMT is json (JSON Lines) or prom (Prometheus text format,\n\
+                  FILE is replaced with the latest values on every report)\n\
+  -I ID           run id included in -X output (default: HOST-PID-TIME)\n\
+  -t FILE[:N[:M]] trace every Nth write, wait, take, print and sleep of each\n\
+                  thread (default: 1), keeping the last M of each thread\n\
+                  (default: 65536), written to FILE as Chrome trace-event\n\
+                  JSON on exit\n\
+  -L N[:T]        for K* readers in check mode, remember the last N samples\n\
+                  and wakeups (default: 1024; 0 disables; at most 16777216)\n\
+                  and print them on an out-of-sequence sample, a latency\n\
+                  over T seconds and SIGUSR2\n\
+  -G A[,A...]     assertions checked by each K* reader in check mode and\n\
+                  each automatic writer over the run, each violated kind\n\
+                  setting a bit in the exit status, A:\n\
+                    rate:N     at least N samples/s read or written   (8)\n\
+                    loss:F     at most fraction F out of sequence    (16)\n\
+                    pQ:T       latency percentile Q (p99, p999, ...)\n\
+                               at most T seconds                     (32)\n\
+                    blocked:F  writer in write at most fraction F\n\
+                               of the time                           (64)\n\
+                    cpu:US     at most US us CPU time per sample    (128)\n\
+                    warmup:S   ignore the first S seconds after the\n\
+                               first sample (default: 0)\n\
   -S EVENTS       monitor status events (comma separated; default: none)\n\
                   reader (abbreviated and full form):\n\
                     pr   pre-read (virtual event)\n\
@@ -762,44 +1672,133 @@ static void do_ddsi_control(const char *args)
   q_osplserModule_ddsi_controlDataWriter_write(ddsi_control_wr, &x, DDS_HANDLE_NIL);
 }
 
-static int fd_getc (int fd)
+/* Input is read in blocks, fd_getc and getl_simple serve it from inbuf;
+   inbuf_reset must be called whenever the input fd changes.  With
+   inbuf_map, the buffer is the entire (mapped) input file; with
+   inbuf_borrow, it is the complete lines received on a TCP connection.
+   It is per thread because every TCP connection has a thread of its
+   own, these only borrow, so the storage is used by one thread only */
+static char inbuf_storage[65536];
+static __thread struct inbuf {
+  int fd;
+  size_t pos, len;
+  char *buf;
+  int mapped; /* 1: mmap-ed input file, 2: borrowed buffer */
+  size_t mapsize;
+  size_t progress_pos;
+  unsigned long long progress_t;
+} inbuf = { .fd = -1, .pos = 0, .len = 0, .buf = inbuf_storage, .mapped = 0 };
+
+static void inbuf_unmap (void)
 {
-  /* like fgetc, but also returning EOF when need to terminate */
-  fd_set fds;
-  int maxfd;
-  int r;
-
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-  FD_SET(termpipe[0], &fds);
-  maxfd = (fd > termpipe[0]) ? fd : termpipe[0];
-
-  while (1)
+  if (inbuf.mapped)
   {
-    r = select(maxfd + 1, &fds, NULL, NULL, NULL);
+    if (inbuf.mapped == 1)
+      munmap (inbuf.buf, inbuf.mapsize);
+    inbuf.buf = inbuf_storage;
+    inbuf.mapped = 0;
+  }
+}
+
+static void inbuf_reset (int fd)
+{
+  inbuf_unmap ();
+  inbuf.fd = fd;
+  inbuf.pos = inbuf.len = 0;
+}
+
+static void inbuf_map (int fd, int sequential)
+{
+  /* Maps the file with at least one zero byte following it, so it can be
+     parsed in place as a string; the zero page is reserved first so that
+     a file of an exact multiple of the page size works, too */
+  const size_t pagesize = (size_t) sysconf (_SC_PAGESIZE);
+  struct stat st;
+  void *p;
+  inbuf_reset (fd);
+  if (fstat (fd, &st) != 0)
+    error ("inbuf_map: fstat: errno %d\n", errno);
+  inbuf.len = (size_t) st.st_size;
+  inbuf.mapsize = (inbuf.len / pagesize + 1) * pagesize;
+  if ((p = mmap (NULL, inbuf.mapsize, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED)
+    error ("inbuf_map: mmap: errno %d\n", errno);
+  if (inbuf.len > 0 && mmap (p, inbuf.len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    error ("inbuf_map: mmap: errno %d\n", errno);
+  if (sequential && inbuf.len > 0)
+    (void) madvise (p, inbuf.len, MADV_SEQUENTIAL);
+  inbuf.buf = p;
+  inbuf.mapped = 1;
+  inbuf.progress_pos = 0;
+  inbuf.progress_t = nowmono ();
+}
+
+static void inbuf_borrow (int fd, char *buf, size_t len)
+{
+  /* BUF must be terminated by a 0 at BUF[LEN] */
+  inbuf_reset (fd);
+  inbuf.buf = buf;
+  inbuf.len = len;
+  inbuf.mapped = 2;
+}
+
+static void inbuf_progress (void)
+{
+  /* progress of mapped input to stderr, at most once per second */
+  if (inbuf.mapped == 1 && inbuf.pos - inbuf.progress_pos >= 1048576)
+  {
+    unsigned long long tnow = nowmono ();
+    if (tnow - inbuf.progress_t >= 1000000000)
+    {
+      fprintf (stderr, "input: %zu of %zu bytes (%.1f%%) %.1f MB/s\n",
+               inbuf.pos, inbuf.len, 100.0 * (double) inbuf.pos / (double) inbuf.len,
+               (double) (inbuf.pos - inbuf.progress_pos) / ((double) (tnow - inbuf.progress_t) / 1e3));
+      inbuf.progress_pos = inbuf.pos;
+      inbuf.progress_t = tnow;
+    }
+  }
+}
+
+static int inbuf_fill (int fd)
+{
+  /* returns 0 on EOF and when need to terminate */
+  struct pollfd fds[2];
+  if (fd != inbuf.fd)
+    inbuf_reset (fd);
+  else if (inbuf.mapped)
+    return 0;
+  fds[0].fd = termpipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = fd;
+  fds[1].events = POLLIN;
+  while (1)
+  {
+    int r = poll (fds, 2, -1);
     if ((r == -1 && errno == EINTR) || r == 0)
       continue;
     if (r == -1)
     {
-      perror("fd_getc: select()");
+      perror("inbuf_fill: poll()");
       exit(2);
     }
 
-    if (FD_ISSET(termpipe[0], &fds))
+    if (fds[0].revents)
     {
-      return EOF;
+      return 0;
     }
-    if (FD_ISSET(fd, &fds))
+    if (fds[1].revents)
     {
-      unsigned char c;
-      ssize_t n = read (fd, &c, 1);
-      if (n == 1)
-        return c;
+      ssize_t n = read (fd, inbuf.buf, sizeof (inbuf_storage));
+      if (n > 0)
+      {
+        inbuf.pos = 0;
+        inbuf.len = (size_t) n;
+        return 1;
+      }
       else if (n == 0)
-        return EOF;
+        return 0;
       else if (errno != EINTR)
       {
-        perror("fd_getc: read()");
+        perror("inbuf_fill: read()");
         exit(2);
       }
       /* else try again */
@@ -807,6 +1806,32 @@ static int fd_getc (int fd)
   }
 }
 
+static int fd_getc (int fd)
+{
+  /* like fgetc, but also returning EOF when need to terminate */
+  if (termflag)
+    return EOF;
+  if ((inbuf.pos == inbuf.len || fd != inbuf.fd) && !inbuf_fill (fd))
+    return EOF;
+  return (unsigned char) inbuf.buf[inbuf.pos++];
+}
+
+static size_t inbuf_read (int fd, char *dst, size_t n)
+{
+  /* returns the number of bytes copied to dst, less than n only at EOF */
+  size_t got = 0;
+  while (got < n && !termflag && ((inbuf.pos < inbuf.len && fd == inbuf.fd) || inbuf_fill (fd)))
+  {
+    size_t m = inbuf.len - inbuf.pos;
+    if (m > n - got)
+      m = n - got;
+    memcpy (dst + got, inbuf.buf + inbuf.pos, m);
+    inbuf.pos += m;
+    got += m;
+  }
+  return got;
+}
+
 static int read_int (int fd, char *buf, int bufsize, int pos, int accept_minus)
 {
   int c = EOF;
@@ -949,23 +1974,32 @@ static int read_value (int fd, char *command, int *key, struct tstamp_t *tstamp,
 static char *getl_simple (int fd, int *count)
 {
   size_t sz = 0, n = 0;
-  char *line;
-  int c;
+  char *line = NULL;
+  int eol = 0;
 
-  if ((c = fd_getc(fd)) == EOF)
+  while (!eol && !termflag && ((inbuf.pos < inbuf.len && fd == inbuf.fd) || inbuf_fill (fd)))
+  {
+    const char *p = inbuf.buf + inbuf.pos;
+    const char *nl = memchr (p, '\n', inbuf.len - inbuf.pos);
+    size_t m = nl ? (size_t) (nl - p) : inbuf.len - inbuf.pos;
+    if (n + m + 1 > sz)
+    {
+      while (n + m + 1 > sz)
+        sz = sz ? 2 * sz : 256;
+      line = realloc (line, sz);
+    }
+    memcpy (line + n, p, m);
+    n += m;
+    inbuf.pos += m + (nl ? 1 : 0);
+    eol = (nl != NULL);
+  }
+  if (line == NULL && !eol)
   {
     *count = 0;
     return NULL;
   }
-
-  line = NULL;
-  do {
-    if (n == sz) line = realloc(line, sz += 256);
-    line[n++] = (char) c;
-  } while ((c = fd_getc (fd)) != EOF && c != '\n');
-  if (n == sz) line = realloc(line, sz += 256);
-  line[n++] = 0;
-  *count = (int) (n-1);
+  line[n] = 0;
+  *count = (int) n;
   return line;
 }
 
@@ -1038,12 +2072,6 @@ static void getl_init_editline (struct getl_arg *arg, int fd)
 }
 #endif
 
-static void getl_reset_input (struct getl_arg *arg, int fd)
-{
-  assert (!arg->use_editline);
-  arg->u.s.fd = fd;
-}
-
 static void getl_fini (struct getl_arg *arg)
 {
   if (arg->use_editline)
@@ -1172,7 +2200,7 @@ static DDS_ReturnCode_t getkeyval_K256 (Keyed256DataReader rd, int32_t *key, DDS
   return result;
 }
 
-static int print_sampleinfo (unsigned long long *tstart, unsigned long long tnow, const DDS_SampleInfo *si, const char *tag)
+static int print_sampleinfo (FILE *out, unsigned long long *tstart, unsigned long long tnow, const DDS_SampleInfo *si, const char *tag)
 {
   unsigned long long relt;
   uint32_t phSystemId, phLocalId, ihSystemId, ihLocalId;
@@ -1186,55 +2214,236 @@ static int print_sampleinfo (unsigned long long *tstart, unsigned long long tnow
   instancehandle_to_id(&phSystemId, &phLocalId, si->publication_handle);
   sep = "";
   if (print_metadata & PM_PID)
-    n += printf ("%d", pid);
+    n += fprintf (out, "%d", pid);
   if (print_metadata & PM_TOPIC)
-    n += printf ("%s", tag);
+    n += fprintf (out, "%s", tag);
   if (print_metadata & PM_TIME)
-    n += printf ("%s%u.%09u", n > 0 ? " " : "", (unsigned) (relt / 1000000000), (unsigned) (relt % 1000000000));
+    n += fprintf (out, "%s%u.%09u", n > 0 ? " " : "", (unsigned) (relt / 1000000000), (unsigned) (relt % 1000000000));
   sep = " : ";
   if (print_metadata & PM_PHANDLE) {
-    n += printf ("%s%" PRIx32 ":%" PRIx32, n > 0 ? sep : "", phSystemId, phLocalId); sep = " ";
+    n += fprintf (out, "%s%" PRIx32 ":%" PRIx32, n > 0 ? sep : "", phSystemId, phLocalId); sep = " ";
   }
   if (print_metadata & PM_IHANDLE) {
-    n += printf ("%s%" PRIx32 ":%" PRIx32, n > 0 ? sep : "", ihSystemId, ihLocalId);
+    n += fprintf (out, "%s%" PRIx32 ":%" PRIx32, n > 0 ? sep : "", ihSystemId, ihLocalId);
   }
   sep = " : ";
   if (print_metadata & PM_STIME) {
-    n += printf ("%s%u.%09u", n > 0 ? sep : "", si->source_timestamp.sec, si->source_timestamp.nanosec);
+    n += fprintf (out, "%s%u.%09u", n > 0 ? sep : "", si->source_timestamp.sec, si->source_timestamp.nanosec);
     sep = " ";
   }
   if (print_metadata & PM_RTIME) {
-    n += printf ("%s%u.%09u", n > 0 ? sep : "", si->reception_timestamp.sec, si->reception_timestamp.nanosec);
+    n += fprintf (out, "%s%u.%09u", n > 0 ? sep : "", si->reception_timestamp.sec, si->reception_timestamp.nanosec);
   }
   sep = " : ";
   if (print_metadata & PM_DGEN) {
-    n += printf ("%s%d", n > 0 ? sep : "", si->disposed_generation_count);
+    n += fprintf (out, "%s%d", n > 0 ? sep : "", si->disposed_generation_count);
     sep = " ";
   }
   if (print_metadata & PM_NWGEN) {
-    n += printf ("%s%d", n > 0 ? sep : "", si->no_writers_generation_count);
+    n += fprintf (out, "%s%d", n > 0 ? sep : "", si->no_writers_generation_count);
     sep = " ";
   }
   sep = " : ";
   if (print_metadata & PM_RANKS) {
-    n += printf ("%s%d %d %d", n > 0 ? sep : "", si->sample_rank, si->generation_rank, si->absolute_generation_rank);
+    n += fprintf (out, "%s%d %d %d", n > 0 ? sep : "", si->sample_rank, si->generation_rank, si->absolute_generation_rank);
     sep = " ";
   }
   sep = " : ";
   if (print_metadata & PM_STATE) {
-    n += printf ("%s%c%c%c", n > 0 ? sep : "", isc, ssc, vsc);
+    n += fprintf (out, "%s%c%c%c", n > 0 ? sep : "", isc, ssc, vsc);
     sep = " ";
   }
   return (n > 0);
 }
 
-static void print_K (unsigned long long *tstart, unsigned long long tnow, DDS_DataReader rd, const char *tag, const DDS_SampleInfo *si, int32_t keyval, uint32_t seq, DDS_ReturnCode_t (*getkeyval) (DDS_DataReader rd, int32_t *key, DDS_InstanceHandle_t ih))
+static void print_quoted (FILE *out, const char *str, int csv)
+{
+  /* quoted as tglib quotes string fields: doubling quotes in CSV,
+     backslash escapes in JSON */
+  fputc ('"', out);
+  for (; *str; str++)
+  {
+    const unsigned char ch = (unsigned char) *str;
+    if (ch == '"')
+      fputs (csv ? "\"\"" : "\\\"", out);
+    else if (ch == '\\' && !csv)
+      fputs ("\\\\", out);
+    else if (ch < 0x20 && !csv)
+      fprintf (out, "\\u%04x", ch);
+    else
+      fputc (ch, out);
+  }
+  fputc ('"', out);
+}
+
+static void print_time_typed (FILE *out, const char *fld, const DDS_Time_t *t, int csv)
+{
+  /* an invalid time is null in JSON and an empty field in CSV */
+  if (t->sec == DDS_TIMESTAMP_INVALID_SEC && t->nanosec == DDS_TIMESTAMP_INVALID_NSEC)
+    fprintf (out, "%s%s,", fld, csv ? "" : "null");
+  else
+    fprintf (out, "%s%d.%09u,", fld, t->sec, t->nanosec);
+}
+
+/* metadata as typed JSON members or CSV fields, always followed by a
+   separator because the sample itself follows */
+static void print_sampleinfo_typed (FILE *out, unsigned long long *tstart, unsigned long long tnow, const DDS_SampleInfo *si, const char *tag, int csv)
+{
+  unsigned long long relt;
+  uint32_t phSystemId, phLocalId, ihSystemId, ihLocalId;
+  const char *q = csv ? "" : "\"";
+#define FLD(name) (csv ? "" : "\"" name "\":")
+  if (*tstart == 0)
+    *tstart = tnow;
+  relt = tnow - *tstart;
+  instancehandle_to_id(&ihSystemId, &ihLocalId, si->instance_handle);
+  instancehandle_to_id(&phSystemId, &phLocalId, si->publication_handle);
+  if (print_metadata & PM_PID)
+    fprintf (out, "%s%d,", FLD("pid"), pid);
+  if (print_metadata & PM_TOPIC)
+  {
+    fprintf (out, "%s", FLD("topic"));
+    print_quoted (out, tag, csv);
+    fputc (',', out);
+  }
+  if (print_metadata & PM_TIME)
+    fprintf (out, "%s%u.%09u,", FLD("time"), (unsigned) (relt / 1000000000), (unsigned) (relt % 1000000000));
+  if (print_metadata & PM_PHANDLE)
+    fprintf (out, "%s%s%" PRIx32 ":%" PRIx32 "%s,", FLD("phandle"), q, phSystemId, phLocalId, q);
+  if (print_metadata & PM_IHANDLE)
+    fprintf (out, "%s%s%" PRIx32 ":%" PRIx32 "%s,", FLD("ihandle"), q, ihSystemId, ihLocalId, q);
+  if (print_metadata & PM_STIME)
+    print_time_typed (out, FLD("stime"), &si->source_timestamp, csv);
+  if (print_metadata & PM_RTIME)
+    print_time_typed (out, FLD("rtime"), &si->reception_timestamp, csv);
+  if (print_metadata & PM_DGEN)
+    fprintf (out, "%s%d,", FLD("dgen"), si->disposed_generation_count);
+  if (print_metadata & PM_NWGEN)
+    fprintf (out, "%s%d,", FLD("nwgen"), si->no_writers_generation_count);
+  if (print_metadata & PM_RANKS)
+    fprintf (out, "%s%d,%s%d,%s%d,", FLD("srank"), si->sample_rank, FLD("grank"), si->generation_rank, FLD("agrank"), si->absolute_generation_rank);
+  if (print_metadata & PM_STATE)
+    fprintf (out, "%s%s%c%s,%s%s%c%s,%s%s%c%s,", FLD("istate"), q, si2isc (si), q, FLD("sstate"), q, si2ssc (si), q, FLD("vstate"), q, si2vsc (si), q);
+#undef FLD
+}
+
+static void print_csv_header (const struct readerspec *spec)
+{
+  FILE *out = spec->sink->fp;
+  static const struct { unsigned flag; const char *names; } tab[] = {
+    { PM_PID, "pid," }, { PM_TOPIC, "topic," }, { PM_TIME, "time," },
+    { PM_PHANDLE, "phandle," }, { PM_IHANDLE, "ihandle," },
+    { PM_STIME, "stime," }, { PM_RTIME, "rtime," },
+    { PM_DGEN, "dgen," }, { PM_NWGEN, "nwgen," },
+    { PM_RANKS, "srank,grank,agrank," },
+    { PM_STATE, "istate,sstate,vstate," }
+  };
+  struct tgstring str;
+  size_t i;
+  tgstring_init(&str, ~(size_t)0);
+  (void)tgprintcsvhdr(&str, spec->tgtp, spec->tgproj);
+  for (i = 0; i < sizeof (tab) / sizeof (tab[0]); i++)
+    if (print_metadata & tab[i].flag)
+      fprintf (out, "%s", tab[i].names);
+  fprintf (out, "valid,%s\n", str.buf);
+  tgstring_fini(&str);
+}
+
+static char *sink_path (struct sink *sk)
+{
+  size_t size = strlen (sk->pattern) + 32, pos = 0;
+  char *path = malloc (size);
+  const char *p;
+  sk->has_seq = 0;
+  for (p = sk->pattern; *p; p++)
+  {
+    char tmp[32];
+    const char *ins = tmp;
+    if (*p != '%' || p[1] == 0)
+      snprintf (tmp, sizeof (tmp), "%c", *p);
+    else
+    {
+      switch (*++p)
+      {
+        case 'i': snprintf (tmp, sizeof (tmp), "%u", sk->idx); break;
+        case 't': ins = sk->topic; break;
+        case 'p': snprintf (tmp, sizeof (tmp), "%d", (int) getpid ()); break;
+        case 'r': snprintf (tmp, sizeof (tmp), "%u", sk->seq); sk->has_seq = 1; break;
+        case '%': strcpy (tmp, "%"); break;
+        default: snprintf (tmp, sizeof (tmp), "%%%c", *p); break;
+      }
+    }
+    while (pos + strlen (ins) + 32 > size)
+      path = realloc (path, size *= 2);
+    strcpy (path + pos, ins);
+    pos += strlen (ins);
+  }
+  path[pos] = 0;
+  if (!sk->has_seq && sk->seq > 0)
+    snprintf (path + pos, size - pos, ".%u", sk->seq);
+  return path;
+}
+
+static void sink_open (struct sink *sk)
+{
+  char *path = sink_path (sk);
+  if ((sk->fp = fopen (path, "w")) == NULL)
+    error ("%s: can't open for writing\n", path);
+  setvbuf (sk->fp, NULL, _IOFBF, 65536);
+  free (path);
+}
+
+static struct sink *sink_new (const char *pattern, unsigned long long maxsize, unsigned idx, const char *topic)
+{
+  struct sink *sk = malloc (sizeof (*sk));
+  sk->idx = idx;
+  sk->topic = strdup (topic);
+  sk->maxsize = maxsize;
+  sk->seq = 0;
+  sk->has_seq = 0;
+  if (pattern == NULL)
+  {
+    sk->pattern = NULL;
+    sk->fp = stdout;
+  }
+  else
+  {
+    sk->pattern = strdup (pattern);
+    sink_open (sk);
+  }
+  return sk;
+}
+
+static void sink_free (struct sink *sk)
+{
+  if (sk->pattern)
+  {
+    fclose (sk->fp);
+    free (sk->pattern);
+  }
+  free (sk->topic);
+  free (sk);
+}
+
+static void sink_maybe_rotate (const struct readerspec *spec)
+{
+  struct sink *sk = spec->sink;
+  if (sk->pattern == NULL || sk->maxsize == 0 || (unsigned long long) ftello (sk->fp) < sk->maxsize)
+    return;
+  fclose (sk->fp);
+  sk->seq++;
+  sink_open (sk);
+  if (print_mode == TGPM_CSV && spec->topicsel == ARB)
+    print_csv_header (spec);
+}
+
+static void print_K (FILE *out, unsigned long long *tstart, unsigned long long tnow, DDS_DataReader rd, const char *tag, const DDS_SampleInfo *si, int32_t keyval, uint32_t seq, DDS_ReturnCode_t (*getkeyval) (DDS_DataReader rd, int32_t *key, DDS_InstanceHandle_t ih))
 {
-  flockfile(stdout);
-  if (print_sampleinfo(tstart, tnow, si, tag))
-    printf(" : ");
+  flockfile(out);
+  if (print_sampleinfo(out, tstart, tnow, si, tag))
+    fprintf(out, " : ");
   if (si->valid_data)
-    printf ("%u %d\n", seq, keyval);
+    fprintf (out, "%u %d\n", seq, keyval);
   else
   {
     /* May not look at mseq->_buffer[i] but want the key value
@@ -1247,91 +2456,413 @@ static void print_K (unsigned long long *tstart, unsigned long long tnow, DDS_Da
 #if 1
     (void)rd;
     (void)getkeyval;
-    printf ("NA %u\n", keyval);
+    fprintf (out, "NA %u\n", keyval);
 #else
     DDS_ReturnCode_t result;
     int32_t d_key;
     if ((result = getkeyval (rd, &d_key, si->instance_handle)) == DDS_RETCODE_OK)
-      printf ("NA %u\n", d_key);
+      fprintf (out, "NA %u\n", d_key);
     else
-      printf ("get_key_value: error %d (%s)\n", (int) result, dds_strerror (result));
+      fprintf (out, "get_key_value: error %d (%s)\n", (int) result, dds_strerror (result));
 #endif
   }
-  funlockfile(stdout);
+  funlockfile(out);
 }
 
-static void print_seq_KS (unsigned long long *tstart, unsigned long long tnow, KeyedSeqDataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_KeyedSeq *mseq)
+static void print_seq_KS (FILE *out, unsigned long long *tstart, unsigned long long tnow, KeyedSeqDataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_KeyedSeq *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
-    print_K (tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_KS);
+    print_K (out, tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_KS);
 }
 
-static void print_seq_K32 (unsigned long long *tstart, unsigned long long tnow, Keyed32DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed32 *mseq)
+static void print_seq_K32 (FILE *out, unsigned long long *tstart, unsigned long long tnow, Keyed32DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed32 *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
-    print_K (tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K32);
+    print_K (out, tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K32);
 }
 
-static void print_seq_K64 (unsigned long long *tstart, unsigned long long tnow, Keyed64DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed64 *mseq)
+static void print_seq_K64 (FILE *out, unsigned long long *tstart, unsigned long long tnow, Keyed64DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed64 *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
-    print_K (tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K64);
+    print_K (out, tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K64);
 }
 
-static void print_seq_K128 (unsigned long long *tstart, unsigned long long tnow, Keyed128DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed128 *mseq)
+static void print_seq_K128 (FILE *out, unsigned long long *tstart, unsigned long long tnow, Keyed128DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed128 *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
-    print_K (tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K128);
+    print_K (out, tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K128);
 }
 
-static void print_seq_K256 (unsigned long long *tstart, unsigned long long tnow, Keyed256DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed256 *mseq)
+static void print_seq_K256 (FILE *out, unsigned long long *tstart, unsigned long long tnow, Keyed256DataReader rd, const char *tag, const DDS_SampleInfoSeq *iseq, DDS_sequence_Keyed256 *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
-    print_K (tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K256);
+    print_K (out, tstart, tnow, rd, tag, &iseq->_buffer[i], mseq->_buffer[i].keyval, mseq->_buffer[i].seq, getkeyval_K256);
 }
 
-static void print_seq_OU (unsigned long long *tstart, unsigned long long tnow, OneULongDataReader rd __attribute__ ((unused)), const char *tag, const DDS_SampleInfoSeq *iseq, const DDS_sequence_OneULong *mseq)
+static void print_seq_OU (FILE *out, unsigned long long *tstart, unsigned long long tnow, OneULongDataReader rd __attribute__ ((unused)), const char *tag, const DDS_SampleInfoSeq *iseq, const DDS_sequence_OneULong *mseq)
 {
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
   {
     DDS_SampleInfo const * const si = &iseq->_buffer[i];
-    flockfile(stdout);
-    if (print_sampleinfo(tstart, tnow, si, tag))
-      printf(" : ");
+    flockfile(out);
+    if (print_sampleinfo(out, tstart, tnow, si, tag))
+      fprintf(out, " : ");
     if (si->valid_data) {
       OneULong *d = &mseq->_buffer[i];
-      printf ("%u\n", d->seq);
+      fprintf (out, "%u\n", d->seq);
     } else {
-      printf ("NA\n");
+      fprintf (out, "NA\n");
+    }
+    funlockfile(out);
+  }
+}
+
+/* Binary input (-b) is a sequence of frames, in native byte order:
+     uint32_t size      number of bytes following size
+     char command       w, d, D, u or r
+     uint8_t flags      BINF_TSTAMP, BINF_ABSTIME
+     uint16_t writer    index in list of writers reading input
+     int64_t tstamp     in ns, only present if BINF_TSTAMP
+     sample             tgencode representation
+   -P bin prints received samples as frames, with the index of the topic
+   on the command line as writer index, so a capture can be replayed */
+#define BINF_TSTAMP 1u
+#define BINF_ABSTIME 2u
+
+static void print_frame_ARB (FILE *out, const DDS_SampleInfo *si, const char *data, const struct readerspec *spec)
+{
+  const int keyonly = !si->valid_data;
+  const size_t samplesize = tgencodesize (spec->tgtp, data, keyonly);
+  const int64_t tstamp = si->source_timestamp.sec * T_SECOND + si->source_timestamp.nanosec;
+  const uint32_t size = (uint32_t) (4 + sizeof (tstamp) + samplesize);
+  const uint16_t widx = (uint16_t) spec->idx;
+  char hdr[16], *buf = malloc (samplesize);
+  memcpy (hdr, &size, 4);
+  if (si->valid_data)
+    hdr[4] = 'w';
+  else
+    hdr[4] = (si->instance_state == DDS_NOT_ALIVE_DISPOSED_INSTANCE_STATE) ? 'd' : 'u';
+  hdr[5] = (char) (BINF_TSTAMP | BINF_ABSTIME);
+  memcpy (hdr + 6, &widx, 2);
+  memcpy (hdr + 8, &tstamp, 8);
+  tgencode (spec->tgtp, buf, data, keyonly);
+  flockfile(out);
+  fwrite (hdr, 1, sizeof (hdr), out);
+  fwrite (buf, 1, samplesize, out);
+  funlockfile(out);
+  free (buf);
+}
+
+static void print_sample_ARB (unsigned long long *tstart, unsigned long long tnow, const char *tag, const DDS_SampleInfo *si, const char *data, const struct readerspec *spec)
+{
+  FILE *out = spec->sink->fp;
+  struct tgstring str;
+  if (print_binary)
+  {
+    print_frame_ARB (out, si, data, spec);
+    return;
+  }
+  tgstring_init(&str, print_chop);
+  if (spec->tgdelta && si->instance_state != DDS_ALIVE_INSTANCE_STATE)
+    tgdelta_forget(spec->tgdelta, si->instance_handle);
+  if (!si->valid_data)
+    (void)tgprintkey(&str, spec->tgtp, spec->tgproj, data, print_mode);
+  else if (spec->tgdelta)
+  {
+    if (!tgprintdelta(&str, spec->tgdelta, si->instance_handle, data, print_mode))
+    {
+      tgstring_fini(&str);
+      return;
+    }
+  }
+  else if (spec->tgproj)
+    (void)tgprintproj(&str, spec->tgproj, data, print_mode);
+  else
+    (void)tgprint(&str, spec->tgtp, data, print_mode);
+  flockfile(out);
+  if (print_mode == TGPM_JSON || print_mode == TGPM_CSV)
+  {
+    const int csv = (print_mode == TGPM_CSV);
+    if (!csv)
+      fprintf(out, "{");
+    print_sampleinfo_typed(out, tstart, tnow, si, tag, csv);
+    if (csv)
+      fprintf(out, "%d,%s\n", si->valid_data ? 1 : 0, str.buf);
+    else
+      fprintf(out, "\"valid\":%s,\"%s\":%s}\n", si->valid_data ? "true" : "false", si->valid_data ? "data" : "key", str.buf[0] ? str.buf : "null");
+  }
+  else
+  {
+    if (print_sampleinfo(out, tstart, tnow, si, tag) && print_chop > 0)
+      fprintf(out, " : ");
+    fprintf(out, "%s\n", str.buf);
+  }
+  funlockfile(out);
+  tgstring_fini(&str);
+}
+
+struct decimate_inst {
+  DDS_InstanceHandle_t ih;
+  struct decimate_inst *lrunext, *lruprev;
+  unsigned long long tlast; /* when last admitted (nowmono) */
+  int pending;
+  unsigned long long tpending; /* read time of pending sample (nowll) */
+  DDS_SampleInfo si;
+  size_t cap;
+  void *data; /* tgcopy of pending sample */
+};
+
+struct decimate {
+  unsigned every, count;
+  unsigned long long mindt, interval, tflush, tsummary; /* nowmono */
+  long long nprinted, nskip_every, nskip_rate, nsuperseded, last_nskip;
+  unsigned ninst, hmask;
+  struct decimate_inst **htab; /* open addressing, linear probing */
+  struct decimate_inst lru; /* sentinel: lru.lrunext is most recently used */
+};
+
+static struct decimate *decimate_new (unsigned long long tmono)
+{
+  struct decimate *dec;
+  if (print_every <= 1 && print_maxrate <= 0.0 && print_latest <= 0.0)
+    return NULL;
+  dec = malloc (sizeof (*dec));
+  dec->every = print_every;
+  dec->count = 0;
+  dec->mindt = (print_maxrate > 0.0) ? (unsigned long long) (1e9 / print_maxrate) : 0;
+  dec->interval = (print_latest > 0.0) ? (unsigned long long) (1e9 * print_latest) : 0;
+  dec->tflush = tmono + dec->interval;
+  dec->tsummary = tmono + 1000000000;
+  dec->nprinted = dec->nskip_every = dec->nskip_rate = dec->nsuperseded = dec->last_nskip = 0;
+  dec->ninst = 0;
+  dec->hmask = 255;
+  dec->htab = calloc (dec->hmask + 1, sizeof (*dec->htab));
+  dec->lru.lrunext = dec->lru.lruprev = &dec->lru;
+  return dec;
+}
+
+static void decimate_free (struct decimate *dec)
+{
+  unsigned i;
+  for (i = 0; i <= dec->hmask; i++)
+  {
+    if (dec->htab[i])
+    {
+      free (dec->htab[i]->data);
+      free (dec->htab[i]);
+    }
+  }
+  free (dec->htab);
+  free (dec);
+}
+
+static unsigned decimate_hash (const struct decimate *dec, DDS_InstanceHandle_t ih)
+{
+  return (unsigned) (((uint64_t) ih * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & dec->hmask;
+}
+
+static unsigned decimate_find (const struct decimate *dec, DDS_InstanceHandle_t ih)
+{
+  unsigned i = decimate_hash (dec, ih);
+  while (dec->htab[i] != NULL && dec->htab[i]->ih != ih)
+    i = (i + 1) & dec->hmask;
+  return i;
+}
+
+static void decimate_print_pending (struct decimate *dec, struct decimate_inst *inst, unsigned long long *tstart, const char *tag, const struct readerspec *spec)
+{
+  print_sample_ARB (tstart, inst->tpending, tag, &inst->si, inst->data, spec);
+  inst->pending = 0;
+  dec->nprinted++;
+}
+
+static void decimate_remove (struct decimate *dec, unsigned i)
+{
+  struct decimate_inst *inst = dec->htab[i];
+  unsigned j = i;
+  inst->lruprev->lrunext = inst->lrunext;
+  inst->lrunext->lruprev = inst->lruprev;
+  free (inst->data);
+  free (inst);
+  dec->ninst--;
+  /* backward shift deletion keeps probe sequences intact */
+  dec->htab[i] = NULL;
+  for (;;)
+  {
+    unsigned h;
+    j = (j + 1) & dec->hmask;
+    if (dec->htab[j] == NULL)
+      break;
+    h = decimate_hash (dec, dec->htab[j]->ih);
+    if (((j - h) & dec->hmask) >= ((j - i) & dec->hmask))
+    {
+      dec->htab[i] = dec->htab[j];
+      dec->htab[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+/* Returns the (most recently used) entry for ih, creating it if need
+   be; beyond TG_MAXINST instances the least recently used one is
+   evicted, after printing its pending sample */
+static struct decimate_inst *decimate_lookup (struct decimate *dec, DDS_InstanceHandle_t ih, unsigned long long *tstart, const char *tag, const struct readerspec *spec)
+{
+  unsigned i = decimate_find (dec, ih);
+  struct decimate_inst *inst = dec->htab[i];
+  if (inst != NULL)
+  {
+    inst->lruprev->lrunext = inst->lrunext;
+    inst->lrunext->lruprev = inst->lruprev;
+  }
+  else
+  {
+    if (dec->ninst == TG_MAXINST)
+    {
+      struct decimate_inst *old = dec->lru.lruprev;
+      if (old->pending)
+        decimate_print_pending (dec, old, tstart, tag, spec);
+      decimate_remove (dec, decimate_find (dec, old->ih));
+      i = decimate_find (dec, ih);
+    }
+    if (2 * (dec->ninst + 1) > dec->hmask + 1)
+    {
+      struct decimate_inst **old = dec->htab;
+      const unsigned oldmask = dec->hmask;
+      unsigned j;
+      dec->hmask = 2 * dec->hmask + 1;
+      dec->htab = calloc (dec->hmask + 1, sizeof (*dec->htab));
+      for (j = 0; j <= oldmask; j++)
+      {
+        if (old[j])
+        {
+          unsigned k = decimate_hash (dec, old[j]->ih);
+          while (dec->htab[k] != NULL)
+            k = (k + 1) & dec->hmask;
+          dec->htab[k] = old[j];
+        }
+      }
+      free (old);
+      i = decimate_find (dec, ih);
+    }
+    inst = malloc (sizeof (*inst));
+    inst->ih = ih;
+    inst->tlast = 0;
+    inst->pending = 0;
+    inst->cap = 0;
+    inst->data = NULL;
+    dec->htab[i] = inst;
+    dec->ninst++;
+  }
+  inst->lrunext = dec->lru.lrunext;
+  inst->lruprev = &dec->lru;
+  dec->lru.lrunext->lruprev = inst;
+  dec->lru.lrunext = inst;
+  return inst;
+}
+
+/* Returns 1 if the sample is to be printed now; else it is either
+   skipped or, if printing the latest per interval, held back */
+static int decimate_admit (struct decimate *dec, unsigned long long *tstart, unsigned long long tnow, unsigned long long tmono, const char *tag, const DDS_SampleInfo *si, const char *data, const struct readerspec *spec)
+{
+  struct decimate_inst *inst;
+  size_t sz;
+  if (dec->every > 1 && dec->count++ % dec->every != 0)
+  {
+    dec->nskip_every++;
+    return 0;
+  }
+  if (dec->mindt == 0 && dec->interval == 0)
+  {
+    dec->nprinted++;
+    return 1;
+  }
+  inst = decimate_lookup (dec, si->instance_handle, tstart, tag, spec);
+  if (!si->valid_data)
+  {
+    /* invalid samples only have a key, no point in copying them and
+       they mark a state change: don't delay them; once disposed or
+       unregistered, the instance need not be tracked anymore */
+    if (inst->pending)
+      decimate_print_pending (dec, inst, tstart, tag, spec);
+    if (si->instance_state != DDS_ALIVE_INSTANCE_STATE)
+      decimate_remove (dec, decimate_find (dec, si->instance_handle));
+    dec->nprinted++;
+    return 1;
+  }
+  if (dec->mindt && inst->tlast != 0 && tmono - inst->tlast < dec->mindt)
+  {
+    dec->nskip_rate++;
+    return 0;
+  }
+  inst->tlast = tmono;
+  if (dec->interval == 0)
+  {
+    dec->nprinted++;
+    return 1;
+  }
+  if (inst->pending)
+    dec->nsuperseded++;
+  if ((sz = tgcopysize (spec->tgtp, data)) > inst->cap)
+  {
+    inst->data = realloc (inst->data, sz);
+    inst->cap = sz;
+  }
+  tgcopy (spec->tgtp, inst->data, data);
+  inst->si = *si;
+  inst->tpending = tnow;
+  inst->pending = 1;
+  return 0;
+}
+
+static void decimate_tick (struct decimate *dec, unsigned long long *tstart, unsigned long long tmono, const char *tag, const struct readerspec *spec, int final)
+{
+  if (dec->interval && (tmono >= dec->tflush || final))
+  {
+    unsigned i;
+    for (i = 0; i <= dec->hmask; i++)
+      if (dec->htab[i] && dec->htab[i]->pending)
+        decimate_print_pending (dec, dec->htab[i], tstart, tag, spec);
+    dec->tflush = tmono + dec->interval;
+  }
+  if (tmono >= dec->tsummary || final)
+  {
+    /* on stderr and as a metrics event, never in the (JSON, CSV or
+       binary) output of the reader */
+    const long long nskip = dec->nskip_every + dec->nskip_rate + dec->nsuperseded;
+    if (nskip != dec->last_nskip || final)
+    {
+      struct metric ms[5];
+      fprintf (stderr, "%s decimation: printed %lld skipped %lld (every %lld rate %lld superseded %lld)\n",
+               tag, dec->nprinted, nskip, dec->nskip_every, dec->nskip_rate, dec->nsuperseded);
+      ms[0].name = "printed"; ms[0].value = (double) dec->nprinted;
+      ms[1].name = "skipped"; ms[1].value = (double) nskip;
+      ms[2].name = "skipped_every"; ms[2].value = (double) dec->nskip_every;
+      ms[3].name = "skipped_rate"; ms[3].value = (double) dec->nskip_rate;
+      ms[4].name = "superseded"; ms[4].value = (double) dec->nsuperseded;
+      metrics_emit ("decimation", &spec->tags, ms, 5);
     }
-    funlockfile(stdout);
+    dec->last_nskip = nskip;
+    dec->tsummary = tmono + 1000000000;
   }
 }
 
-static void print_seq_ARB (unsigned long long *tstart, unsigned long long tnow, DDS_DataReader rd __attribute__ ((unused)), const char *tag, const DDS_SampleInfoSeq *iseq, const DDS_sequence_octet *mseq, const struct tgtopic *tgtp)
+static void print_seq_ARB (unsigned long long *tstart, unsigned long long tnow, DDS_DataReader rd __attribute__ ((unused)), const char *tag, const DDS_SampleInfoSeq *iseq, const DDS_sequence_octet *mseq, const struct readerspec *spec, struct decimate *dec)
 {
+  const unsigned long long tmono = dec ? nowmono () : 0;
   unsigned i;
   for (i = 0; i < mseq->_length; i++)
   {
     DDS_SampleInfo const * const si = &iseq->_buffer[i];
-    struct tgstring str;
-    tgstring_init(&str, print_chop);
-    flockfile(stdout);
-    if (print_sampleinfo(tstart, tnow, si, tag) && print_chop > 0)
-      printf(" : ");
-    if (si->valid_data)
-      (void)tgprint(&str, tgtp, (char *) mseq->_buffer + i * tgtp->size, print_mode);
-    else
-      (void)tgprintkey(&str, tgtp, (char *) mseq->_buffer + i * tgtp->size, print_mode);
-    printf("%s\n", str.buf);
-    funlockfile(stdout);
-    tgstring_fini(&str);
+    const char *data = (char *) mseq->_buffer + i * spec->tgtp->size;
+    if (dec == NULL || decimate_admit (dec, tstart, tnow, tmono, tag, si, data, spec))
+      print_sample_ARB (tstart, tnow, tag, si, data, spec);
   }
 }
 
@@ -1472,52 +3003,6 @@ static void wr_on_publication_matched (void *listener_data __attribute__((unused
           systemId, localId);
 }
 
-static int w_accept(int fd)
-{
-  fd_set fds;
-  int maxfd;
-  struct sockaddr_in saddr;
-  socklen_t saddrlen = sizeof (saddr);
-  int r;
-
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-  FD_SET(termpipe[0], &fds);
-  maxfd = (fd > termpipe[0]) ? fd : termpipe[0];
-
-  while (1)
-  {
-    r = select(maxfd + 1, &fds, NULL, NULL, NULL);
-   if ((r == -1 && errno == EINTR) || r == 0)
-     continue;
-    if (r == -1)
-    {
-      perror("w_accept: select()");
-      exit(2);
-    }
-
-    if (FD_ISSET(termpipe[0], &fds))
-    {
-      return -1;
-    }
-    if (FD_ISSET(fd, &fds))
-    {
-      int fdacc;
-      if ((fdacc = accept (fd, (struct sockaddr *) &saddr, &saddrlen)) == -1)
-      {
-        if (errno != EINTR)
-        {
-          perror ("accept()");
-          exit (2);
-        }
-      }
-      if (print_tcp)
-        printf ("to %s\n", inet_ntoa (saddr.sin_addr));
-      return fdacc;
-    }
-  }
-}
-
 static DDS_ReturnCode_t register_instance_wrapper (DDS_DataWriter wr, void *d, DDS_InstanceHandle_t h, const DDS_Time_t *tstamp)
 {
   (void) h;
@@ -1604,6 +3089,26 @@ static char *skipspaces (const char *s)
   return (char *) s;
 }
 
+static char *skipblanks (const char *s)
+{
+  /* as skipspaces, but stopping at a newline */
+  while (*s && *s != '\n' && isspace((unsigned char) *s))
+    s++;
+  return (char *) s;
+}
+
+static const char *nextline (const char *s)
+{
+  const char *nl = strchr (s, '\n');
+  return nl ? nl + 1 : NULL;
+}
+
+static char *restofline (const char *s)
+{
+  const char *nl = strchr (s, '\n');
+  return nl ? strndup (s, (size_t) (nl - s)) : strdup (s);
+}
+
 static int accept_error (char command, DDS_ReturnCode_t retcode)
 {
   if (retcode == DDS_RETCODE_TIMEOUT)
@@ -1624,12 +3129,29 @@ union data {
   OneULong ou;
 };
 
+static void snapshot_writer (const struct writerspec *spec, uint64_t ntot, uint64_t telapsed, uint64_t tblocked, const struct hist *cum, const struct hist *cur)
+{
+  /* TBLOCKED is the (sampled) time spent in the write call */
+  struct metric ms[METRICS_MAX];
+  char counts[128];
+  snprintf (counts, sizeof (counts), "writes %" PRIu64 " in %.1fs", ntot, (double) telapsed / 1e9);
+  ms[0].name = "writes";
+  ms[0].value = (double) ntot;
+  snapshot_print ("write_snapshot", &spec->tags, counts, cum, cur, 0, tblocked, ms, 1);
+}
+
 static void pub_do_auto (const struct writerspec *spec)
 {
+  sig_atomic_t snapgen = snapshot_gen;
+  struct cpustats cpu;
+  struct perfstats perf;
+  struct allocstats alloc;
+  struct gate_window gw;
   DDS_ReturnCode_t result;
   DDS_InstanceHandle_t handle[nkeyvals];
   uint64_t ntot = 0, tfirst, tlast, tprev, tfirst0, tstop;
-  struct hist *hist = hist_new (30, 1000, 0);
+  uint64_t tblocked = 0, tblocked_gw = 0; /* estimated time in write, total and at last gate accounting */
+  struct hist *hist = hist_new (), *cum = hist_new ();
   int k = 0;
   union data d;
   memset (&d, 0, sizeof (d));
@@ -1668,7 +3190,13 @@ static void pub_do_auto (const struct writerspec *spec)
   }
   sleep (1);
   d.seq_keyval.keyval = 0;
-  tfirst0 = tfirst = tprev = nowll ();
+  tfirst0 = tfirst = tprev = nowmono ();
+  cpustats_init (&cpu);
+  perfstats_init (&perf, 1);
+  allocstats_init (&alloc);
+  gate_window_init (&gw, 1);
+  gate_window_begin (&gw, tfirst0);
+  perfctrs_start (perf.pc);
   if (dur != 0.0)
     tstop = tfirst0 + (unsigned long long) (1e9 * dur);
   else
@@ -1687,7 +3215,20 @@ static void pub_do_auto (const struct writerspec *spec)
   {
     while (!termflag && tprev < tstop)
     {
-      if ((result = DDS_DataWriter_write (spec->wr, &d, handle[d.seq_keyval.keyval])) != DDS_RETCODE_OK)
+      /* the time spent in write is sampled on every 16th write and
+         counted for all 16, like the histogram in burst mode */
+      const int timed = (ntot % 16) == 0;
+      const unsigned long long ttr = trace_begin (TK_WRITE);
+      unsigned long long tw0 = 0;
+      alloc_phase_set (AP_WRITE);
+      if (timed)
+        tw0 = nowmono ();
+      result = DDS_DataWriter_write (spec->wr, &d, handle[d.seq_keyval.keyval]);
+      if (timed)
+        tblocked += 16 * (nowmono () - tw0);
+      alloc_phase_set (AP_OTHER);
+      trace_end (TK_WRITE, ttr, 1);
+      if (result != DDS_RETCODE_OK)
       {
         printf ("write: error %d (%s)\n", (int) result, dds_strerror (result));
         if (result != DDS_RETCODE_TIMEOUT)
@@ -1700,16 +3241,33 @@ static void pub_do_auto (const struct writerspec *spec)
         ntot++;
         if ((d.seq % 16) == 0)
         {
-          unsigned long long t = nowll ();
+          unsigned long long t = nowmono ();
           hist_record (hist, (t - tprev) / 16, 16);
+          if (gate_window_account (&gw, t))
+          {
+            gw.n += 16;
+            gw.tblocked += tblocked - tblocked_gw;
+          }
+          tblocked_gw = tblocked;
+          if (snapgen != snapshot_gen)
+          {
+            snapgen = snapshot_gen;
+            snapshot_writer (spec, ntot, t - tfirst0, tblocked, cum, hist);
+          }
           if (t < tfirst + 4 * 1000000000ll)
             tprev = t;
           else
           {
+            const uint64_t nwr = hist_count (hist);
             tlast = t;
+            hist_merge (cum, hist);
+            metrics_writes ("write", &spec->tags, hist, tlast - tfirst);
             hist_print (hist, tlast - tfirst, 1);
+            cpustats_report (&cpu, &spec->tags, nwr);
+            perfstats_report (&perf, "perf", &spec->tags, nwr, 1);
+            allocstats_report (&alloc, NULL, "alloc", &spec->tags, nwr, 1);
             tfirst = tprev;
-            tprev = nowll ();
+            tprev = nowmono ();
           }
         }
       }
@@ -1720,7 +3278,20 @@ static void pub_do_auto (const struct writerspec *spec)
     unsigned bi = 0;
     while (!termflag && tprev < tstop)
     {
-      if ((result = DDS_DataWriter_write (spec->wr, &d, handle[d.seq_keyval.keyval])) != DDS_RETCODE_OK)
+      /* the time spent in write is sampled on every 16th write and
+         counted for all 16, like the histogram in burst mode */
+      const int timed = (ntot % 16) == 0;
+      const unsigned long long ttr = trace_begin (TK_WRITE);
+      unsigned long long tw0 = 0;
+      alloc_phase_set (AP_WRITE);
+      if (timed)
+        tw0 = nowmono ();
+      result = DDS_DataWriter_write (spec->wr, &d, handle[d.seq_keyval.keyval]);
+      if (timed)
+        tblocked += 16 * (nowmono () - tw0);
+      alloc_phase_set (AP_OTHER);
+      trace_end (TK_WRITE, ttr, 1);
+      if (result != DDS_RETCODE_OK)
       {
         printf ("write: error %d (%s)\n", (int) result, dds_strerror (result));
         if (result != DDS_RETCODE_TIMEOUT)
@@ -1728,27 +3299,46 @@ static void pub_do_auto (const struct writerspec *spec)
       }
 
       {
-        unsigned long long t = nowll ();
+        unsigned long long t = nowmono ();
         d.seq_keyval.keyval = (d.seq_keyval.keyval + 1) % (int32_t)nkeyvals;
         d.seq++;
         ntot++;
         hist_record (hist, t - tprev, 1);
+        if (gate_window_account (&gw, t))
+        {
+          gw.n++;
+          gw.tblocked += tblocked - tblocked_gw;
+        }
+        tblocked_gw = tblocked;
+        if (snapgen != snapshot_gen)
+        {
+          snapgen = snapshot_gen;
+          snapshot_writer (spec, ntot, t - tfirst0, tblocked, cum, hist);
+        }
         if (t >= tfirst + 4 * 1000000000ll)
         {
+          const uint64_t nwr = hist_count (hist);
           tlast = t;
+          hist_merge (cum, hist);
+          metrics_writes ("write", &spec->tags, hist, tlast - tfirst);
           hist_print (hist, tlast - tfirst, 1);
+          cpustats_report (&cpu, &spec->tags, nwr);
+          perfstats_report (&perf, "perf", &spec->tags, nwr, 1);
+          allocstats_report (&alloc, NULL, "alloc", &spec->tags, nwr, 1);
           tfirst = tprev;
-          t = nowll ();
+          t = nowmono ();
         }
         if (++bi == spec->burstsize)
         {
           while (((ntot / spec->burstsize) / ((t - tfirst0) / 1e9 + 5e-3)) > spec->writerate && !termflag)
           {
+            const unsigned long long ttr = trace_begin (TK_SLEEP);
             struct timespec delay;
             delay.tv_sec = 0;
             delay.tv_nsec = 10 * 1000 * 1000;
             nanosleep (&delay, NULL);
-            t = nowll ();
+            trace_end (TK_SLEEP, ttr, 0);
+            t = nowmono ();
           }
           bi = 0;
         }
@@ -1756,16 +3346,35 @@ static void pub_do_auto (const struct writerspec *spec)
       }
     }
   }
-  tlast = nowll ();
+  tlast = nowmono ();
+  perfctrs_stop (perf.pc);
+  hist_merge (cum, hist);
   hist_print(hist, tlast - tfirst, 0);
+  cpustats_report (&cpu, &spec->tags, hist_count (hist));
+  perfstats_report (&perf, "perf", &spec->tags, hist_count (hist), 1);
+  allocstats_report (&alloc, NULL, "alloc", &spec->tags, hist_count (hist), 1);
+  metrics_writes ("write_total", &spec->tags, cum, tlast - tfirst0);
+  hist_total_add (&wrhist_total, cum);
+  hist_free (cum);
   hist_free (hist);
   printf ("total writes: %" PRIu64 " (%e/s)\n", ntot, ntot * 1e9 / (tlast - tfirst0));
+  cpustats_peak (&cpu, &spec->tags);
+  perfstats_report (&perf, "perf_total", &spec->tags, ntot, 0);
+  allocstats_report (&alloc, NULL, "alloc_total", &spec->tags, ntot, 0);
+  gate_window_fini (&gw, &spec->tags, tlast);
+  perfctrs_free (perf.pc);
   if (spec->topicsel == KS)
     DDS_free (d.ks.baggage._buffer);
 }
 
-static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *seq)
-{
+struct nonarb_state {
+  uint32_t seq;
+  const struct writerspec *zspec; /* baggagesize set by 'z' applies to zspec */
+  uint32_t baggagesize;
+};
+
+static char *pub_do_nonarb(const struct writerspec *spec, int fdin, struct nonarb_state *st)
+{
   struct tstamp_t tstamp_spec = { .isabs = 0, .t = 0 };
   DDS_ReturnCode_t result;
   union data d;
@@ -1778,9 +3387,14 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
     case UNSPEC:
       assert(0);
     case KS:
-      d.ks.baggage._maximum = d.ks.baggage._length = spec->baggagesize;
-      d.ks.baggage._buffer = DDS_sequence_octet_allocbuf (spec->baggagesize);
-      memset (d.ks.baggage._buffer, 0xee, spec->baggagesize);
+      if (st->zspec != spec)
+      {
+        st->zspec = spec;
+        st->baggagesize = spec->baggagesize;
+      }
+      d.ks.baggage._maximum = d.ks.baggage._length = st->baggagesize;
+      d.ks.baggage._buffer = DDS_sequence_octet_allocbuf (st->baggagesize);
+      memset (d.ks.baggage._buffer, 0xee, st->baggagesize);
       break;
     case K32:
       memset (d.k32.baggage, 0xee, sizeof (d.k32.baggage));
@@ -1801,15 +3415,18 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
       break;
   }
   assert (fdin >= 0);
-  d.seq = *seq;
+  d.seq = st->seq;
   command = 0;
   while (command != ':' && read_value (fdin, &command, &k, &tstamp_spec, &arg))
   {
+    inbuf_progress ();
     d.seq_keyval.keyval = k;
     switch (command)
     {
       case 'w': case 'd': case 'D': case 'u': case 'r': {
         write_oper_t fn = get_write_oper(command);
+        enum alloc_phase ap;
+        unsigned long long ttr;
         DDS_Time_t tstamp;
         if (!tstamp_spec.isabs)
         {
@@ -1818,6 +3435,8 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
         }
         tstamp.sec = (int) (tstamp_spec.t / T_SECOND);
         tstamp.nanosec = (unsigned) (tstamp_spec.t % T_SECOND);
+        ttr = trace_begin (TK_WRITE);
+        ap = alloc_phase_set (AP_WRITE);
         if ((result = fn (spec->wr, &d, DDS_HANDLE_NIL, &tstamp)) != DDS_RETCODE_OK)
         {
           printf ("%s %d: error %d (%s)\n", get_write_operstr(command), k, (int) result, dds_strerror(result));
@@ -1830,6 +3449,8 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
           if (!accept_error (command, result))
             exit(2);
         }
+        alloc_phase_set (ap);
+        trace_end (TK_WRITE, ttr, 1);
         d.seq++;
         break;
       }
@@ -1841,6 +3462,7 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
         else
         {
           uint32_t baggagesize = (k != 0) ? (uint32_t) (k - 12) : 0;
+          st->baggagesize = baggagesize;
           if (d.ks.baggage._buffer)
             DDS_free (d.ks.baggage._buffer);
           d.ks.baggage._maximum = d.ks.baggage._length = baggagesize;
@@ -1880,216 +3502,1336 @@ static char *pub_do_nonarb(const struct writerspec *spec, int fdin, uint32_t *se
   }
   if (spec->topicsel == KS)
     DDS_free (d.ks.baggage._buffer);
-  *seq = d.seq;
+  st->seq = d.seq;
   if (command == ':')
     return arg;
   else
   {
-    free(arg);
+    free(arg);
+    return NULL;
+  }
+}
+
+/* Operations resulting from parsing ARB input, executed either directly
+   or, with -B, by a separate writer thread so that parsing and writing
+   overlap; the queue preserves the order of all operations.  Repeat
+   blocks are parsed once into an arb_prog and then run directly */
+enum arb_opkind {
+  AO_NONE,
+  AO_WRITE,
+  AO_PARTITION,
+  AO_SLEEP,
+  AO_NAP,
+  AO_NONDATA,
+  AO_DDSI_CONTROL,
+  AO_SNAPSHOT,
+  AO_PACE,
+  AO_REPEAT
+};
+
+/* Pacing of writes set by "at" and "ramp": the rate goes linearly from
+   r0 to r1 in tramp seconds, then stays at r1; 0 means unpaced */
+struct arb_pace {
+  double r0, r1, tramp;
+  unsigned long long tstart; /* 0 until first write */
+  uint64_t k; /* writes since tstart */
+};
+
+struct arb_op {
+  enum arb_opkind kind;
+  const struct writerspec *spec;
+  char command;
+  struct tstamp_t tstamp_spec;
+  void *data; /* AO_WRITE, allocated in arena */
+  struct tgtemplate *tmpl; /* AO_WRITE in arb_prog, if data contains $i */
+  char *arg;
+  int k;
+  struct arb_pace *pace;
+  double r0, r1, tramp; /* AO_PACE */
+  unsigned long count; /* AO_REPEAT */
+  struct arb_prog *body; /* AO_REPEAT */
+  struct tgarena *arena;
+  unsigned long line; /* input line it came from, 0 for binary frames */
+};
+
+struct arb_prog {
+  unsigned n, max;
+  struct arb_op *ops;
+  struct tgarena *arena;
+};
+
+/* Per input stream state: stdin/file, or a TCP connection */
+struct arb_stream {
+  struct arb_pipe *pp;
+  struct tgarena *arena; /* for operations executed directly */
+  struct arb_pace pace;
+  unsigned depth; /* of repeat blocks being collected */
+  char *block;
+  size_t blocklen, blocksize;
+  unsigned long line; /* number of input lines parsed */
+};
+
+struct arb_pipe {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned size, head, n;
+  int stop;
+  unsigned long failed; /* line of the last failed operation, 0 if none */
+  struct arb_op *ops;
+  pthread_t tid;
+};
+
+static unsigned pipeline_depth = 0;
+
+/* the key caches are shared by the TCP connections writing to a writer */
+static pthread_mutex_t keycache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static DDS_InstanceHandle_t arb_handle (const struct writerspec *spec, char command, void *arb, const DDS_Time_t *tstamp)
+{
+  /* registers the instance on first use; an unregister of an instance
+     not in the cache uses the key, as does a failed registration */
+  DDS_InstanceHandle_t *ih, h;
+  if (spec->keycache == NULL || command == 'r')
+    return DDS_HANDLE_NIL;
+  pthread_mutex_lock (&keycache_lock);
+  if ((ih = tgkeycache_lookup (spec->keycache, arb, command != 'u')) == NULL)
+    h = DDS_HANDLE_NIL;
+  else
+  {
+    if (*ih == DDS_HANDLE_NIL)
+      *ih = DDS_DataWriter_register_instance_w_timestamp (spec->wr, arb, tstamp);
+    h = *ih;
+  }
+  pthread_mutex_unlock (&keycache_lock);
+  return h;
+}
+
+static int arb_write (const struct writerspec *spec, char command, struct tstamp_t *tstamp_spec, void *arb)
+{
+  write_oper_t fn = get_write_oper(command);
+  DDS_ReturnCode_t result;
+  DDS_Time_t tstamp;
+  int diddodup = 0;
+  if (!tstamp_spec->isabs)
+  {
+    DDS_DomainParticipant_get_current_time(dp, &tstamp);
+    tstamp_spec->t += tstamp.sec * T_SECOND + tstamp.nanosec;
+  }
+  tstamp.sec = (int) (tstamp_spec->t / T_SECOND);
+  tstamp.nanosec = (unsigned) (tstamp_spec->t % T_SECOND);
+  result = fn (spec->wr, arb, arb_handle (spec, command, arb, &tstamp), &tstamp);
+  if (command == 'u' && spec->keycache)
+  {
+    pthread_mutex_lock (&keycache_lock);
+    tgkeycache_forget (spec->keycache, arb);
+    pthread_mutex_unlock (&keycache_lock);
+  }
+  if (result == DDS_RETCODE_OK && spec->dupwr)
+  {
+    diddodup = 1;
+    result = fn (spec->dupwr, arb, DDS_HANDLE_NIL, &tstamp);
+  }
+  if (result != DDS_RETCODE_OK)
+  {
+    printf ("%s%s: error %d (%s)\n", get_write_operstr(command), diddodup ? "(dup)" : "", (int) result, dds_strerror(result));
+    if (!accept_error (command, result))
+    {
+      if (!isatty(fdin))
+        exit(2);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void arb_pace_wait (struct arb_pace *p)
+{
+  /* the k-th write is due when the integral of the rate since tstart
+     reaches k, so there is no drift; when more than a second behind,
+     the schedule is shifted rather than catching up in a burst */
+  const double k = (double) p->k, nramp = (p->r0 + p->r1) * p->tramp / 2;
+  unsigned long long tnow = nowmono (), tdue;
+  double t;
+  if (p->r1 <= 0)
+    return;
+  if (p->tstart == 0)
+    p->tstart = tnow;
+  if (k >= nramp)
+    t = p->tramp + (k - nramp) / p->r1;
+  else if (p->r0 == p->r1)
+    t = k / p->r0;
+  else
+  {
+    const double acc = (p->r1 - p->r0) / p->tramp;
+    t = (sqrt (p->r0 * p->r0 + 2 * acc * k) - p->r0) / acc;
+  }
+  tdue = p->tstart + (unsigned long long) (t * 1e9);
+  if (tnow > tdue + 1000000000)
+    p->tstart += tnow - tdue;
+  else if (tdue > tnow)
+  {
+    struct timespec delay;
+    delay.tv_sec = (time_t) ((tdue - tnow) / 1000000000);
+    delay.tv_nsec = (long) ((tdue - tnow) % 1000000000);
+    nanosleep (&delay, NULL);
+  }
+  p->k++;
+}
+
+static void arb_pace_shift (struct arb_pace *p, unsigned long long tslept)
+{
+  /* a sleep postpones the remainder of the schedule */
+  if (p->tstart != 0)
+    p->tstart += tslept;
+}
+
+/* Input-driven writes are done by whichever thread runs the operations
+   (the input thread, a TCP connection thread or a pipeline thread), so
+   each of those keeps its own counters for the SIGUSR1 snapshot; they
+   cover all writers it writes to, and are printed with the tags of the
+   writer of the first operation run after the signal */
+struct arb_snapshot {
+  sig_atomic_t snapgen;
+  uint64_t nwrites;
+  unsigned long long tfirst, tblocked;
+};
+
+static __thread struct arb_snapshot arb_snap;
+
+static void arb_snapshot_check (const struct writerspec *spec)
+{
+  struct arb_snapshot * const s = &arb_snap;
+  if (s->tfirst == 0)
+  {
+    s->snapgen = snapshot_gen;
+    s->tfirst = nowmono ();
+  }
+  else if (s->snapgen != snapshot_gen)
+  {
+    struct metric ms[METRICS_MAX];
+    char counts[128];
+    s->snapgen = snapshot_gen;
+    snprintf (counts, sizeof (counts), "writes %" PRIu64 " in %.1fs", s->nwrites, (double) (nowmono () - s->tfirst) / 1e9);
+    ms[0].name = "writes";
+    ms[0].value = (double) s->nwrites;
+    snapshot_print ("write_snapshot", &spec->tags, counts, NULL, NULL, 0, s->tblocked, ms, 1);
+  }
+}
+
+static int arb_run (const struct arb_op *op)
+{
+  /* returns 0 if processing of the rest of the line should be skipped */
+  int ok = 1;
+  arb_snapshot_check (op->spec);
+  /* once terminating, queued operations are dropped */
+  switch (termflag ? AO_NONE : op->kind)
+  {
+    case AO_NONE:
+    case AO_REPEAT:
+      break;
+    case AO_WRITE: {
+      struct tstamp_t tstamp_spec = op->tstamp_spec;
+      unsigned long long ttr, t0;
+      enum alloc_phase ap;
+      if (op->pace)
+      {
+        ttr = trace_begin (TK_SLEEP);
+        arb_pace_wait (op->pace);
+        trace_end (TK_SLEEP, ttr, 0);
+      }
+      ttr = trace_begin (TK_WRITE);
+      ap = alloc_phase_set (AP_WRITE);
+      t0 = nowmono ();
+      ok = arb_write (op->spec, op->command, &tstamp_spec, op->data);
+      arb_snap.tblocked += nowmono () - t0;
+      arb_snap.nwrites++;
+      alloc_phase_set (ap);
+      trace_end (TK_WRITE, ttr, 1);
+      break;
+    }
+    case AO_PARTITION:
+      set_pub_partition (DDS_DataWriter_get_publisher(op->spec->wr), op->arg);
+      break;
+    case AO_SLEEP: {
+      const unsigned long long ttr = trace_begin (TK_SLEEP), t0 = nowmono ();
+      sleep ((unsigned) op->k);
+      arb_pace_shift (op->pace, nowmono () - t0);
+      trace_end (TK_SLEEP, ttr, 0);
+      break;
+    }
+    case AO_NAP: {
+      const unsigned long long ttr = trace_begin (TK_SLEEP), t0 = nowmono ();
+      usleep ((unsigned) op->k);
+      arb_pace_shift (op->pace, nowmono () - t0);
+      trace_end (TK_SLEEP, ttr, 0);
+      break;
+    }
+    case AO_NONDATA:
+      non_data_operation(op->command, op->spec->wr);
+      break;
+    case AO_DDSI_CONTROL:
+      do_ddsi_control(op->arg);
+      break;
+    case AO_SNAPSHOT:
+      make_persistent_snapshot(op->arg);
+      break;
+    case AO_PACE:
+      op->pace->r0 = op->r0;
+      op->pace->r1 = op->r1;
+      op->pace->tramp = op->tramp;
+      op->pace->tstart = 0;
+      op->pace->k = 0;
+      break;
+  }
+  return ok;
+}
+
+static void arb_release (struct arb_op *op)
+{
+  tgarena_reset (op->arena);
+  free (op->arg);
+  op->arg = NULL;
+  op->kind = AO_NONE;
+}
+
+static int arb_exec (struct arb_op *op)
+{
+  /* runs and releases an operation */
+  int ok = arb_run (op);
+  arb_release (op);
+  return ok;
+}
+
+static void *arb_pipe_writer (void *vpp)
+{
+  struct arb_pipe *pp = vpp;
+  struct allocstats alloc;
+  allocstats_init (&alloc);
+  trace_thread ("pipeline");
+  pthread_mutex_lock (&pp->lock);
+  while (1)
+  {
+    struct arb_op *op;
+    int skip, ok = 1;
+    while (pp->n == 0 && !pp->stop)
+      pthread_cond_wait (&pp->cond, &pp->lock);
+    if (pp->n == 0)
+      break;
+    op = &pp->ops[pp->head];
+    /* as without a pipeline, a failed operation ends its line */
+    skip = (op->line != 0 && op->line == pp->failed);
+    pthread_mutex_unlock (&pp->lock);
+    if (skip)
+      arb_release (op);
+    else
+      ok = arb_exec (op);
+    pthread_mutex_lock (&pp->lock);
+    if (!ok && op->line != 0)
+      pp->failed = op->line;
+    pp->head = (pp->head + 1) % pp->size;
+    pp->n--;
+    pthread_cond_broadcast (&pp->cond);
+  }
+  pthread_mutex_unlock (&pp->lock);
+  allocstats_report (&alloc, "pipeline", NULL, NULL, 0, 0);
+  return NULL;
+}
+
+static struct arb_pipe *arb_pipe_new (unsigned size)
+{
+  struct arb_pipe *pp = malloc (sizeof (*pp));
+  unsigned i;
+  pthread_mutex_init (&pp->lock, NULL);
+  pthread_cond_init (&pp->cond, NULL);
+  pp->size = size;
+  pp->head = pp->n = 0;
+  pp->stop = 0;
+  pp->failed = 0;
+  pp->ops = malloc (size * sizeof (*pp->ops));
+  for (i = 0; i < size; i++)
+  {
+    memset (&pp->ops[i], 0, sizeof (pp->ops[i]));
+    pp->ops[i].arena = tgarena_new ();
+  }
+  pthread_create (&pp->tid, NULL, arb_pipe_writer, pp);
+  return pp;
+}
+
+static struct arb_op *arb_pipe_slot (struct arb_pipe *pp)
+{
+  /* the slot is private to the parser until it is published */
+  struct arb_op *op;
+  pthread_mutex_lock (&pp->lock);
+  while (pp->n == pp->size)
+    pthread_cond_wait (&pp->cond, &pp->lock);
+  op = &pp->ops[(pp->head + pp->n) % pp->size];
+  pthread_mutex_unlock (&pp->lock);
+  return op;
+}
+
+static int arb_pipe_publish (struct arb_pipe *pp)
+{
+  /* returns 0 if an earlier operation on the same line has failed */
+  int ok;
+  pthread_mutex_lock (&pp->lock);
+  ok = (pp->ops[(pp->head + pp->n) % pp->size].line != pp->failed);
+  pp->n++;
+  pthread_cond_broadcast (&pp->cond);
+  pthread_mutex_unlock (&pp->lock);
+  return ok;
+}
+
+static void arb_pipe_drain (struct arb_pipe *pp)
+{
+  pthread_mutex_lock (&pp->lock);
+  while (pp->n > 0)
+    pthread_cond_wait (&pp->cond, &pp->lock);
+  pthread_mutex_unlock (&pp->lock);
+}
+
+static void arb_pipe_free (struct arb_pipe *pp)
+{
+  unsigned i;
+  pthread_mutex_lock (&pp->lock);
+  pp->stop = 1;
+  pthread_cond_broadcast (&pp->cond);
+  pthread_mutex_unlock (&pp->lock);
+  pthread_join (pp->tid, NULL);
+  for (i = 0; i < pp->size; i++)
+    tgarena_free (pp->ops[i].arena);
+  free (pp->ops);
+  pthread_cond_destroy (&pp->cond);
+  pthread_mutex_destroy (&pp->lock);
+  free (pp);
+}
+
+static struct arb_prog *arb_prog_new (void)
+{
+  struct arb_prog *prog = malloc (sizeof (*prog));
+  prog->n = prog->max = 0;
+  prog->ops = NULL;
+  prog->arena = tgarena_new ();
+  return prog;
+}
+
+static void arb_prog_free (struct arb_prog *prog)
+{
+  unsigned i;
+  for (i = 0; i < prog->n; i++)
+  {
+    tgtemplate_free (prog->ops[i].tmpl);
+    free (prog->ops[i].arg);
+    if (prog->ops[i].body)
+      arb_prog_free (prog->ops[i].body);
+  }
+  tgarena_free (prog->arena);
+  free (prog->ops);
+  free (prog);
+}
+
+static unsigned long long arb_prog_run (const struct arb_prog *prog, int64_t i)
+{
+  /* i is the iteration counter of the innermost repeat, substituted for
+     $i; returns the number of writes */
+  unsigned long long nwrites = 0;
+  unsigned k;
+  for (k = 0; k < prog->n && !termflag; k++)
+  {
+    const struct arb_op *op = &prog->ops[k];
+    if (op->kind == AO_REPEAT)
+    {
+      unsigned long j;
+      for (j = 0; j < op->count && !termflag; j++)
+        nwrites += arb_prog_run (op->body, (int64_t) j);
+    }
+    else
+    {
+      if (op->tmpl)
+        tgtemplate_apply (op->tmpl, i);
+      (void) arb_run (op);
+      if (op->kind == AO_WRITE)
+        nwrites++;
+    }
+  }
+  return nwrites;
+}
+
+static void arb_stream_init (struct arb_stream *st, struct arb_pipe *pp)
+{
+  memset (st, 0, sizeof (*st));
+  st->pp = pp;
+  st->arena = tgarena_new ();
+}
+
+static void arb_stream_fini (struct arb_stream *st)
+{
+  /* queued operations may refer to st->pace */
+  if (st->pp)
+    arb_pipe_drain (st->pp);
+  if (st->depth > 0)
+    printf ("unterminated repeat block ignored\n");
+  tgarena_free (st->arena);
+  free (st->block);
+}
+
+static struct arb_op *arb_newop (const struct writerspec *spec, struct arb_stream *st, struct arb_prog *prog, struct arb_op *opbuf)
+{
+  /* slot for the next operation: in the program being compiled, in the
+     pipeline or the local buffer */
+  struct arb_op *op;
+  if (prog)
+  {
+    if (prog->n == prog->max)
+    {
+      prog->max = prog->max ? 2 * prog->max : 8;
+      prog->ops = realloc (prog->ops, prog->max * sizeof (*prog->ops));
+    }
+    op = &prog->ops[prog->n];
+    memset (op, 0, sizeof (*op));
+    op->arena = prog->arena;
+  }
+  else
+  {
+    op = st->pp ? arb_pipe_slot (st->pp) : opbuf;
+    op->tmpl = NULL;
+    op->line = st->line;
+  }
+  op->spec = spec;
+  op->pace = &st->pace;
+  return op;
+}
+
+static int arb_commit (struct arb_stream *st, struct arb_prog *prog, struct arb_op *op)
+{
+  if (prog)
+  {
+    prog->n++;
+    return 1;
+  }
+  else if (st->pp)
+  {
+    return arb_pipe_publish (st->pp);
+  }
+  else
+  {
+    return arb_exec (op);
+  }
+}
+
+static int keyword (const char *line, const char *kw)
+{
+  const size_t n = strlen (kw);
+  return strncmp (line, kw, n) == 0 && !isalnum ((unsigned char) line[n]) && line[n] != '_';
+}
+
+static int parse_ramp (const char *line, double *r0, double *r1, double *tramp, int *pos)
+{
+  /* "R0..R1 over T[s]"; strtod would also take the first '.' of ".." */
+  const char *p = line, *dd;
+  char *endp;
+  if ((dd = strstr (p, "..")) == NULL)
+    return 0;
+  *r0 = strtod (p, &endp);
+  if (endp == p || (endp != dd && endp != dd + 1))
+    return 0;
+  p = dd + 2;
+  *r1 = strtod (p, &endp);
+  if (endp == p)
+    return 0;
+  p = skipblanks (endp);
+  if (!keyword (p, "over"))
+    return 0;
+  p += 4;
+  *tramp = strtod (p, &endp);
+  if (endp == p)
+    return 0;
+  if (*endp == 's')
+    endp++;
+  *pos = (int) (endp - line);
+  return *r0 >= 0 && *r1 > 0 && *tramp >= 0;
+}
+
+static char *arb_parse_line(const struct writerspec *spec, const char *line, const char **endp, struct arb_stream *st, struct arb_prog *prog)
+{
+  /* processes the commands on the first line of LINE, a line is terminated
+     by a newline or the end of the string; *ENDP is set to the start of
+     the next line, or NULL if there is none.  If PROG is non-null, the
+     operations are appended to it instead of being executed */
+  struct arb_op opbuf = { .kind = AO_NONE, .arg = NULL, .arena = st->arena };
+  char *ret = NULL;
+  const char *next = NULL;
+  int pos;
+  if (prog == NULL)
+    st->line++;
+  while (line && *(line = skipblanks(line)) != 0)
+  {
+    struct arb_op *op;
+    if (*line == '\n')
+    {
+      next = line + 1;
+      break;
+    }
+    op = arb_newop (spec, st, prog, &opbuf);
+    op->tstamp_spec.isabs = 0; op->tstamp_spec.t = 0;
+    op->command = 'w';
+    if (keyword (line, "at"))
+    {
+      if (sscanf (line + 2, "%lf%n", &op->r0, &pos) != 1 || op->r0 < 0) {
+        printf ("invalid rate: %.*s\n", (int) strcspn (line, "\n"), line);
+        next = nextline (line);
+        line = NULL;
+      } else {
+        op->kind = AO_PACE;
+        op->r1 = op->r0;
+        op->tramp = 0;
+        line += 2 + pos;
+        if (strncmp (line, "/s", 2) == 0)
+          line += 2;
+      }
+    }
+    else if (keyword (line, "ramp"))
+    {
+      if (!parse_ramp (line + 4, &op->r0, &op->r1, &op->tramp, &pos)) {
+        printf ("invalid ramp: %.*s\n", (int) strcspn (line, "\n"), line);
+        next = nextline (line);
+        line = NULL;
+      } else {
+        op->kind = AO_PACE;
+        line += 4 + pos;
+      }
+    }
+    else switch (*line)
+    {
+      case 'w': case 'd': case 'D': case 'u': case 'r':
+        op->command = *line++;
+        if (*line == '@')
+        {
+          if (*++line == '=') { ++line; op->tstamp_spec.isabs = 1; }
+          op->tstamp_spec.t = T_SECOND * strtol (line, (char **) &line, 10);
+        }
+      case '{': {
+        const enum alloc_phase ap = alloc_phase_set (AP_PARSE);
+        char *endp;
+        if (prog)
+          op->data = tgscan_template (spec->tgtp, line, &endp, op->arena, &op->tmpl);
+        else
+          op->data = tgscan_arena (spec->tgtp, line, &endp, op->arena);
+        alloc_phase_set (ap);
+        if (op->data == NULL) {
+          if (prog == NULL)
+            tgarena_reset(op->arena);
+          next = nextline (line);
+          line = NULL;
+        } else {
+          op->kind = AO_WRITE;
+          line = endp;
+        }
+        break;
+      }
+      case 'p':
+        op->kind = AO_PARTITION;
+        op->arg = restofline (line+1);
+        next = nextline (line);
+        line = NULL;
+        break;
+      case 's':
+        if (sscanf(line+1, "%d%n", &op->k, &pos) != 1 || op->k < 0) {
+          printf ("invalid sleep duration: %ds\n", op->k);
+          next = nextline (line);
+          line = NULL;
+        } else {
+          op->kind = AO_SLEEP;
+          line += 1 + pos;
+        }
+        break;
+      case 'n':
+        if (sscanf(line+1, "%d%n", &op->k, &pos) != 1 || op->k < 0) {
+          printf ("invalid nap duration: %dus\n", op->k);
+          next = nextline (line);
+          line = NULL;
+        } else {
+          op->kind = AO_NAP;
+          line += 1 + pos;
+        }
+        break;
+      case 'Y': case 'B': case 'E': case 'W': case ')': case 'Q': case 'P':
+        op->kind = AO_NONDATA;
+        op->command = *line++;
+        break;
+      case 'C':
+        op->kind = AO_DDSI_CONTROL;
+        op->arg = restofline (line+1);
+        next = nextline (line);
+        line = NULL;
+        break;
+      case 'S':
+        op->kind = AO_SNAPSHOT;
+        op->arg = restofline (line+1);
+        next = nextline (line);
+        line = NULL;
+        break;
+      case ':':
+        if (prog)
+          printf ("writer selection not supported in repeat blocks\n");
+        else
+          ret = restofline (line+1);
+        next = nextline (line);
+        line = NULL;
+        break;
+      default:
+        printf ("unrecognised command: %.*s\n", (int) strcspn (line, "\n"), line);
+        next = nextline (line);
+        line = NULL;
+        break;
+    }
+    if (op->kind != AO_NONE && !arb_commit (st, prog, op) && line)
+    {
+      next = nextline (line);
+      line = NULL;
+    }
+  }
+  if (endp)
+    *endp = next;
+  return ret;
+}
+
+static int parse_repeat (const char *line, unsigned long *count)
+{
+  /* "repeat N {", nothing may follow the brace */
+  int pos = 0;
+  if (sscanf (line + 6, "%lu {%n", count, &pos) != 1 || pos == 0)
+    return 0;
+  line = skipblanks (line + 6 + pos);
+  return *line == 0 || *line == '\n';
+}
+
+static const char *arb_compile (const struct writerspec *spec, struct arb_stream *st, const char *text, struct arb_prog *prog, int nested)
+{
+  /* compiles lines of TEXT into PROG, up to the closing brace if NESTED;
+     returns the text following it (or the end), or NULL on error */
+  while (text)
+  {
+    const char *line = skipblanks (text), *next;
+    if (*line == 0)
+    {
+      if (!nested)
+        return line;
+      printf ("unterminated repeat block\n");
+      return NULL;
+    }
+    else if (*line == '\n')
+      text = line + 1;
+    else if (*line == '}')
+    {
+      if (nested)
+        return (next = nextline (line)) ? next : line + strlen (line);
+      printf ("unexpected '}'\n");
+      return NULL;
+    }
+    else if (keyword (line, "repeat"))
+    {
+      struct arb_op *op = arb_newop (spec, st, prog, NULL);
+      if (!parse_repeat (line, &op->count))
+      {
+        printf ("invalid repeat: %.*s\n", (int) strcspn (line, "\n"), line);
+        return NULL;
+      }
+      op->kind = AO_REPEAT;
+      op->body = arb_prog_new ();
+      (void) arb_commit (st, prog, op);
+      if ((next = nextline (line)) == NULL || (text = arb_compile (spec, st, next, op->body, 1)) == NULL)
+        return NULL;
+    }
+    else
+    {
+      (void) arb_parse_line (spec, line, &text, st, prog);
+    }
+  }
+  if (nested)
+  {
+    printf ("unterminated repeat block\n");
+    return NULL;
+  }
+  return "";
+}
+
+static void arb_block_append (struct arb_stream *st, const char *line)
+{
+  const size_t n = strcspn (line, "\n");
+  if (st->blocklen + n + 2 > st->blocksize)
+  {
+    while (st->blocklen + n + 2 > st->blocksize)
+      st->blocksize = st->blocksize ? 2 * st->blocksize : 1024;
+    st->block = realloc (st->block, st->blocksize);
+  }
+  memcpy (st->block + st->blocklen, line, n);
+  st->blocklen += n;
+  st->block[st->blocklen++] = '\n';
+  st->block[st->blocklen] = 0;
+}
+
+static char *pub_do_arb_line(const struct writerspec *spec, const char *line, const char **endp, struct arb_stream *st)
+{
+  /* as arb_parse_line, but collecting repeat blocks, which are run once
+     complete */
+  const char *cmd = skipblanks (line);
+  unsigned long count;
+  if (st->depth == 0 && !keyword (cmd, "repeat"))
+    return arb_parse_line (spec, line, endp, st, NULL);
+  if (keyword (cmd, "repeat") && !parse_repeat (cmd, &count))
+  {
+    /* e.g. "repeat N { ... }" on one line: not opening a block, so it
+       mustn't swallow the following lines; inside a block, arb_compile
+       rejects the block for it */
+    if (st->depth == 0)
+    {
+      printf ("invalid repeat: %.*s\n", (int) strcspn (cmd, "\n"), cmd);
+      if (endp)
+        *endp = nextline (cmd);
+      return NULL;
+    }
+    arb_block_append (st, cmd);
+  }
+  else
+  {
+    arb_block_append (st, cmd);
+    if (keyword (cmd, "repeat"))
+      st->depth++;
+    else if (*cmd == '}')
+      st->depth--;
+  }
+  if (st->depth == 0)
+  {
+    struct arb_prog *prog = arb_prog_new ();
+    if (arb_compile (spec, st, st->block, prog, 0))
+    {
+      struct metric ms[3];
+      unsigned long long tstart, nwrites;
+      double dt;
+      if (st->pp)
+        arb_pipe_drain (st->pp);
+      tstart = nowmono ();
+      nwrites = arb_prog_run (prog, 0);
+      dt = (double) (nowmono () - tstart) / 1e9;
+      ms[0].name = "writes"; ms[0].value = (double) nwrites;
+      ms[1].name = "seconds"; ms[1].value = dt;
+      ms[2].name = "rate"; ms[2].value = (dt > 0) ? (double) nwrites / dt : 0.0;
+      metrics_emit ("repeat", &spec->tags, ms, 3);
+    }
+    arb_prog_free (prog);
+    st->blocklen = 0;
+  }
+  if (endp)
+    *endp = nextline (cmd);
+  return NULL;
+}
+
+static char *pub_do_arb_mapped(const struct writerspec *spec, struct arb_stream *st)
+{
+  /* parses directly from the mapped input file, no copying of lines */
+  char *ret = NULL;
+  while (ret == NULL && !termflag && inbuf.pos < inbuf.len)
+  {
+    const char *endp;
+    ret = pub_do_arb_line (spec, inbuf.buf + inbuf.pos, &endp, st);
+    inbuf.pos = endp ? (size_t) (endp - inbuf.buf) : inbuf.len;
+    inbuf_progress ();
+  }
+  return ret;
+}
+
+static char *pub_do_arb(const struct writerspec *spec, struct getl_arg *getl_arg, struct arb_stream *st)
+{
+  const char *orgline;
+  char *ret = NULL;
+  int count;
+  if (inbuf.mapped)
+    return pub_do_arb_mapped (spec, st);
+  while (ret == NULL && (orgline = getl(getl_arg, &count)) != NULL)
+  {
+    const char *line = skipspaces(orgline);
+    if (*line) getl_enter_hist(getl_arg, orgline);
+    ret = pub_do_arb_line (spec, line, NULL, st);
+  }
+  return ret;
+}
+
+static void *pubthread_auto(void *vspec)
+{
+  const struct writerspec *spec = vspec;
+  char name[300];
+  assert (spec->topicsel != UNSPEC && spec->topicsel != ARB);
+  snprintf (name, sizeof (name), "writer [%u:%s]", spec->tags.idx, spec->tags.topic);
+  trace_thread (name);
+  pub_do_auto(spec);
+  return 0;
+}
+
+static int binframe_next(int fd, const char **frame, uint32_t *size, char **tmp, size_t *tmpsize)
+{
+  /* sets *FRAME to the frame following the size, in the input buffer if
+     it is there in its entirety, else copied to *TMP */
+  size_t got;
+  if ((got = inbuf_read (fd, (char *) size, sizeof (*size))) != sizeof (*size))
+  {
+    if (got > 0)
+      fprintf (stderr, "binary input: truncated frame\n");
+    return 0;
+  }
+  if (*size < 4)
+  {
+    fprintf (stderr, "binary input: invalid frame size %" PRIu32 "\n", *size);
+    return 0;
+  }
+  if (fd == inbuf.fd && inbuf.len - inbuf.pos >= *size)
+  {
+    *frame = inbuf.buf + inbuf.pos;
+    inbuf.pos += *size;
+    return 1;
+  }
+  if (*size > *tmpsize)
+  {
+    *tmpsize = *size;
+    *tmp = realloc (*tmp, *tmpsize);
+  }
+  if (inbuf_read (fd, *tmp, *size) != *size)
+  {
+    fprintf (stderr, "binary input: truncated frame\n");
+    return 0;
+  }
+  *frame = *tmp;
+  return 1;
+}
+
+static void pub_do_bin(struct wrspeclist *wrspecs, int fd, struct arb_pipe *pp, struct tgarena *arena, uint64_t *nframes)
+{
+  /* decodes frames into the arena of the operation, writing them directly
+     (with ARENA) or via the pipeline */
+  struct wrspeclist *cursor = wrspecs;
+  struct arb_op opbuf = { .kind = AO_NONE, .arg = NULL };
+  char *tmp = NULL;
+  size_t tmpsize = 0;
+  const char *frame;
+  uint32_t size;
+  unsigned nwr = 0;
+  do {
+    nwr++;
+    cursor = cursor->next;
+  } while (cursor != wrspecs);
+  while (binframe_next (fd, &frame, &size, &tmp, &tmpsize))
+  {
+    const char *p = frame + 4, *end = frame + size;
+    const struct writerspec *spec;
+    struct arb_op *op;
+    enum alloc_phase ap;
+    uint16_t widx;
+    uint8_t flags = (uint8_t) frame[1];
+    int64_t t = 0;
+    (*nframes)++;
+    memcpy (&widx, frame + 2, sizeof (widx));
+    if (widx >= nwr)
+    {
+      printf ("frame %" PRIu64 ": writer %u does not exist\n", *nframes, (unsigned) widx);
+      continue;
+    }
+    for (cursor = wrspecs; widx > 0; widx--)
+      cursor = cursor->next;
+    spec = cursor->spec;
+    if (spec->topicsel != ARB)
+    {
+      printf ("frame %" PRIu64 ": binary input requires an ARB writer\n", *nframes);
+      continue;
+    }
+    if (frame[0] == 0 || strchr ("wdDur", frame[0]) == NULL)
+    {
+      printf ("frame %" PRIu64 ": invalid command\n", *nframes);
+      continue;
+    }
+    if (flags & BINF_TSTAMP)
+    {
+      if ((size_t) (end - p) < sizeof (t))
+      {
+        printf ("frame %" PRIu64 ": truncated timestamp\n", *nframes);
+        continue;
+      }
+      memcpy (&t, p, sizeof (t));
+      p += sizeof (t);
+    }
+    op = pp ? arb_pipe_slot (pp) : &opbuf;
+    if (pp == NULL)
+      op->arena = arena;
+    op->tmpl = NULL;
+    op->pace = NULL;
+    ap = alloc_phase_set (AP_PARSE);
+    op->data = tgdecode_arena (spec->tgtp, p, (size_t) (end - p), op->arena);
+    alloc_phase_set (ap);
+    if (op->data == NULL)
+    {
+      printf ("frame %" PRIu64 ": invalid sample\n", *nframes);
+      tgarena_reset (op->arena);
+      continue;
+    }
+    op->kind = AO_WRITE;
+    op->spec = spec;
+    op->command = frame[0];
+    op->tstamp_spec.isabs = (flags & BINF_ABSTIME) != 0;
+    op->tstamp_spec.t = t;
+    op->line = 0;
+    if (pp)
+      (void) arb_pipe_publish (pp);
+    else
+      (void) arb_exec (op);
+    inbuf_progress ();
+  }
+  free (tmp);
+}
+
+static struct wrspeclist *select_writer(struct wrspeclist *wrspecs, struct wrspeclist *cursor, char *nextspec)
+{
+  int cnt, pos;
+  char *tmp = nextspec + strlen(nextspec);
+  while (tmp > nextspec && isspace((unsigned char)tmp[-1]))
+    *--tmp = 0;
+  if ((sscanf (nextspec, "+%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) || ((void)(cnt = 1), strcmp(nextspec, "+") == 0)) {
+    while (cnt--) cursor = cursor->next;
+  } else if ((sscanf (nextspec, "-%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) || ((void)(cnt = 1), strcmp(nextspec, "-") == 0)) {
+    while (cnt--) cursor = cursor->prev;
+  } else if (sscanf (nextspec, "%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) {
+    cursor = wrspecs; while (cnt--) cursor = cursor->next;
+  } else {
+    struct wrspeclist *endm = cursor, *cand = NULL;
+    do {
+      if (strncmp (cursor->spec->tpname, nextspec, strlen(nextspec)) == 0) {
+        if (cand == NULL)
+          cand = cursor;
+        else {
+          printf ("%s: ambiguous writer specification\n", nextspec);
+          break;
+        }
+      }
+      cursor = cursor->next;
+    } while (cursor != endm);
+    if (cand == NULL) {
+      printf ("%s: no matching writer specification\n", nextspec);
+    } else if (cursor != endm) { /* ambiguous case */
+      cursor = endm;
+    } else {
+      cursor = cand;
+    }
+  }
+  return cursor;
+}
+
+/* With -w :PORT, any number of clients can feed data at the same time:
+   each connection is served by a thread of its own, with its own input
+   buffer, selected writer, statistics and (with -B) pipeline, so that a
+   sleep or a repeat block on one connection doesn't hold up the others;
+   complete lines are processed as they arrive, the connection's buffer
+   standing in for the input buffer */
+struct tcpconn {
+  int fd;
+  char peer[INET_ADDRSTRLEN + 8];
+  char *buf;
+  size_t len, size;
+  struct wrspeclist *wrspecs, *cursor;
+  struct arb_pipe *pp;
+  struct nonarb_state nst;
+  struct arb_stream ast;
+  unsigned long long tstart;
+  uint64_t nbytes, nlines, nswitches; /* nlines counts frames if -b */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned nconns;
+} tcpconns = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+static struct tcpconn *tcpconn_accept(struct wrspeclist *wrspecs)
+{
+  struct sockaddr_storage saddr;
+  socklen_t saddrlen = sizeof (saddr);
+  struct tcpconn *c;
+  int fd;
+  if ((fd = accept (fdservsock, (struct sockaddr *) &saddr, &saddrlen)) == -1)
+  {
+    if (errno != EINTR && errno != ECONNABORTED)
+    {
+      perror ("accept()");
+      exit (2);
+    }
     return NULL;
   }
+  c = malloc (sizeof (*c));
+  c->fd = fd;
+  if (saddr.ss_family == AF_INET)
+  {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) &saddr;
+    snprintf (c->peer, sizeof (c->peer), "%s:%d", inet_ntoa (sin->sin_addr), ntohs (sin->sin_port));
+  }
+  else
+    snprintf (c->peer, sizeof (c->peer), "local#%d", fd);
+  c->size = 65536;
+  c->buf = malloc (c->size + 1);
+  c->len = 0;
+  c->wrspecs = c->cursor = wrspecs;
+  c->pp = NULL;
+  c->nst.seq = 0;
+  c->nst.zspec = NULL;
+  c->tstart = nowmono ();
+  c->nbytes = c->nlines = c->nswitches = 0;
+  if (print_tcp)
+    printf ("to %s\n", c->peer);
+  return c;
 }
 
-static char *pub_do_arb_line(const struct writerspec *spec, const char *line)
+static void tcpconn_close(struct tcpconn *c)
 {
-  DDS_ReturnCode_t result;
-  struct tstamp_t tstamp_spec;
-  char *ret = NULL;
-  char command;
-  int k, pos;
-  while (line && *(line = skipspaces(line)) != 0)
+  double dt = (double) (nowmono () - c->tstart) / 1e9;
+  const char *unit = binary_input ? "frames" : "lines";
+  arb_stream_fini (&c->ast);
+  if (c->pp)
+    arb_pipe_free (c->pp);
+  flockfile (stdout);
+  printf ("%s: closed after %.3fs: %" PRIu64 " bytes %" PRIu64 " %s (%.1f %s/s) %" PRIu64 " writer switches\n",
+          c->peer, dt, c->nbytes, c->nlines, unit, (dt > 0) ? (double) c->nlines / dt : 0.0, unit, c->nswitches);
+  if (print_tcp)
+    printf ("listening ... ");
+  fflush (stdout);
+  funlockfile (stdout);
+  close (c->fd);
+  free (c->buf);
+  free (c);
+}
+
+static void tcpconn_process(struct tcpconn *c, int eof)
+{
+  /* processes all complete lines (frames) in the buffer, and at EOF also
+     a final incomplete one */
+  size_t end = c->len, i;
+  char save;
+  if (eof)
+    ;
+  else if (binary_input)
+  {
+    uint32_t size;
+    end = 0;
+    while (c->len - end >= sizeof (size) && (memcpy (&size, c->buf + end, sizeof (size)), c->len - end - sizeof (size) >= size))
+      end += sizeof (size) + size;
+  }
+  else
+  {
+    while (end > 0 && c->buf[end-1] != '\n')
+      end--;
+  }
+  if (end == 0)
+    return;
+  if (!binary_input)
   {
-    tstamp_spec.isabs = 0; tstamp_spec.t = 0;
-    command = 'w';
-    switch (*line)
+    for (i = 0; i < end; i++)
+      if (c->buf[i] == '\n')
+        c->nlines++;
+  }
+  save = c->buf[end];
+  c->buf[end] = 0;
+  inbuf_borrow (c->fd, c->buf, end);
+  if (binary_input)
+    pub_do_bin(c->wrspecs, c->fd, c->pp, c->ast.arena, &c->nlines);
+  while (!binary_input && !termflag && inbuf.pos < inbuf.len)
+  {
+    const struct writerspec *spec = c->cursor->spec;
+    char *nextspec;
+    if (spec->topicsel != ARB)
     {
-      case 'w': case 'd': case 'D': case 'u': case 'r':
-        command = *line++;
-        if (*line == '@')
-        {
-          if (*++line == '=') { ++line; tstamp_spec.isabs = 1; }
-          tstamp_spec.t = T_SECOND * strtol (line, (char **) &line, 10);
-        }
-      case '{': {
-        write_oper_t fn = get_write_oper(command);
-        void *arb;
-        char *endp;
-        if ((arb = tgscan (spec->tgtp, line, &endp)) == NULL) {
-          line = NULL;
-        } else {
-          DDS_Time_t tstamp;
-          int diddodup = 0;
-          if (!tstamp_spec.isabs)
-          {
-            DDS_DomainParticipant_get_current_time(dp, &tstamp);
-            tstamp_spec.t += tstamp.sec * T_SECOND + tstamp.nanosec;
-          }
-          tstamp.sec = (int) (tstamp_spec.t / T_SECOND);
-          tstamp.nanosec = (unsigned) (tstamp_spec.t % T_SECOND);
-          line = endp;
-          result = fn (spec->wr, arb, DDS_HANDLE_NIL, &tstamp);
-          if (result == DDS_RETCODE_OK && spec->dupwr)
-          {
-            diddodup = 1;
-            result = fn (spec->dupwr, arb, DDS_HANDLE_NIL, &tstamp);
-          }
-          tgfreedata(spec->tgtp, arb);
-          if (result != DDS_RETCODE_OK)
-          {
-            printf ("%s%s: error %d (%s)\n", get_write_operstr(command), diddodup ? "(dup)" : "", (int) result, dds_strerror(result));
-            if (!accept_error (command, result))
-            {
-              line = NULL;
-              if (!isatty(fdin))
-                exit(2);
-              break;
-            }
-          }
-        }
-        break;
-      }
-      case 'p':
-        set_pub_partition (DDS_DataWriter_get_publisher(spec->wr), line+1);
-        line = NULL;
-        break;
-      case 's':
-        if (sscanf(line+1, "%d%n", &k, &pos) != 1 || k < 0) {
-          printf ("invalid sleep duration: %ds\n", k);
-          line = NULL;
-        } else {
-          sleep ((unsigned) k);
-          line += 1 + pos;
-        }
-        break;
-      case 'n':
-        if (sscanf(line+1, "%d%n", &k, &pos) != 1 || k < 0) {
-          printf ("invalid nap duration: %dus\n", k);
-          line = NULL;
-        } else {
-          usleep ((unsigned) k);
-          line += 1 + pos;
-        }
-        break;
-      case 'Y': case 'B': case 'E': case 'W': case ')': case 'Q': case 'P':
-        non_data_operation(*line++, spec->wr);
-        break;
-      case 'C':
-        do_ddsi_control(line+1);
-        line = NULL;
-        break;
-      case 'S':
-        make_persistent_snapshot(line+1);
-        line = NULL;
-        break;
-      case ':':
-        ret = strdup(line+1);
-        line = NULL;
-        break;
-      default:
-        printf ("unrecognised command: %s\n", line);
-        line = NULL;
-        break;
+      if (c->pp)
+        arb_pipe_drain (c->pp);
+      nextspec = pub_do_nonarb(spec, c->fd, &c->nst);
     }
+    else
+      nextspec = pub_do_arb_mapped(spec, &c->ast);
+    if (nextspec == NULL)
+      break;
+    c->cursor = select_writer(c->wrspecs, c->cursor, nextspec);
+    c->nst.zspec = NULL;
+    c->nswitches++;
+    free (nextspec);
   }
-  return ret;
+  inbuf_reset (-1);
+  c->buf[end] = save;
+  memmove (c->buf, c->buf + end, c->len - end);
+  c->len -= end;
 }
 
-static char *pub_do_arb(const struct writerspec *spec, struct getl_arg *getl_arg)
+static int tcpconn_read(struct tcpconn *c)
 {
-  const char *orgline;
-  char *ret = NULL;
-  int count;
-  while (ret == NULL && (orgline = getl(getl_arg, &count)) != NULL)
+  /* returns 0 when the connection is to be closed */
+  ssize_t n;
+  if (c->len == c->size)
   {
-    const char *line = skipspaces(orgline);
-    if (*line) getl_enter_hist(getl_arg, orgline);
-    ret = pub_do_arb_line (spec, line);
+    c->size *= 2;
+    c->buf = realloc (c->buf, c->size + 1);
+  }
+  if ((n = read (c->fd, c->buf + c->len, c->size - c->len)) > 0)
+  {
+    c->len += (size_t) n;
+    c->nbytes += (uint64_t) n;
+    tcpconn_process(c, 0);
+    return 1;
+  }
+  else if (n == 0)
+  {
+    tcpconn_process(c, 1);
+    return 0;
+  }
+  else if (errno == EINTR || errno == EAGAIN)
+    return 1;
+  else
+  {
+    fprintf (stderr, "%s: read: errno %d\n", c->peer, errno);
+    return 0;
   }
-  return ret;
 }
 
-static void *pubthread_auto(void *vspec)
+static void *tcpconn_thread(void *vc)
 {
-  const struct writerspec *spec = vspec;
-  assert (spec->topicsel != UNSPEC && spec->topicsel != ARB);
-  pub_do_auto(spec);
-  return 0;
+  struct tcpconn *c = vc;
+  char name[64];
+  snprintf (name, sizeof (name), "input [%s]", c->peer);
+  trace_thread (name);
+  if (pipeline_depth > 0)
+    c->pp = arb_pipe_new (pipeline_depth);
+  arb_stream_init (&c->ast, c->pp);
+  while (!termflag)
+  {
+    struct pollfd fds[2];
+    int r;
+    fds[0].fd = termpipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = c->fd;
+    fds[1].events = POLLIN;
+    if ((r = poll (fds, 2, -1)) == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+    {
+      perror("tcpconn: poll()");
+      exit(2);
+    }
+    if (fds[0].revents || (fds[1].revents && !tcpconn_read(c)))
+      break;
+  }
+  tcpconn_close(c);
+  pthread_mutex_lock (&tcpconns.lock);
+  if (--tcpconns.nconns == 0)
+    pthread_cond_broadcast (&tcpconns.cond);
+  pthread_mutex_unlock (&tcpconns.lock);
+  return NULL;
+}
+
+static void tcpserver(struct wrspeclist *wrspecs)
+{
+  while (!termflag)
+  {
+    struct pollfd fds[2];
+    struct tcpconn *c;
+    pthread_t tid;
+    int r;
+    fds[0].fd = termpipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = fdservsock;
+    fds[1].events = POLLIN;
+    if ((r = poll (fds, 2, -1)) == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+    {
+      perror("tcpserver: poll()");
+      exit(2);
+    }
+    if (fds[0].revents)
+      break;
+    if ((fds[1].revents & POLLIN) && (c = tcpconn_accept(wrspecs)) != NULL)
+    {
+      pthread_mutex_lock (&tcpconns.lock);
+      tcpconns.nconns++;
+      pthread_mutex_unlock (&tcpconns.lock);
+      if ((r = pthread_create (&tid, NULL, tcpconn_thread, c)) != 0)
+        error ("tcpserver: pthread_create: %d\n", r);
+      pthread_detach (tid);
+    }
+  }
+  /* the connections see termination, too */
+  pthread_mutex_lock (&tcpconns.lock);
+  while (tcpconns.nconns > 0)
+    pthread_cond_wait (&tcpconns.cond, &tcpconns.lock);
+  pthread_mutex_unlock (&tcpconns.lock);
 }
 
 static void *pubthread(void *vwrspecs)
 {
   struct wrspeclist *wrspecs = vwrspecs;
-  uint32_t seq = 0;
+  struct nonarb_state nst = { .seq = 0, .zspec = NULL };
   struct getl_arg getl_arg;
+  struct arb_pipe *pp = NULL;
+  struct allocstats alloc;
+  allocstats_init (&alloc);
+  trace_thread ("input");
 #if USE_EDITLINE
   getl_init_editline(&getl_arg, fdin);
 #else
   getl_init_simple(&getl_arg, fdin);
 #endif
-  do {
+  if (fdin_map)
+    inbuf_map (fdin, fdin_map > 1);
+  if (pipeline_depth > 0 && fdservsock == -1)
+    pp = arb_pipe_new (pipeline_depth);
+  if (fdservsock != -1)
+    tcpserver(wrspecs);
+  else if (binary_input)
+  {
+    struct tgarena *arena = tgarena_new ();
+    uint64_t nframes = 0;
+    assert (fdin >= 0);
+    pub_do_bin(wrspecs, fdin, pp, arena, &nframes);
+    tgarena_free (arena);
+    inbuf_unmap ();
+    if (fdin > 0)
+      close (fdin);
+  }
+  else
+  {
     struct wrspeclist *cursor = wrspecs;
-    struct writerspec *spec = cursor->spec;
+    const struct writerspec *spec = cursor->spec;
+    struct arb_stream st;
     char *nextspec;
-    if (fdservsock != -1) {
-      /* w_accept doesn't return on error, uses -1 to signal termination */
-      if ((fdin = w_accept(fdservsock)) < 0)
-        continue;
-      getl_reset_input(&getl_arg, fdin);
-    }
     assert (fdin >= 0);
+    arb_stream_init (&st, pp);
     do {
       if (spec->topicsel != ARB)
-        nextspec = pub_do_nonarb(spec, fdin, &seq);
+      {
+        if (pp)
+          arb_pipe_drain (pp);
+        nextspec = pub_do_nonarb(spec, fdin, &nst);
+      }
       else
-        nextspec = pub_do_arb(spec, &getl_arg);
+        nextspec = pub_do_arb(spec, &getl_arg, &st);
       if (nextspec == NULL)
         spec = NULL;
       else
       {
-        int cnt, pos;
-        char *tmp = nextspec + strlen(nextspec);
-        while (tmp > nextspec && isspace((unsigned char)tmp[-1]))
-          *--tmp = 0;
-        if ((sscanf (nextspec, "+%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) || ((void)(cnt = 1), strcmp(nextspec, "+") == 0)) {
-          while (cnt--) cursor = cursor->next;
-        } else if ((sscanf (nextspec, "-%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) || ((void)(cnt = 1), strcmp(nextspec, "+") == 0)) {
-          while (cnt--) cursor = cursor->prev;
-        } else if (sscanf (nextspec, "%d%n", &cnt, &pos) == 1 && nextspec[pos] == 0) {
-          cursor = wrspecs; while (cnt--) cursor = cursor->next;
-        } else {
-          struct wrspeclist *endm = cursor, *cand = NULL;
-          do {
-            if (strncmp (cursor->spec->tpname, nextspec, strlen(nextspec)) == 0) {
-              if (cand == NULL)
-                cand = cursor;
-              else {
-                printf ("%s: ambiguous writer specification\n", nextspec);
-                break;
-              }
-            }
-            cursor = cursor->next;
-          } while (cursor != endm);
-          if (cand == NULL) {
-            printf ("%s: no matching writer specification\n", nextspec);
-          } else if (cursor != endm) { /* ambiguous case */
-            cursor = endm;
-          } else {
-            cursor = cand;
-          }
-        }
+        cursor = select_writer(wrspecs, cursor, nextspec);
+        nst.zspec = NULL;
+        free (nextspec);
         spec = cursor->spec;
       }
     } while (spec);
+    arb_stream_fini (&st);
+    inbuf_unmap ();
     if (fdin > 0)
       close (fdin);
-    if (fdservsock != -1)
-    {
-      if (print_tcp)
-        printf ("listening ... ");
-      fflush (stdout);
-    }
-  } while (fdservsock != -1 && !termflag);
+  }
+  if (pp)
+    arb_pipe_free (pp);
   getl_fini(&getl_arg);
+  allocstats_report (&alloc, "input", NULL, NULL, 0, 0);
   return 0;
 }
 
@@ -2116,9 +4858,12 @@ static void fini_eseq_admin (struct eseq_admin *ea)
   free (ea->eseq);
 }
 
-static int check_eseq (struct eseq_admin *ea, unsigned seq, unsigned keyval, const DDS_InstanceHandle_t pubhandle)
+static int check_eseq (struct eseq_admin *ea, unsigned seq, unsigned keyval, const DDS_InstanceHandle_t pubhandle, unsigned *nlost)
 {
+  /* returns whether seq is the expected one; *nlost is set to the number
+     of samples of the instance skipped over, 0 if it is a step back */
   unsigned *eseq;
+  *nlost = 0;
   if (keyval >= ea->nkeys)
   {
     printf ("received key %d >= nkeys %d\n", keyval, ea->nkeys);
@@ -2129,6 +4874,8 @@ static int check_eseq (struct eseq_admin *ea, unsigned seq, unsigned keyval, con
     {
       unsigned e = ea->eseq[i][keyval];
       ea->eseq[i][keyval] = seq + ea->nkeys;
+      if ((int) (seq - e) > 0)
+        *nlost = (seq - e) / ea->nkeys;
       return seq == e;
     }
   ea->ph = realloc (ea->ph, (ea->nph + 1) * sizeof (*ea->ph));
@@ -2142,6 +4889,114 @@ static int check_eseq (struct eseq_admin *ea, unsigned seq, unsigned keyval, con
   return 1;
 }
 
+/* Flight recorder of a reader in check mode: the metadata of the last
+   samples and wakeups, private to the reader thread and hence without
+   any synchronisation; dumped by that thread on an out-of-sequence
+   sample, on a latency above flightrec_latency and on SIGUSR2 */
+enum flightrec_kind {
+  FK_WAKEUP, /* seq: number of triggered conditions */
+  FK_SAMPLE
+};
+
+struct flightrec_entry {
+  unsigned long long ttake, tsrc, trecv; /* ns since the epoch */
+  DDS_InstanceHandle_t pubhandle;
+  uint32_t batch, seq, keyval;
+  enum flightrec_kind kind;
+};
+
+struct flightrec {
+  struct flightrec_entry *ev; /* NULL if disabled */
+  uint64_t n, ndumped; /* events recorded, n at last dump */
+  uint32_t mask, batch;
+};
+
+static void flightrec_init (struct flightrec *fr, unsigned size)
+{
+  uint32_t sz = 1;
+  fr->n = fr->ndumped = 0;
+  fr->batch = 0;
+  if (size == 0)
+  {
+    fr->ev = NULL;
+    fr->mask = 0;
+    return;
+  }
+  while (sz < size)
+    sz *= 2;
+  fr->ev = malloc (sz * sizeof (*fr->ev));
+  fr->mask = sz - 1;
+}
+
+static void flightrec_fini (struct flightrec *fr)
+{
+  free (fr->ev);
+}
+
+static void flightrec_wakeup (struct flightrec *fr, unsigned long long tnow, uint32_t ntrig)
+{
+  struct flightrec_entry *e;
+  if (fr->ev == NULL)
+    return;
+  e = &fr->ev[fr->n++ & fr->mask];
+  e->kind = FK_WAKEUP;
+  e->ttake = tnow;
+  e->batch = ++fr->batch;
+  e->seq = ntrig;
+}
+
+static void flightrec_sample (struct flightrec *fr, unsigned long long ttake, const DDS_SampleInfo *si, uint32_t seq, uint32_t keyval)
+{
+  struct flightrec_entry *e;
+  if (fr->ev == NULL)
+    return;
+  e = &fr->ev[fr->n++ & fr->mask];
+  e->kind = FK_SAMPLE;
+  e->ttake = ttake;
+  e->tsrc = (DDS_unsigned_long) si->source_timestamp.sec * 1000000000ull + si->source_timestamp.nanosec;
+  e->trecv = (DDS_unsigned_long) si->reception_timestamp.sec * 1000000000ull + si->reception_timestamp.nanosec;
+  e->pubhandle = si->publication_handle;
+  e->batch = fr->batch;
+  e->seq = seq;
+  e->keyval = keyval;
+}
+
+static void flightrec_dump (struct flightrec *fr, const char *tag, const char *why, int force)
+{
+  /* unless forced, a dump is skipped if the events haven't been replaced
+     entirely since the previous one, so that a burst of anomalies gives
+     one dump instead of one per sample; a forced one (SIGUSR2) doesn't
+     count as the previous one */
+  const uint64_t size = (uint64_t) fr->mask + 1;
+  uint64_t i;
+  if (fr->ev == NULL || (!force && fr->ndumped > 0 && fr->n - fr->ndumped < size))
+    return;
+  if (!force)
+    fr->ndumped = fr->n;
+  i = (fr->n > size) ? fr->n - size : 0;
+  flockfile (stdout);
+  printf ("flight recorder %s: %s, last %" PRIu64 " of %" PRIu64 " events\n", tag, why, fr->n - i, fr->n);
+  for (; i < fr->n; i++)
+  {
+    const struct flightrec_entry *e = &fr->ev[i & fr->mask];
+    printf ("  %llu.%09u batch %" PRIu32, e->ttake / 1000000000, (unsigned) (e->ttake % 1000000000), e->batch);
+    if (e->kind == FK_WAKEUP)
+      printf (" wakeup %" PRIu32 "\n", e->seq);
+    else
+    {
+      uint32_t systemId, localId;
+      instancehandle_to_id (&systemId, &localId, e->pubhandle);
+      printf (" seq %" PRIu32 " key %" PRIu32 " writer %" PRIx32 ":%" PRIx32 " src %llu.%09u rcv %llu.%09u latency %.3fms\n",
+              e->seq, e->keyval, systemId, localId,
+              e->tsrc / 1000000000, (unsigned) (e->tsrc % 1000000000),
+              e->trecv / 1000000000, (unsigned) (e->trecv % 1000000000),
+              ((double) e->ttake - (double) e->tsrc) / 1e6);
+    }
+  }
+  printf ("flight recorder %s: end\n", tag);
+  funlockfile (stdout);
+}
+
 static int subscriber_needs_access (DDS_Subscriber sub)
 {
   DDS_SubscriberQos *qos;
@@ -2173,6 +5028,11 @@ static void *subthread (void *vspec)
   DDS_string tn = DDS_TopicDescription_get_name(td);
   snprintf(tag, sizeof(tag), "[%u:%s]", spec->idx, tn);
   DDS_free(tn);
+  {
+    char name[300];
+    snprintf (name, sizeof (name), "reader %s", tag);
+    trace_thread (name);
+  }
 
   if (wait_hist_data)
   {
@@ -2235,19 +5095,36 @@ static void *subthread (void *vspec)
     long long out_of_seq = 0, nreceived = 0, last_nreceived = 0;
     long long nreceived_bytes = 0, last_nreceived_bytes = 0;
     struct eseq_admin eseq_admin;
-    struct hist *hist = hist_new (30, 10000, 0);
+    struct hist *hist = hist_new (), *cum = hist_new ();
+    unsigned long long tblocked = 0;
+    sig_atomic_t snapgen = snapshot_gen, flightgen = flightrec_gen;
+    struct cpustats cpu;
+    struct perfstats perf;
+    struct allocstats alloc;
+    struct flightrec flight;
+    struct gate_window gw;
+    struct decimate *dec = NULL;
     init_eseq_admin(&eseq_admin, nkeyvals);
+    if (spec->topicsel == ARB && (spec->mode == MODE_PRINT || spec->mode == MODE_DUMP))
+      dec = decimate_new (nowmono ());
     mseq.any = DDS_sequence_octet__alloc();
     iseq = DDS_SampleInfoSeq__alloc ();
     glist = DDS_ConditionSeq__alloc ();
     timeout.sec = 0;
     timeout.nanosec = 100000000;
+    perfstats_init (&perf, spec->mode == MODE_CHECK);
+    allocstats_init (&alloc);
+    flightrec_init (&flight, (spec->mode == MODE_CHECK) ? flightrec_size : 0);
+    gate_window_init (&gw, spec->mode == MODE_CHECK);
 
     while (!termflag && !once_mode)
     {
-      unsigned long long tnow;
+      unsigned long long tnow, tmono, twait, ttr;
       unsigned gi;
 
+      perfctrs_stop (perf.pc);
+      twait = nowmono ();
+      ttr = trace_begin (TK_WAIT);
       if (spec->polling)
       {
         const struct timespec d = { 0, 1000000 }; /* 1ms sleep interval, so a bit less than 1kHz poll freq */
@@ -2258,6 +5135,27 @@ static void *subthread (void *vspec)
         printf ("wait: error %d\n", (int) result);
         break;
       }
+      trace_end (TK_WAIT, ttr, spec->polling ? 1 : (unsigned) glist->_length);
+      tblocked += nowmono () - twait;
+      if (flight.ev)
+        flightrec_wakeup (&flight, nowll (), spec->polling ? 1 : (uint32_t) glist->_length);
+      if (flightgen != flightrec_gen)
+      {
+        flightgen = flightrec_gen;
+        flightrec_dump (&flight, tag, "signal", 1);
+      }
+      if (snapgen != snapshot_gen)
+      {
+        struct metric ms[METRICS_MAX];
+        char counts[128];
+        snapgen = snapshot_gen;
+        snprintf (counts, sizeof (counts), "received %lld bytes %lld out of seq %lld", nreceived, nreceived_bytes, out_of_seq);
+        ms[0].name = "ntot"; ms[0].value = (double) nreceived;
+        ms[1].name = "bytes"; ms[1].value = (double) nreceived_bytes;
+        ms[2].name = "nseq"; ms[2].value = (double) out_of_seq;
+        snapshot_print ("read_snapshot", &spec->tags, counts, print_latency ? cum : NULL, print_latency ? hist : NULL, 1, tblocked, ms, 3);
+      }
+      perfctrs_start (perf.pc);
 
       for (gi = 0; gi < (spec->polling ? 1 : glist->_length); gi++)
       {
@@ -2301,6 +5199,8 @@ static void *subthread (void *vspec)
         if (need_access && (result = DDS_Subscriber_begin_access (sub)) != DDS_RETCODE_OK)
           error ("DDS_Subscriber_begin_access: %d (%s)\n", (int) result, dds_strerror (result));
 
+        ttr = trace_begin (TK_TAKE);
+        alloc_phase_set (AP_TAKE);
         if (spec->mode == MODE_CHECK || (spec->mode == MODE_DUMP && spec->use_take) || spec->polling) {
           result = DDS_DataReader_take (rd, mseq.any, iseq, spec->read_maxsamples, DDS_ANY_SAMPLE_STATE, DDS_ANY_VIEW_STATE, DDS_ANY_INSTANCE_STATE);
         } else if (spec->mode == MODE_DUMP) {
@@ -2310,6 +5210,8 @@ static void *subthread (void *vspec)
         } else {
           result = DDS_DataReader_read_w_condition (rd, mseq.any, iseq, spec->read_maxsamples, cond);
         }
+        alloc_phase_set (AP_OTHER);
+        trace_end (TK_TAKE, ttr, (result == DDS_RETCODE_OK) ? (unsigned) iseq->_length : 0);
 
         {
           DDS_ReturnCode_t end_access_result;
@@ -2329,21 +5231,28 @@ static void *subthread (void *vspec)
         }
 
         tnow = nowll ();
+        tmono = nowmono ();
 
         switch (spec->mode)
         {
           case MODE_PRINT:
           case MODE_DUMP:
+            ttr = trace_begin (TK_PRINT);
+            alloc_phase_set (AP_PRINT);
             switch (spec->topicsel) {
               case UNSPEC: assert(0);
-              case KS:   print_seq_KS (&tstart, tnow, rd, tag, iseq, mseq.ks); break;
-              case K32:  print_seq_K32 (&tstart, tnow, rd, tag, iseq, mseq.k32); break;
-              case K64:  print_seq_K64 (&tstart, tnow, rd, tag, iseq, mseq.k64); break;
-              case K128: print_seq_K128 (&tstart, tnow, rd, tag, iseq, mseq.k128); break;
-              case K256: print_seq_K256 (&tstart, tnow, rd, tag, iseq, mseq.k256); break;
-              case OU:   print_seq_OU (&tstart, tnow, rd, tag, iseq, mseq.ou); break;
-              case ARB:  print_seq_ARB (&tstart, tnow, rd, tag, iseq, mseq.any, spec->tgtp); break;
+              case KS:   print_seq_KS (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.ks); break;
+              case K32:  print_seq_K32 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k32); break;
+              case K64:  print_seq_K64 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k64); break;
+              case K128: print_seq_K128 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k128); break;
+              case K256: print_seq_K256 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k256); break;
+              case OU:   print_seq_OU (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.ou); break;
+              case ARB:  print_seq_ARB (&tstart, tnow, rd, tag, iseq, mseq.any, spec, dec); break;
             }
+            alloc_phase_set (AP_OTHER);
+            trace_end (TK_PRINT, ttr, (unsigned) iseq->_length);
+            sink_maybe_rotate (spec);
+            nreceived += (long long) iseq->_length;
             break;
 
           case MODE_CHECK:
@@ -2351,7 +5260,8 @@ static void *subthread (void *vspec)
             {
               int keyval = 0;
               unsigned seq = 0;
-              unsigned size = 0;
+              unsigned size = 0, nlost;
+              int ingate;
               if (!iseq->_buffer[i].valid_data)
                 continue;
               switch (spec->topicsel)
@@ -2365,11 +5275,20 @@ static void *subthread (void *vspec)
                 case OU:   { OneULong *d = &mseq.ou->_buffer[i];   keyval = 0;         seq = d->seq; size = 4; } break;
                 case ARB:  assert(0); break; /* can't check what we don't know */
               }
-              if (check_eseq (&eseq_admin, seq, (unsigned)keyval, iseq->_buffer[i].publication_handle))
+              flightrec_sample (&flight, tnow, &iseq->_buffer[i], seq, (uint32_t) keyval);
+              if (nreceived == 0)
+                gate_window_begin (&gw, tnow);
+              if ((ingate = gate_window_account (&gw, tnow)) != 0)
+                gw.n++;
+              if (check_eseq (&eseq_admin, seq, (unsigned)keyval, iseq->_buffer[i].publication_handle, &nlost))
               {
                 unsigned long long tsrc = (DDS_unsigned_long)iseq->_buffer[i].source_timestamp.sec * 1000000000ull + iseq->_buffer[i].source_timestamp.nanosec;
                 unsigned long long tdelta = tnow - tsrc;
                 hist_record (hist, tdelta, 1);
+                if (ingate && gw.lat)
+                  hist_record (gw.lat, tdelta, 1);
+                if (flightrec_latency && tdelta > flightrec_latency && tnow >= tsrc)
+                  flightrec_dump (&flight, tag, "latency", 0);
                 if (latlog_fp)
                 {
                   fwrite(&tnow, sizeof(tnow), 1, latlog_fp);
@@ -2379,32 +5298,40 @@ static void *subthread (void *vspec)
               else
               {
                 out_of_seq++;
+                if (ingate)
+                  gw.nlost += nlost;
+                flightrec_dump (&flight, tag, "out-of-sequence", spec->exit_on_out_of_seq);
                 if (spec->exit_on_out_of_seq)
                 {
+                  ttr = trace_begin (TK_PRINT);
+                  alloc_phase_set (AP_PRINT);
                   switch (spec->topicsel) {
                     case UNSPEC: assert(0);
-                    case KS:   print_seq_KS (&tstart, tnow, rd, tag, iseq, mseq.ks); break;
-                    case K32:  print_seq_K32 (&tstart, tnow, rd, tag, iseq, mseq.k32); break;
-                    case K64:  print_seq_K64 (&tstart, tnow, rd, tag, iseq, mseq.k64); break;
-                    case K128: print_seq_K128 (&tstart, tnow, rd, tag, iseq, mseq.k128); break;
-                    case K256: print_seq_K256 (&tstart, tnow, rd, tag, iseq, mseq.k256); break;
-                    case OU:   print_seq_OU (&tstart, tnow, rd, tag, iseq, mseq.ou); break;
-                    case ARB:  print_seq_ARB (&tstart, tnow, rd, tag, iseq, mseq.any, spec->tgtp); break;
+                    case KS:   print_seq_KS (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.ks); break;
+                    case K32:  print_seq_K32 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k32); break;
+                    case K64:  print_seq_K64 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k64); break;
+                    case K128: print_seq_K128 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k128); break;
+                    case K256: print_seq_K256 (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.k256); break;
+                    case OU:   print_seq_OU (spec->sink->fp, &tstart, tnow, rd, tag, iseq, mseq.ou); break;
+                    case ARB:  print_seq_ARB (&tstart, tnow, rd, tag, iseq, mseq.any, spec, dec); break;
                   }
+                  alloc_phase_set (AP_OTHER);
+                  trace_end (TK_PRINT, ttr, (unsigned) iseq->_length);
                   exitcode = 1;
                   terminate();
                 }
               }
               if (nreceived == 0)
               {
-                tfirst = tnow;
+                tfirst = tmono;
                 tprint = tfirst;
+                cpustats_init (&cpu);
               }
               nreceived++;
               nreceived_bytes += size;
-              if (tnow - tprint >= 1000000000ll || termflag)
+              if (tmono - tprint >= 1000000000ll || termflag)
               {
-                const unsigned long long tdelta_ns = tnow - tfirst;
+                const unsigned long long tdelta_ns = tmono - tfirst;
                 const unsigned long long tdelta_s0 = tdelta_ns / 1000000000;
                 const unsigned tdelta_ms0 = ((tdelta_ns % 1000000000) + 500000) / 1000000;
                 const unsigned long long tdelta_s = tdelta_s0 + (tdelta_ms0 == 1000);
@@ -2414,14 +5341,21 @@ static void *subthread (void *vspec)
                 flockfile(stdout);
                 printf ("%llu.%03u ntot %lld nseq %lld ndelta %lld rate %.2f Mb/s",
                         tdelta_s, tdelta_ms, nreceived, out_of_seq, ndelta, rate_Mbps);
+                metrics_reads ("read", &spec->tags, nreceived, out_of_seq, ndelta, rate_Mbps, print_latency ? hist : NULL);
                 if (print_latency)
-                  hist_print (hist, tnow - tprint, 1);
+                {
+                  hist_merge (cum, hist);
+                  hist_print (hist, tmono - tprint, 1);
+                }
                 else
                   printf ("\n");
+                cpustats_report (&cpu, &spec->tags, (uint64_t) ndelta);
+                perfstats_report (&perf, "perf", &spec->tags, (uint64_t) ndelta, 1);
+                allocstats_report (&alloc, NULL, "alloc", &spec->tags, (uint64_t) ndelta, 1);
                 funlockfile(stdout);
                 last_nreceived = nreceived;
                 last_nreceived_bytes = nreceived_bytes;
-                tprint = tnow;
+                tprint = tmono;
               }
             }
             break;
@@ -2432,7 +5366,16 @@ static void *subthread (void *vspec)
         }
         DDS_DataReader_return_loan(rd, mseq.any, iseq);
         if (spec->sleep_us)
+        {
+          ttr = trace_begin (TK_SLEEP);
           usleep (spec->sleep_us);
+          trace_end (TK_SLEEP, ttr, 0);
+        }
+      }
+      if (dec)
+      {
+        decimate_tick (dec, &tstart, nowmono (), tag, spec, 0);
+        sink_maybe_rotate (spec);
       }
     }
     DDS_free (glist);
@@ -2442,7 +5385,9 @@ static void *subthread (void *vspec)
       if (need_access && (result = DDS_Subscriber_begin_access (sub)) != DDS_RETCODE_OK)
         error ("DDS_Subscriber_begin_access: %d (%s)\n", (int) result, dds_strerror (result));
 
+      alloc_phase_set (AP_TAKE);
       result = DDS_DataReader_take (rd, mseq.any, iseq, DDS_LENGTH_UNLIMITED, DDS_ANY_SAMPLE_STATE, DDS_ANY_VIEW_STATE, DDS_ANY_INSTANCE_STATE);
+      alloc_phase_set (AP_OTHER);
       if (result == DDS_RETCODE_NO_DATA)
       {
         if (once_mode)
@@ -2463,29 +5408,53 @@ static void *subthread (void *vspec)
           printf ("-- final contents of data reader --\n");
         if (spec->mode == MODE_PRINT || spec->mode == MODE_DUMP)
         {
+          const unsigned long long ttr = trace_begin (TK_PRINT);
+          alloc_phase_set (AP_PRINT);
           switch (spec->topicsel)
           {
             case UNSPEC: assert(0);
-            case KS:   print_seq_KS (&tstart, nowll (), rd, tag, iseq, mseq.ks); break;
-            case K32:  print_seq_K32 (&tstart, nowll (), rd, tag, iseq, mseq.k32); break;
-            case K64:  print_seq_K64 (&tstart, nowll (), rd, tag, iseq, mseq.k64); break;
-            case K128: print_seq_K128 (&tstart, nowll (), rd, tag, iseq, mseq.k128); break;
-            case K256: print_seq_K256 (&tstart, nowll (), rd, tag, iseq, mseq.k256); break;
-            case OU:   print_seq_OU (&tstart, nowll (), rd, tag, iseq, mseq.ou); break;
-            case ARB:  print_seq_ARB (&tstart, nowll (), rd, tag, iseq, mseq.any, spec->tgtp); break;
+            case KS:   print_seq_KS (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.ks); break;
+            case K32:  print_seq_K32 (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.k32); break;
+            case K64:  print_seq_K64 (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.k64); break;
+            case K128: print_seq_K128 (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.k128); break;
+            case K256: print_seq_K256 (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.k256); break;
+            case OU:   print_seq_OU (spec->sink->fp, &tstart, nowll (), rd, tag, iseq, mseq.ou); break;
+            case ARB:  print_seq_ARB (&tstart, nowll (), rd, tag, iseq, mseq.any, spec, dec); break;
           }
+          alloc_phase_set (AP_OTHER);
+          trace_end (TK_PRINT, ttr, (unsigned) iseq->_length);
         }
       }
       if (need_access && (result = DDS_Subscriber_end_access (sub)) != DDS_RETCODE_OK)
         error ("DDS_Subscriber_end_access: %d (%s)\n", (int) result, dds_strerror (result));
       DDS_DataReader_return_loan (rd, mseq.any, iseq);
     }
+    if (dec)
+    {
+      decimate_tick (dec, &tstart, nowmono (), tag, spec, 1);
+      decimate_free (dec);
+    }
 
     DDS_free (iseq);
     DDS_free (mseq.any);
+    if (print_latency)
+      hist_merge (cum, hist);
     if (spec->mode == MODE_CHECK)
+    {
       printf ("received: %lld, out of seq: %lld\n", nreceived, out_of_seq);
+      metrics_reads ("read_total", &spec->tags, nreceived, out_of_seq, -1, 0.0, print_latency ? cum : NULL);
+      if (nreceived > 0)
+        cpustats_peak (&cpu, &spec->tags);
+      perfstats_report (&perf, "perf_total", &spec->tags, (uint64_t) nreceived, 0);
+      gate_window_fini (&gw, &spec->tags, gw.tlast);
+    }
     fini_eseq_admin (&eseq_admin);
+    perfctrs_free (perf.pc);
+    flightrec_fini (&flight);
+    allocstats_report (&alloc, NULL, "alloc_total", &spec->tags, (uint64_t) nreceived, 0);
+    if (print_latency)
+      hist_total_add (&lathist_total, cum);
+    hist_free (cum);
     hist_free (hist);
   }
 
@@ -2530,14 +5499,14 @@ static void *autotermthread(void *varg __attribute__((unused)))
   glist->_length = 0;
   glist->_buffer = DDS_ConditionSeq_allocbuf (glist->_maximum);
 
-  tnow = nowll ();
+  tnow = nowmono ();
   tstop = tnow + (unsigned long long) (1e9 * dur);
 
   ws = DDS_WaitSet__alloc ();
   if ((result = DDS_WaitSet_attach_condition (ws, termcond)) != DDS_RETCODE_OK)
     error ("DDS_WaitSet_attach_condition (termcomd): %d (%s)\n", (int) result, dds_strerror (result));
 
-  tnow = nowll();
+  tnow = nowmono();
   while (!termflag && tnow < tstop)
   {
     unsigned long long dt = tstop - tnow;
@@ -2549,7 +5518,7 @@ static void *autotermthread(void *varg __attribute__((unused)))
       printf ("wait: error %d\n", (int) result);
       break;
     }
-    tnow = nowll();
+    tnow = nowmono();
   }
 
   DDS_WaitSet_detach_condition(ws, termcond);
@@ -2724,6 +5693,8 @@ static void set_print_mode (const char *optarg)
       print_final_take_notice = enable;
     else if (strcmp(tok, "latency") == 0)
       print_latency = enable;
+    else if (strcmp(tok, "perf") == 0)
+      print_perf = enable;
     else if (strncmp(tok, "latency=", 8) == 0 && enable)
     {
       print_latency = enable;
@@ -2737,10 +5708,38 @@ static void set_print_mode (const char *optarg)
       print_mode = TGPM_FIELDS;
     else if (strcmp(tok, "multiline") == 0)
       print_mode = TGPM_MULTILINE;
+    else if (strcmp(tok, "json") == 0)
+      print_mode = TGPM_JSON;
+    else if (strcmp(tok, "csv") == 0)
+      print_mode = TGPM_CSV;
     else if (sscanf(tok, "chop:%u%n", &chop, &pos) == 1 && tok[pos] == 0)
       print_chop = chop;
+    else if (strcmp(tok, "delta") == 0)
+      print_delta = enable ? 10000 : 0;
+    else if (sscanf(tok, "delta:%u%n", &print_delta, &pos) == 1 && tok[pos] == 0 && enable && print_delta > 0 && print_delta <= TG_MAXINST)
+      ;
+    else if (sscanf(tok, "every:%u%n", &print_every, &pos) == 1 && tok[pos] == 0 && enable && print_every > 0)
+      ;
+    else if (sscanf(tok, "maxrate:%lf%n", &print_maxrate, &pos) == 1 && tok[pos] == 0 && enable && print_maxrate >= 0.0)
+      ;
+    else if (sscanf(tok, "latest:%lf%n", &print_latest, &pos) == 1 && tok[pos] == 0 && enable && print_latest >= 0.0)
+      ;
     else if (strcmp(tok, "tcp") == 0)
       print_tcp = enable;
+    else if (strcmp(tok, "bin") == 0)
+      print_binary = enable;
+    else if (strncmp(tok, "proj:", 5) == 0 && enable)
+    {
+      /* member paths are comma-separated, too, so take the remainder */
+      free(print_proj);
+      print_proj = strdup(optarg + (tok - copy) + 5);
+      if (*print_proj == 0)
+      {
+        fprintf (stderr, "-P %s: empty projection\n", optarg);
+        exit (3);
+      }
+      break;
+    }
     else
     {
       static struct { const char *name; unsigned flag; } tab[] = {
@@ -2794,6 +5793,7 @@ int main (int argc, char *argv[])
   const char *qpublisher[2+argc];
   const char *qsubscriber[2+argc];
   int nqtopic = 0, nqreader = 0, nqwriter = 0;
+  const char *metrics_arg = NULL, *metrics_runid_arg = NULL;
   int nqpublisher = 0, nqsubscriber = 0;
   int opt, pos;
   uintptr_t exitcode = 0;
@@ -2859,7 +5859,7 @@ int main (int argc, char *argv[])
   spec_sofar = 0;
   assert(specidx == 0);
 
-  while ((opt = getopt (argc, argv, "^:$!@*:f:FK:T:D:q:m:M:n:OP:rRs:S:U:W:w:z:")) != EOF)
+  while ((opt = getopt (argc, argv, "^:$!@*:B:bf:FG:H:I:K:L:T:D:q:m:M:n:o:OP:rRs:S:t:U:W:w:X:z:")) != EOF)
   {
     switch (opt)
     {
@@ -3031,8 +6031,9 @@ int main (int argc, char *argv[])
         if (strcmp (optarg, "-") == 0)
         {
           if (fdin > 0) close (fdin);
-          if (fdservsock != -1) { close (fdservsock); fdservsock = -1; }
+          close_servsock ();
           fdin = 0;
+          fdin_map = 0;
           spec[specidx].wr.mode = WM_INPUT;
         }
         else if (sscanf (optarg, "%d%n", &nkeyvals, &pos) == 1 && optarg[pos] == 0)
@@ -3047,21 +6048,43 @@ int main (int argc, char *argv[])
         {
           spec[specidx].wr.mode = (nkeyvals == 0) ? WM_NONE : WM_AUTO;
         }
+        else if (optarg[0] == ':' && optarg[1 + strspn (optarg + 1, "0123456789")] != 0 && strchr (optarg + 1, '/') == NULL)
+        {
+          fprintf (stderr, "-w %s: invalid port (a UNIX domain socket path must contain a /)\n", optarg);
+          exit (3);
+        }
         else if (sscanf (optarg, ":%d%n", &port, &pos) == 1 && optarg[pos] == 0)
         {
           if (fdin > 0) close (fdin);
-          if (fdservsock != -1) { close (fdservsock); fdservsock = -1; }
+          close_servsock ();
           fdservsock = open_tcpserver_sock (port);
           fdin = -1;
+          fdin_map = 0;
+          spec[specidx].wr.mode = WM_INPUT;
+        }
+        else if (optarg[0] == ':' && strchr (optarg + 1, '/') != NULL)
+        {
+          if (fdin > 0) close (fdin);
+          close_servsock ();
+          fdservsock = open_unixserver_sock (optarg + 1);
+          fdin = -1;
+          fdin_map = 0;
           spec[specidx].wr.mode = WM_INPUT;
         }
         else
         {
+          const char *file = optarg;
+          fdin_map = 0;
+          while (*file == '@' && fdin_map < 2)
+          {
+            fdin_map++;
+            file++;
+          }
           if (fdin > 0) close (fdin);
-          if (fdservsock != -1) { close (fdservsock); fdservsock = -1; }
-          if ((fdin = open (optarg, O_RDONLY)) < 0)
+          close_servsock ();
+          if ((fdin = open (file, O_RDONLY)) < 0)
           {
-            fprintf (stderr, "%s: can't open\n", optarg);
+            fprintf (stderr, "%s: can't open\n", file);
             exit (3);
           }
           spec[specidx].wr.mode = WM_INPUT;
@@ -3071,6 +6094,25 @@ int main (int argc, char *argv[])
       case 'n':
         spec[specidx].rd.read_maxsamples = atoi (optarg);
         break;
+      case 'o':
+        {
+          /* optional ":SIZE" suffix for rotation, but only if it parses */
+          char *colon = strrchr (optarg, ':'), *endp;
+          unsigned long long size;
+          if (colon && colon[1] && (size = strtoull (colon + 1, &endp, 10)) > 0 &&
+              (*endp == 0 || (strchr ("kMG", *endp) && endp[1] == 0)))
+          {
+            switch (*endp) {
+              case 'k': size <<= 10; break;
+              case 'M': size <<= 20; break;
+              case 'G': size <<= 30; break;
+            }
+            *colon = 0;
+            spec[specidx].rd.outmaxsize = size;
+          }
+          spec[specidx].rd.outpattern = optarg;
+        }
+        break;
       case 'O':
         once_mode = 1;
         break;
@@ -3092,6 +6134,56 @@ int main (int argc, char *argv[])
       case 's':
         spec[specidx].rd.sleep_us = 1000u * (unsigned) atoi (optarg);
         break;
+      case 'B':
+        if (sscanf (optarg, "%u%n", &pipeline_depth, &pos) != 1 || optarg[pos] != 0)
+        {
+          fprintf (stderr, "-B %s: invalid queue length\n", optarg);
+          exit (3);
+        }
+        break;
+      case 'b':
+        binary_input = 1;
+        break;
+      case 'I':
+        metrics_runid_arg = optarg;
+        break;
+      case 'X':
+        metrics_arg = optarg;
+        break;
+      case 'G':
+        if (!gate_parse (optarg))
+        {
+          fprintf (stderr, "-G %s: invalid assertions\n", optarg);
+          exit (3);
+        }
+        break;
+      case 'L': {
+        double lat;
+        if (sscanf (optarg, "%u:%lf%n", &flightrec_size, &lat, &pos) == 2 && optarg[pos] == 0 && lat > 0 && flightrec_size <= FLIGHTREC_MAXSIZE)
+          flightrec_latency = (unsigned long long) (lat * 1e9);
+        else if (sscanf (optarg, "%u%n", &flightrec_size, &pos) == 1 && optarg[pos] == 0 && flightrec_size <= FLIGHTREC_MAXSIZE)
+          flightrec_latency = 0;
+        else
+        {
+          fprintf (stderr, "-L %s: invalid flight recorder specification\n", optarg);
+          exit (3);
+        }
+        break;
+      }
+      case 't':
+        if (!trace_init (optarg))
+        {
+          fprintf (stderr, "-t %s: invalid trace specification\n", optarg);
+          exit (3);
+        }
+        break;
+      case 'H':
+        if (sscanf (optarg, "%u%n", &keycache_size, &pos) != 1 || optarg[pos] != 0 || keycache_size > TG_MAXINST)
+        {
+          fprintf (stderr, "-H %s: invalid number of instances\n", optarg);
+          exit (3);
+        }
+        break;
       case 'W':
         {
           double t;
@@ -3173,6 +6265,13 @@ int main (int argc, char *argv[])
   {
     usage (argv[0]);
   }
+  if (print_delta && print_mode == TGPM_CSV)
+  {
+    fprintf (stderr, "-P delta: not supported in csv mode\n");
+    exit (3);
+  }
+  if (metrics_arg)
+    metrics_init (metrics_arg, metrics_runid_arg, nqtopic, qtopic, nqreader, qreader, nqwriter, qwriter);
 
   for (i = 0; i <= specidx; i++)
   {
@@ -3312,9 +6411,21 @@ int main (int argc, char *argv[])
           DDS_free(ts);
         }
         spec[i].rd.tgtp = spec[i].wr.tgtp = tgnew(spec[i].tp, printtype);
+        if (spec[i].wr.register_instances && keycache_size > 0)
+          spec[i].wr.keycache = tgkeycache_new(spec[i].wr.tgtp, keycache_size);
+        if (print_proj)
+          spec[i].rd.tgproj = tgprojnew(spec[i].rd.tgtp, print_proj);
+        if (print_delta)
+          spec[i].rd.tgdelta = tgdelta_new(spec[i].rd.tgtp, spec[i].rd.tgproj, print_delta);
         break;
     }
     assert (spec[i].tp != NULL);
+    spec[i].rd.tags.role = "reader";
+    spec[i].wr.tags.role = "writer";
+    spec[i].rd.tags.idx = spec[i].wr.tags.idx = i;
+    spec[i].rd.tags.topic = spec[i].wr.tags.topic = spec[i].topicname;
+    spec[i].rd.tags.qos = metrics_qos_rd;
+    spec[i].wr.tags.qos = metrics_qos_wr;
     assert (spec[i].rd.topicsel != ARB || spec[i].rd.tgtp != NULL);
     assert (spec[i].wr.topicsel != ARB || spec[i].wr.tgtp != NULL);
     free_qos (qos);
@@ -3338,6 +6449,13 @@ int main (int argc, char *argv[])
       setqos_from_args (qos, nqreader, qreader);
       spec[i].rd.rd = new_datareader_listener (qos, &rdlistener, rdstatusmask);
       free_qos (qos);
+      {
+        DDS_string tn = DDS_Topic_get_name (spec[i].tp);
+        spec[i].rd.sink = sink_new (spec[i].rd.outpattern, spec[i].rd.outmaxsize, i, tn);
+        DDS_free (tn);
+      }
+      if (print_mode == TGPM_CSV && spec[i].rd.topicsel == ARB && (spec[i].rd.mode == MODE_PRINT || spec[i].rd.mode == MODE_DUMP))
+        print_csv_header (&spec[i].rd);
     }
 
     if (spec[i].wr.mode != WM_NONE)
@@ -3360,7 +6478,7 @@ int main (int argc, char *argv[])
   if (want_writer && wait_for_matching_reader_arg)
   {
     struct qos *q = NULL;
-    uint64_t tnow = nowll();
+    uint64_t tnow = nowmono();
     uint64_t tend = tnow + (uint64_t) (wait_for_matching_reader_timeout >= 0 ? (wait_for_matching_reader_timeout * 1e9 + 0.5) : 0);
     DDS_InstanceHandleSeq *sh = DDS_InstanceHandleSeq__alloc();
     DDS_InstanceHandle_t pphandle;
@@ -3402,7 +6520,7 @@ int main (int argc, char *argv[])
           }
       }
       }
-      tnow = nowll();
+      tnow = nowmono();
       if (m != 0 && tnow < tend)
       {
         uint64_t tdelta = (tend-tnow) < T_SECOND/10 ? tend-tnow : T_SECOND/10;
@@ -3410,7 +6528,7 @@ int main (int argc, char *argv[])
         delay.tv_sec = (os_timeSec) (tdelta / T_SECOND);
         delay.tv_nsec = (os_int32) (tdelta % T_SECOND);
         os_nanoSleep(delay);
-        tnow = nowll();
+        tnow = nowmono();
       }
     } while(m != 0 && tnow < tend);
     free_qos(q);
@@ -3433,6 +6551,8 @@ int main (int argc, char *argv[])
     pthread_create(&sigtid, NULL, sigthread, NULL);
     signal (SIGINT, sigh);
     signal (SIGTERM, sigh);
+    signal (SIGUSR1, sigh);
+    signal (SIGUSR2, sigh);
   }
 
   if (want_writer)
@@ -3553,15 +6673,30 @@ int main (int argc, char *argv[])
 
   if (latlog_fp)
     fclose(latlog_fp);
+  close_servsock ();
 
   for (i = 0; i <= specidx; i++)
   {
     assert(spec[i].wr.tgtp == spec[i].rd.tgtp); /* so no need to free both */
+    if (spec[i].rd.sink)
+      sink_free(spec[i].rd.sink);
+    if (spec[i].rd.tgdelta)
+      tgdelta_free(spec[i].rd.tgdelta);
+    if (spec[i].rd.tgproj)
+      tgprojfree(spec[i].rd.tgproj);
     if (spec[i].rd.tgtp)
       tgfree(spec[i].rd.tgtp);
+    if (spec[i].wr.keycache)
+      tgkeycache_free(spec[i].wr.keycache);
     if (spec[i].wr.tpname)
       DDS_free(spec[i].wr.tpname);
   }
+  hist_total_print (&wrhist_total, "all writers");
+  hist_total_print (&lathist_total, "all readers latency");
+  exitcode |= gate_result ();
+  metrics_fini ();
+  trace_fini ();
+  free(print_proj);
   DDS_free(termcond);
   if (sleep_at_end_1)
     sleep (sleep_at_end_1);
@@ -0,0 +1,124 @@
+/* Copyright 2017 PrismTech Limited
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tglib.h"
+
+/* Times tgnewmd on a generated metadescription of NMODS modules, each
+   with NTYPES structs; every struct references the previous one in its
+   module by a relative name and the last struct of the preceding module
+   by an absolute name, so all lookup paths get exercised */
+
+struct buf {
+  char *s;
+  size_t pos, size;
+};
+
+static void append (struct buf *b, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void append (struct buf *b, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+  va_start (ap, fmt);
+  n = vsnprintf (b->s + b->pos, b->size - b->pos, fmt, ap);
+  va_end (ap);
+  if (b->pos + (size_t) n >= b->size)
+  {
+    while (b->pos + (size_t) n >= b->size)
+      b->size *= 2;
+    b->s = realloc (b->s, b->size);
+    va_start (ap, fmt);
+    (void) vsnprintf (b->s + b->pos, b->size - b->pos, fmt, ap);
+    va_end (ap);
+  }
+  b->pos += (size_t) n;
+}
+
+static char *genmd (unsigned nmods, unsigned ntypes)
+{
+  struct buf b = { .s = malloc (1024), .pos = 0, .size = 1024 };
+  unsigned m, t;
+  append (&b, "<MetaData version=\"1.0.0\"><Module name=\"bench\">");
+  for (m = 0; m < nmods; m++)
+  {
+    append (&b, "<Module name=\"M%u\">", m);
+    for (t = 0; t < ntypes; t++)
+    {
+      append (&b, "<Struct name=\"T%u\"><Member name=\"k\"><Long/></Member><Member name=\"s\"><String/></Member>", t);
+      if (t > 0)
+        append (&b, "<Member name=\"prev\"><Type name=\"T%u\"/></Member>", t - 1);
+      else if (m > 0)
+        append (&b, "<Member name=\"prev\"><Type name=\"::bench::M%u::T%u\"/></Member>", m - 1, ntypes - 1);
+      append (&b, "</Struct>");
+    }
+    append (&b, "</Module>");
+  }
+  append (&b, "</Module></MetaData>");
+  return b.s;
+}
+
+static void usage (const char *argv0)
+{
+  fprintf (stderr, "usage: %s [-m NMODS] [-t NTYPES] [-r ROUNDS]\n", argv0);
+  exit (3);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned nmods = 100, ntypes = 20, rounds = 10, r;
+  unsigned long long tmin = ~0ull, ttot = 0;
+  char typename[64];
+  char *md;
+  int opt;
+  save_argv0 (argv[0]);
+  clock_init ();
+  while ((opt = getopt (argc, argv, "m:t:r:")) != EOF)
+  {
+    switch (opt)
+    {
+      case 'm': nmods = (unsigned) atoi (optarg); break;
+      case 't': ntypes = (unsigned) atoi (optarg); break;
+      case 'r': rounds = (unsigned) atoi (optarg); break;
+      default: usage (argv[0]);
+    }
+  }
+  if (nmods == 0 || ntypes == 0 || rounds == 0 || optind != argc)
+    usage (argv[0]);
+
+  md = genmd (nmods, ntypes);
+  snprintf (typename, sizeof (typename), "bench::M%u::T%u", nmods - 1, ntypes - 1);
+  printf ("%u modules x %u types, metadescription %zu bytes\n", nmods, ntypes, strlen (md));
+
+  for (r = 0; r < rounds; r++)
+  {
+    unsigned long long t0, dt;
+    struct tgtopic *tp;
+    t0 = nowmono ();
+    tp = tgnewmd ("bench", typename, "k", md, 0);
+    dt = nowmono () - t0;
+    tgfree (tp);
+    ttot += dt;
+    if (dt < tmin)
+      tmin = dt;
+  }
+  printf ("tgnew: min %.3fms mean %.3fms\n", tmin / 1e6, ttot / 1e6 / rounds);
+  free (md);
+  return 0;
+}
@@ -15,6 +15,8 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <dds_dcps.h>
 
@@ -53,6 +55,7 @@ enum tokenkind {
   TOK_LBRACKET,
   TOK_RBRACKET,
 
+  TOK_COUNTER, /* $i, only in templates */
   TOK_LITERAL
 };
 
@@ -70,6 +73,7 @@ struct lexer {
   struct token token;
   const char *srcstart;
   const char *src;
+  struct tgtemplate *tmpl; /* non-null if $i is allowed */
 };
 
 enum tgkind {
@@ -142,14 +146,45 @@ struct tgtype {
 };
 
 struct dictnode {
-  struct dictnode *next;
-  const char *name; /* aliases type->name */
+  struct dictnode *next; /* hash chain */
+  uint32_t hash;
+  char *name; /* fully qualified, "::M1::M2::T" */
   struct tgtype *type;
 };
 
+/* Module scopes are prefixes of parse_context::nameprefix, with the
+   hash of the prefix cached so that names can be looked up in every
+   enclosing scope without constructing the qualified name */
+struct scope {
+  size_t len;
+  uint32_t hash;
+};
+
+/* All types created while parsing one metadescription, shared by all
+   topics with the same type name and metadescription; reference
+   counted and kept in typecache for as long as it is referenced */
+struct tgtypegraph {
+  struct tgtypegraph *next;
+  unsigned refc;
+  char *typename;
+  uint64_t mdhash; /* to skip most full comparisons of md */
+  char *md;
+  struct tgtype *root;
+  unsigned ntypes, maxtypes;
+  struct tgtype **types;
+};
+
+static pthread_mutex_t typecache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tgtypegraph *typecache;
+
 struct parse_context {
-  struct dictnode *dict;
+  struct tgtypegraph *graph;
+  struct dictnode **dict; /* hash table of dictsize (power of 2) chains */
+  unsigned dictsize, dictcount;
   char *nameprefix;
+  size_t nameprefixsize;
+  struct scope *scopes;
+  unsigned nscopes, maxscopes;
   int depth;
 };
 
@@ -235,91 +270,174 @@ const char *tgkindstr(enum tgkind kind)
   return "?";
 }
 
-static char *fullname(struct parse_arg *arg, const char *name)
+#define DICTHASH_INIT 2166136261u
+
+static uint32_t dicthash(uint32_t h, const char *s)
+{
+  /* FNV-1a: can be continued, so hash("a::b") = dicthash(dicthash(hash("a"), "::"), "b") */
+  while (*s)
+    h = (h ^ (unsigned char) *s++) * 16777619u;
+  return h;
+}
+
+static void init_parse_context(struct parse_context *ctx, struct tgtypegraph *graph)
 {
-  if (name == NULL)
-    return NULL;
-  else
+  ctx->graph = graph;
+  ctx->dictsize = 64;
+  ctx->dictcount = 0;
+  ctx->dict = calloc(ctx->dictsize, sizeof(*ctx->dict));
+  ctx->nameprefixsize = 64;
+  ctx->nameprefix = malloc(ctx->nameprefixsize);
+  ctx->nameprefix[0] = 0;
+  ctx->maxscopes = 8;
+  ctx->scopes = malloc(ctx->maxscopes * sizeof(*ctx->scopes));
+  ctx->scopes[0].len = 0;
+  ctx->scopes[0].hash = DICTHASH_INIT;
+  ctx->nscopes = 1;
+  ctx->depth = 0;
+}
+
+static void fini_parse_context(struct parse_context *ctx)
+{
+  unsigned i;
+  for (i = 0; i < ctx->dictsize; i++)
   {
-    size_t sz = strlen(arg->context->nameprefix) + 2 + strlen(name) + 1;
-    char *x = malloc(sz);
-    (void) snprintf(x, sz, "%s::%s", arg->context->nameprefix, name);
-    return x;
+    struct dictnode *n = ctx->dict[i];
+    while (n)
+    {
+      struct dictnode *next = n->next;
+      free(n->name);
+      free(n);
+      n = next;
+    }
   }
+  free(ctx->dict);
+  free(ctx->nameprefix);
+  free(ctx->scopes);
 }
 
-static struct tgtype *lookupname1(struct dictnode *dict, const char *name)
+static struct tgtype *lookupscoped(const struct parse_context *ctx, const struct scope *sc, const char *name)
 {
-  struct dictnode *n = dict;
-  while (n && strcmp(n->name, name) != 0)
-    n = n->next;
-  return n ? n->type : NULL;
+  const uint32_t h = dicthash(dicthash(sc->hash, "::"), name);
+  const struct dictnode *n;
+  for (n = ctx->dict[h & (ctx->dictsize - 1)]; n; n = n->next)
+  {
+    if (n->hash == h &&
+        strncmp(n->name, ctx->nameprefix, sc->len) == 0 &&
+        n->name[sc->len] == ':' && n->name[sc->len+1] == ':' &&
+        strcmp(n->name + sc->len + 2, name) == 0)
+      return n->type;
+  }
+  return NULL;
 }
 
 static struct tgtype *lookupname(struct parse_arg *arg, const char *name)
 {
+  const struct parse_context *ctx = arg->context;
   if (strncmp(name, "::", 2) == 0)
-    return lookupname1(arg->context->dict, name);
+    return lookupscoped(ctx, &ctx->scopes[0], name + 2);
   else
   {
-    char *prefix = strdup(arg->context->nameprefix);
-    size_t sz = strlen(prefix) + 2 + strlen(name) + 1;
-    char *tmp = malloc(sz);
-    struct tgtype *t;
-    (void) snprintf(tmp, sz, "%s::%s", prefix, name);
-    while((t = lookupname1(arg->context->dict, tmp)) == NULL && *prefix)
+    /* innermost enclosing module scope first */
+    struct tgtype *t = NULL;
+    unsigned i = ctx->nscopes;
+    while (t == NULL && i > 0)
+      t = lookupscoped(ctx, &ctx->scopes[--i], name);
+    return t;
+  }
+}
+
+static void growdict(struct parse_context *ctx)
+{
+  unsigned newsize = 2 * ctx->dictsize, i;
+  struct dictnode **newdict = calloc(newsize, sizeof(*newdict));
+  for (i = 0; i < ctx->dictsize; i++)
+  {
+    struct dictnode *n = ctx->dict[i];
+    while (n)
     {
-      char *x = strrchr(prefix, ':');
-      assert(x > prefix && x[-1] == ':');
-      x[-1] = 0;
-      (void) snprintf(tmp, sz, "%s::%s", prefix, name);
+      struct dictnode *next = n->next;
+      n->next = newdict[n->hash & (newsize - 1)];
+      newdict[n->hash & (newsize - 1)] = n;
+      n = next;
     }
-    free(prefix);
-    free(tmp);
-    return t;
   }
+  free(ctx->dict);
+  ctx->dict = newdict;
+  ctx->dictsize = newsize;
 }
 
 static void addtodict(struct parse_arg *arg, const char *name, struct tgtype *t)
 {
   if (name)
   {
+    struct parse_context *ctx = arg->context;
+    const struct scope *sc = &ctx->scopes[ctx->nscopes-1];
+    size_t sz = sc->len + 2 + strlen(name) + 1;
     struct dictnode *n;
     assert(t->name == NULL);
     t->name = strdup(name);
+    if (ctx->dictcount >= ctx->dictsize)
+      growdict(ctx);
     n = malloc(sizeof(*n));
-    n->name = fullname(arg, name);
+    n->name = malloc(sz);
+    (void) snprintf(n->name, sz, "%s::%s", ctx->nameprefix, name);
+    n->hash = dicthash(dicthash(sc->hash, "::"), name);
     n->type = t;
-    n->next = arg->context->dict;
-    arg->context->dict = n;
+    /* prepending means later definitions shadow earlier ones, like before */
+    n->next = ctx->dict[n->hash & (ctx->dictsize - 1)];
+    ctx->dict[n->hash & (ctx->dictsize - 1)] = n;
+    ctx->dictcount++;
   }
 }
 
 static void pushmodule(struct parse_arg *arg, const char *name)
 {
-  size_t sz = strlen(arg->context->nameprefix) + 2 + strlen(name) + 1;
-  char *np = malloc(sz);
-  (void) snprintf(np, sz, "%s::%s", arg->context->nameprefix, name);
-  free(arg->context->nameprefix);
-  arg->context->nameprefix = np;
+  struct parse_context *ctx = arg->context;
+  const struct scope *sc = &ctx->scopes[ctx->nscopes-1];
+  size_t sz = sc->len + 2 + strlen(name) + 1;
+  if (sz > ctx->nameprefixsize)
+  {
+    while (sz > ctx->nameprefixsize)
+      ctx->nameprefixsize *= 2;
+    ctx->nameprefix = realloc(ctx->nameprefix, ctx->nameprefixsize);
+  }
+  if (ctx->nscopes == ctx->maxscopes)
+  {
+    ctx->maxscopes *= 2;
+    ctx->scopes = realloc(ctx->scopes, ctx->maxscopes * sizeof(*ctx->scopes));
+    sc = &ctx->scopes[ctx->nscopes-1];
+  }
+  (void) snprintf(ctx->nameprefix + sc->len, sz - sc->len, "::%s", name);
+  ctx->scopes[ctx->nscopes].len = sz - 1;
+  ctx->scopes[ctx->nscopes].hash = dicthash(dicthash(sc->hash, "::"), name);
+  ctx->nscopes++;
 }
 
 static void popmodule(struct parse_arg *arg)
 {
-  char *x = strrchr(arg->context->nameprefix, ':');
-  assert(x > arg->context->nameprefix && x[-1] == ':');
-  x[-1] = 0;
+  struct parse_context *ctx = arg->context;
+  assert(ctx->nscopes > 1);
+  ctx->nscopes--;
+  ctx->nameprefix[ctx->scopes[ctx->nscopes-1].len] = 0;
 }
 
 static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name, const DDS_TypeAttributeSeq *attrs, DDS_TypeParserHandle handle __attribute__ ((unused)), void *varg);
 
-static struct tgtype *newtgtype(enum tgkind kind, size_t sz /* 0 if still to be computed */, size_t align)
+static struct tgtype *newtgtype(struct parse_context *ctx, enum tgkind kind, size_t sz /* 0 if still to be computed */, size_t align)
 {
+  struct tgtypegraph *g = ctx->graph;
   struct tgtype *t = malloc(sizeof (*t));
   memset(t, 0, sizeof (*t));
   t->kind = kind;
   t->size = sz;
   t->align = align;
+  if (g->ntypes == g->maxtypes)
+  {
+    g->maxtypes = g->maxtypes ? 2 * g->maxtypes : 32;
+    g->types = realloc(g->types, g->maxtypes * sizeof(*g->types));
+  }
+  g->types[g->ntypes++] = t;
   return t;
 }
 
@@ -529,7 +647,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
       struct parse_arg subarg = { .context = arg->context, .type = NULL };
       struct tgtype *t;
       (void) DDS_TypeSupport_walk_type_description(handle, parse_type_cb, &subarg);
-      t = newtgtype(TG_TYPEDEF, subarg.type->size, subarg.type->align);
+      t = newtgtype(arg->context, TG_TYPEDEF, subarg.type->size, subarg.type->align);
       t->u.td.type = subarg.type;
       if (name) addtodict(arg, name, t);
       break;
@@ -542,7 +660,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
 
     case DDS_TYPE_ELEMENT_KIND_STRUCT:
     {
-      struct tgtype *t = newtgtype(TG_STRUCT, 0, 0);
+      struct tgtype *t = newtgtype(arg->context, TG_STRUCT, 0, 0);
       struct parse_arg subarg = { .context = arg->context, .type = t };
       (void) DDS_TypeSupport_walk_type_description(handle, parse_struct_cb, &subarg);
       t->size = alignup(t->size, t->align);
@@ -553,7 +671,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
 
     case DDS_TYPE_ELEMENT_KIND_UNION:
     {
-      struct tgtype *t = newtgtype(TG_UNION, 0, 0);
+      struct tgtype *t = newtgtype(arg->context, TG_UNION, 0, 0);
       struct parse_arg subarg = { .context = arg->context, .type = t };
       t->u.U.msidxdef = -1;
       (void) DDS_TypeSupport_walk_type_description(handle, parse_union_cb, &subarg);
@@ -568,7 +686,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
     {
       unsigned n = intattr_w_0_default(attrs, "size");
       int isseq = (kind == DDS_TYPE_ELEMENT_KIND_SEQUENCE || n == 0);
-      struct tgtype *t = newtgtype(isseq ? TG_SEQUENCE : TG_ARRAY, 0, 0);
+      struct tgtype *t = newtgtype(arg->context, isseq ? TG_SEQUENCE : TG_ARRAY, 0, 0);
       struct parse_arg subarg = { .context = arg->context, .type = NULL };
       (void) DDS_TypeSupport_walk_type_description(handle, parse_type_cb, &subarg);
       assert(subarg.type);
@@ -590,7 +708,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
 
     case DDS_TYPE_ELEMENT_KIND_ENUM:
     {
-      struct tgtype *t = newtgtype(TG_ENUM, 4, alignof (int32_t));
+      struct tgtype *t = newtgtype(arg->context, TG_ENUM, 4, alignof (int32_t));
       struct parse_arg subarg = { .context = arg->context, .type = t };
       (void) DDS_TypeSupport_walk_type_description(handle, parse_enum_cb, &subarg);
       if (name) addtodict(arg, name, t);
@@ -598,19 +716,19 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
       break;
     }
 
-    case DDS_TYPE_ELEMENT_KIND_BOOLEAN:   arg->type = newtgtype(TG_BOOLEAN, 1, 1); break;
-    case DDS_TYPE_ELEMENT_KIND_CHAR:      arg->type = newtgtype(TG_CHAR,    1, 1); break;
-    case DDS_TYPE_ELEMENT_KIND_OCTET:     arg->type = newtgtype(TG_UINT,    1, 1); break;
-    case DDS_TYPE_ELEMENT_KIND_SHORT:     arg->type = newtgtype(TG_INT,     2, alignof(int16_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_USHORT:    arg->type = newtgtype(TG_UINT,    2, alignof(int16_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_LONG:      arg->type = newtgtype(TG_INT,     4, alignof(int32_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_ULONG:     arg->type = newtgtype(TG_UINT,    4, alignof(int32_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_LONGLONG:  arg->type = newtgtype(TG_INT,     8, alignof(int64_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_ULONGLONG: arg->type = newtgtype(TG_UINT,    8, alignof(int64_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_FLOAT:     arg->type = newtgtype(TG_FLOAT,   4, alignof(float));   break;
-    case DDS_TYPE_ELEMENT_KIND_DOUBLE:    arg->type = newtgtype(TG_FLOAT,   8, alignof(double));  break;
-    case DDS_TYPE_ELEMENT_KIND_TIME:      arg->type = newtgtype(TG_TIME,    8, alignof(int32_t)); break;
-    case DDS_TYPE_ELEMENT_KIND_STRING:    arg->type = newtgtype(TG_STRING,  sizeof(char *), alignof(ptr)); break;
+    case DDS_TYPE_ELEMENT_KIND_BOOLEAN:   arg->type = newtgtype(arg->context, TG_BOOLEAN, 1, 1); break;
+    case DDS_TYPE_ELEMENT_KIND_CHAR:      arg->type = newtgtype(arg->context, TG_CHAR,    1, 1); break;
+    case DDS_TYPE_ELEMENT_KIND_OCTET:     arg->type = newtgtype(arg->context, TG_UINT,    1, 1); break;
+    case DDS_TYPE_ELEMENT_KIND_SHORT:     arg->type = newtgtype(arg->context, TG_INT,     2, alignof(int16_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_USHORT:    arg->type = newtgtype(arg->context, TG_UINT,    2, alignof(int16_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_LONG:      arg->type = newtgtype(arg->context, TG_INT,     4, alignof(int32_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_ULONG:     arg->type = newtgtype(arg->context, TG_UINT,    4, alignof(int32_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_LONGLONG:  arg->type = newtgtype(arg->context, TG_INT,     8, alignof(int64_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_ULONGLONG: arg->type = newtgtype(arg->context, TG_UINT,    8, alignof(int64_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_FLOAT:     arg->type = newtgtype(arg->context, TG_FLOAT,   4, alignof(float));   break;
+    case DDS_TYPE_ELEMENT_KIND_DOUBLE:    arg->type = newtgtype(arg->context, TG_FLOAT,   8, alignof(double));  break;
+    case DDS_TYPE_ELEMENT_KIND_TIME:      arg->type = newtgtype(arg->context, TG_TIME,    8, alignof(int32_t)); break;
+    case DDS_TYPE_ELEMENT_KIND_STRING:    arg->type = newtgtype(arg->context, TG_STRING,  sizeof(char *), alignof(ptr)); break;
 
     default:
       print_cb(kind, name, attrs, handle, arg);
@@ -620,7 +738,7 @@ static DDS_boolean parse_type_cb(DDS_TypeElementKind kind, const DDS_string name
   return 1;
 }
 
-static int lookupfield(const struct tgtype **ptype, size_t *poff, const struct tgtype *type, const char *name)
+static int lookupfield(const struct tgtype **ptype, size_t *poff, const struct tgtype *type, const char *name, int keytype)
 {
   struct lexer l;
   struct token tok;
@@ -669,7 +787,7 @@ static int lookupfield(const struct tgtype **ptype, size_t *poff, const struct t
           (void) scantoken(&tok, &l);
           if (!casttoint(&tok, &l))
             return scanerror(&tok, &l, "integer expected");
-          if (tok.val.ui > (unsigned) ta->n)
+          if (tok.val.ui >= (unsigned) ta->n)
             return scanerror(&tok, &l, "index out of bounds");
           *poff += (size_t) tok.val.ui * ta->type->size;
           (*ptype) = detypedef(ta->type);
@@ -686,7 +804,7 @@ static int lookupfield(const struct tgtype **ptype, size_t *poff, const struct t
     return scanerror(&tok, &l, "non-existent key");
   } else if (tk != TOK_EOF || allowed == SYMBOL) {
     return scanerror(&tok, &l, "junk at end of input");
-  } else switch ((*ptype)->kind) {
+  } else if (keytype) switch ((*ptype)->kind) {
     case TG_CHAR:
     case TG_BOOLEAN:
     case TG_INT:
@@ -738,9 +856,6 @@ static char *get_metadescription(DDS_Topic dds_tp, char **typename, char **keyli
 
 struct tgtopic *tgnew(DDS_Topic dds_tp, int printtype)
 {
-  DDS_ReturnCode_t result;
-  struct parse_context context = { .dict = NULL, .nameprefix = strdup(""), .depth = 0 };
-  struct parse_arg arg = { .context = &context, .type = NULL };
   struct tgtopic *tp;
   char *topicname;
   char *typename;
@@ -749,22 +864,132 @@ struct tgtopic *tgnew(DDS_Topic dds_tp, int printtype)
 
   topicname = DDS_Topic_get_name(dds_tp);
   xs = get_metadescription(dds_tp, &typename, &keylist);
-  if (printtype && (result = DDS_TypeSupport_parse_type_description(xs, print_cb, &arg)) != DDS_RETCODE_OK)
-    error("DDS_TypeSupport_parse_type_description: error %d (%s)\n", (int) result, dds_strerror(result));
-  if ((result = DDS_TypeSupport_parse_type_description(xs, parse_type_cb, &arg)) != DDS_RETCODE_OK)
-    error("DDS_TypeSupport_parse_type_description: error %d (%s)\n", (int) result, dds_strerror(result));
+  tp = tgnewmd(topicname, typename, keylist, xs, printtype);
   DDS_free(xs);
+  DDS_free(typename);
+  DDS_free(topicname);
+  DDS_free(keylist);
+  return tp;
+}
 
-  tp = malloc(sizeof(*tp));
-  tp->name = strdup(topicname);
+static uint64_t mdhash(const char *md)
+{
+  uint64_t h = 14695981039346656037ull;
+  while (*md)
+    h = (h ^ (unsigned char) *md++) * 1099511628211ull;
+  return h;
+}
+
+static void freetgtype(struct tgtype *t)
+{
+  unsigned i;
+  switch (t->kind)
+  {
+    case TG_STRUCT:
+      for (i = 0; i < t->u.S.n; i++)
+        free(t->u.S.ms[i].name);
+      free(t->u.S.ms);
+      break;
+    case TG_ENUM:
+      for (i = 0; i < t->u.e.n; i++)
+        free(t->u.e.ms[i].name);
+      free(t->u.e.ms);
+      break;
+    case TG_UNION:
+      for (i = 0; i < t->u.U.n; i++)
+        free(t->u.U.ms[i].name);
+      free(t->u.U.ms);
+      free(t->u.U.labs);
+      break;
+    default:
+      break;
+  }
+  free(t->name);
+  free(t);
+}
+
+static struct tgtypegraph *parsegraph(const char *topicname, const char *typename, const char *md, uint64_t h)
+{
+  DDS_ReturnCode_t result;
+  struct tgtypegraph *g = malloc(sizeof(*g));
+  struct parse_context context;
+  struct parse_arg arg = { .context = &context, .type = NULL };
+
+  memset(g, 0, sizeof(*g));
+  g->typename = strdup(typename);
+  g->mdhash = h;
+  g->md = strdup(md);
+  init_parse_context(&context, g);
+  if ((result = DDS_TypeSupport_parse_type_description((DDS_string) md, parse_type_cb, &arg)) != DDS_RETCODE_OK)
+    error("DDS_TypeSupport_parse_type_description: error %d (%s)\n", (int) result, dds_strerror(result));
   if (arg.type)
-    tp->type = arg.type;
-  else
+    g->root = arg.type;
+  else if ((g->root = lookupname(&arg, typename)) == NULL)
+    error("topic %s: can't find type %s\n", topicname, typename);
+  fini_parse_context(&context);
+  return g;
+}
+
+static struct tgtypegraph *refgraph(const char *topicname, const char *typename, const char *md)
+{
+  const uint64_t h = mdhash(md);
+  struct tgtypegraph *g;
+  /* parsing while holding the lock is fine: tgnew is only called at
+     startup or when a new topic is discovered */
+  pthread_mutex_lock(&typecache_lock);
+  for (g = typecache; g; g = g->next)
+    if (g->mdhash == h && strcmp(g->md, md) == 0 && strcmp(g->typename, typename) == 0)
+      break;
+  if (g == NULL)
+  {
+    g = parsegraph(topicname, typename, md, h);
+    g->next = typecache;
+    typecache = g;
+  }
+  g->refc++;
+  pthread_mutex_unlock(&typecache_lock);
+  return g;
+}
+
+static void unrefgraph(struct tgtypegraph *g)
+{
+  pthread_mutex_lock(&typecache_lock);
+  if (--g->refc == 0)
+  {
+    struct tgtypegraph **pg = &typecache;
+    unsigned i;
+    while (*pg != g)
+      pg = &(*pg)->next;
+    *pg = g->next;
+    for (i = 0; i < g->ntypes; i++)
+      freetgtype(g->types[i]);
+    free(g->types);
+    free(g->typename);
+    free(g->md);
+    free(g);
+  }
+  pthread_mutex_unlock(&typecache_lock);
+}
+
+struct tgtopic *tgnewmd(const char *topicname, const char *typename, const char *keylist, const char *md, int printtype)
+{
+  struct tgtopic *tp;
+
+  if (printtype)
   {
-    tp->type = lookupname(&arg, typename);
-    if (tp->type == NULL)
-      error("topic %s: can't find type %s\n", tp->name, typename);
+    DDS_ReturnCode_t result;
+    struct parse_context context;
+    struct parse_arg arg = { .context = &context, .type = NULL };
+    init_parse_context(&context, NULL);
+    if ((result = DDS_TypeSupport_parse_type_description((DDS_string) md, print_cb, &arg)) != DDS_RETCODE_OK)
+      error("DDS_TypeSupport_parse_type_description: error %d (%s)\n", (int) result, dds_strerror(result));
+    fini_parse_context(&context);
   }
+
+  tp = malloc(sizeof(*tp));
+  tp->name = strdup(topicname);
+  tp->graph = refgraph(topicname, typename, md);
+  tp->type = tp->graph->root;
   tp->size = tp->type->size;
 
   if (*keylist == 0)
@@ -774,9 +999,10 @@ struct tgtopic *tgnew(DDS_Topic dds_tp, int printtype)
   }
   else
   {
+    char *keys = strdup(keylist);
     char *cursor, *key;
     unsigned i = 0, n = 0;
-    cursor = keylist;
+    cursor = keys;
     while (cursor)
     {
       n++;
@@ -785,27 +1011,16 @@ struct tgtopic *tgnew(DDS_Topic dds_tp, int printtype)
     }
     tp->nkeys = n;
     tp->keys = malloc(n * sizeof (*tp->keys));
-    cursor = keylist;
+    cursor = keys;
     while ((key = strsep(&cursor, ",")) != NULL)
     {
       tp->keys[i].name = strdup(key);
-      if (!lookupfield(&tp->keys[i].type, &tp->keys[i].off, tp->type, key))
+      if (!lookupfield(&tp->keys[i].type, &tp->keys[i].off, tp->type, key, 1))
         error("topic %s key %s not found\n", tp->name, key);
       i++;
     }
+    free(keys);
   }
-
-  DDS_free(typename);
-  DDS_free(topicname);
-  DDS_free(keylist);
-
-  while (context.dict)
-  {
-    struct dictnode *n = context.dict;
-    context.dict = n->next;
-    free(n);
-  }
-  free(context.nameprefix);
   return tp;
 }
 
@@ -814,12 +1029,43 @@ void tgfree(struct tgtopic *tp)
   unsigned i;
   for (i = 0; i < tp->nkeys; i++)
     free(tp->keys[i].name);
-  /* FIXME: free tp->type */
+  unrefgraph(tp->graph);
   free(tp->name);
   free(tp->keys);
   free(tp);
 }
 
+struct tgproj *tgprojnew(const struct tgtopic *tp, const char *paths)
+{
+  struct tgproj *proj;
+  char *copy = strdup(paths), *cursor, *path;
+  unsigned i = 0, n = 1;
+  for (cursor = copy; (cursor = strchr(cursor, ',')) != NULL; cursor++)
+    n++;
+  proj = malloc(sizeof(*proj));
+  proj->fields = malloc(n * sizeof(*proj->fields));
+  cursor = copy;
+  while ((path = strsep(&cursor, ",")) != NULL)
+  {
+    proj->fields[i].name = strdup(path);
+    if (!lookupfield(&proj->fields[i].type, &proj->fields[i].off, tp->type, path, 0))
+      error("topic %s field %s not found\n", tp->name, path);
+    i++;
+  }
+  proj->n = i;
+  free(copy);
+  return proj;
+}
+
+void tgprojfree(struct tgproj *proj)
+{
+  unsigned i;
+  for (i = 0; i < proj->n; i++)
+    free(proj->fields[i].name);
+  free(proj->fields);
+  free(proj);
+}
+
 static uint64_t loaddisc(const struct tgtype *t, const char *data)
 {
   switch (t->kind) {
@@ -1127,146 +1373,1301 @@ static int tgprint1(struct tgstring *s, const struct tgtype *t, const char *data
   return 1;
 }
 
-int tgprint(struct tgstring *s, const struct tgtopic *tp, const void *data, enum tgprint_mode mode)
+/* Length of the well-formed UTF-8 sequence starting at STR (at most N
+   bytes available), or 0 if it isn't one: no overlong encodings, no
+   surrogates and nothing beyond U+10FFFF */
+static size_t utf8seqlen(const unsigned char *str, size_t n)
 {
-  if (s->chop == 0)
+  unsigned char lo = 0x80, hi = 0xbf;
+  size_t len, i;
+  if (str[0] < 0x80)
+    return 1;
+  else if (str[0] >= 0xc2 && str[0] <= 0xdf)
+    len = 2;
+  else if (str[0] >= 0xe0 && str[0] <= 0xef) {
+    len = 3;
+    if (str[0] == 0xe0)
+      lo = 0xa0;
+    else if (str[0] == 0xed)
+      hi = 0x9f;
+  } else if (str[0] >= 0xf0 && str[0] <= 0xf4) {
+    len = 4;
+    if (str[0] == 0xf0)
+      lo = 0x90;
+    else if (str[0] == 0xf4)
+      hi = 0x8f;
+  } else
     return 0;
-  else
-  {
-    s->chopped = 0;
-    s->pos = 0;
-    s->buf[0] = 0;
-    (void)tgprint1(s, tp->type, data, 0, mode);
-    return !s->chopped;
-  }
+  if (len > n || str[1] < lo || str[1] > hi)
+    return 0;
+  for (i = 2; i < len; i++)
+    if (str[i] < 0x80 || str[i] > 0xbf)
+      return 0;
+  return len;
 }
 
-int tgprintkey(struct tgstring *s, const struct tgtopic *tp, const void *keydata, enum tgprint_mode mode)
+/* Bytes that are not part of well-formed UTF-8 are replaced by U+FFFD,
+   so the output is always valid JSON */
+static int tgprintjsonstr(struct tgstring *s, const char *str, size_t n, const char *q)
 {
-  if (s->chop == 0)
-    return 0;
-  else
-  {
-    const char *space = (mode == TGPM_DENSE) ? "" : " ";
-    const char *commaspace = (mode == TGPM_DENSE) ? "," : ", ";
-    unsigned i;
+  size_t i = 0;
+  tgprintf(s, "%s", q);
+  while (i < n) {
+    const unsigned char ch = (unsigned char) str[i];
+    size_t len = 1;
     int c;
-    s->chopped = 0;
-    s->pos = 0;
-    s->buf[0] = 0;
-    c = tgprintf(s, "{%s", mode == TGPM_MULTILINE ? "" : space);
-    for (i = 0; c && i < tp->nkeys; i++)
-    {
-      if (mode == TGPM_MULTILINE)
-        (void)tgprintf(s, "%s\n%*.*s", i == 0 ? "" : ",", 4, 4, "");
-      else
-        (void)tgprintf(s, "%s", i == 0 ? "" : commaspace);
-      if (mode >= TGPM_FIELDS)
-        (void)tgprintf(s, ".%s%s=%s", tp->keys[i].name, space, space);
-      c = tgprint1(s, tp->keys[i].type, (const char *) keydata + tp->keys[i].off, 0, mode);
+    if (ch == '"')
+      c = tgprintf(s, "\\%s", q);
+    else if (ch == '\\')
+      c = tgprintf(s, "\\\\");
+    else if (ch < 0x20)
+      c = tgprintf(s, "\\u%04x", ch);
+    else if ((len = utf8seqlen((const unsigned char *) str + i, n - i)) == 0) {
+      c = tgprintf(s, "\\ufffd");
+      len = 1;
+    } else
+      c = tgprintf(s, "%.*s", (int) len, str + i);
+    if (!c)
+      return 0;
+    i += len;
+  }
+  return tgprintf(s, "%s", q);
+}
+
+/* Turns chopped JSON into valid JSON: cuts it back to the end of the
+   last complete value (or the last opening bracket) and closes all
+   brackets still open there, so the result may be slightly longer
+   than the chop limit */
+static void tgjsonunchop(struct tgstring *s)
+{
+  char stack[256];
+  size_t i, safe = 0, depth = 0, safedepth = 0;
+  int instr = 0, esc = 0;
+  if (!s->chopped)
+    return;
+  for (i = 0; i < s->pos; i++) {
+    const char ch = s->buf[i];
+    if (instr) {
+      if (esc)
+        esc = 0;
+      else if (ch == '\\')
+        esc = 1;
+      else if (ch == '"')
+        instr = 0;
+    } else if (ch == '"') {
+      instr = 1;
+    } else if (ch == '{' || ch == '[') {
+      if (depth == sizeof(stack))
+        break;
+      stack[depth++] = (ch == '{') ? '}' : ']';
+      safe = i + 1; safedepth = depth;
+    } else if (ch == '}' || ch == ']') {
+      if (depth > 0)
+        depth--;
+      safe = i + 1; safedepth = depth;
+    } else if (ch == ',') {
+      safe = i; safedepth = depth;
     }
-    (void)tgprintf(s, "%s}", tp->nkeys > 0 ? space : "");
-    return !s->chopped;
   }
+  if (s->size < safe + safedepth + 1) {
+    s->size = safe + safedepth + 1;
+    s->buf = realloc(s->buf, s->size);
+  }
+  s->pos = safe;
+  while (safedepth > 0)
+    s->buf[s->pos++] = stack[--safedepth];
+  s->buf[s->pos] = 0;
 }
 
-static void tgfreedata1(const struct tgtype *t, char *data)
+/* q is the quote to use for JSON strings: "\"" normally, but "\"\""
+   when the JSON is embedded in a (quoted) CSV field */
+static int tgprintjson1(struct tgstring *s, const struct tgtype *t, const char *data, const char *q)
 {
-  switch(t->kind) {
+  switch (t->kind) {
     case TG_BOOLEAN:
-    case TG_CHAR:
     case TG_INT:
     case TG_UINT:
-    case TG_FLOAT:
-    case TG_ENUM:
-    case TG_TIME:
-      break;
+      return tgprint1(s, t, data, 0, TGPM_DENSE);
 
-    case TG_STRING:
-      free(*(char **)data);
-      break;
+    case TG_CHAR:
+      return tgprintjsonstr(s, data, 1, q);
+
+    case TG_FLOAT: {
+      const double v = (t->size == 4) ? *(float *)data : *(double *)data;
+      if (!isfinite(v))
+        return tgprintf(s, "null");
+      else
+        return tgprintf(s, "%.*g", (t->size == 4) ? 9 : 17, v);
+    }
+
+    case TG_ENUM: {
+      int val = *(int *)data;
+      unsigned i;
+      for (i = 0; i < t->u.e.n; i++)
+        if (t->u.e.ms[i].v == val)
+          return tgprintf(s, "%s%s%s", q, t->u.e.ms[i].name, q);
+      return tgprintf(s, "%d", val);
+    }
+
+    case TG_STRING: {
+      const char *str = *((char **)data);
+      if (str == NULL)
+        return tgprintf(s, "null");
+      else
+        return tgprintjsonstr(s, str, strlen(str), q);
+    }
+
+    case TG_TIME: {
+      DDS_Time_t t = *(DDS_Time_t *)data;
+      if (t.sec == DDS_TIMESTAMP_INVALID_SEC && t.nanosec == DDS_TIMESTAMP_INVALID_NSEC)
+        return tgprintf(s, "null");
+      else if(t.sec == DDS_DURATION_INFINITE_SEC && t.nanosec == DDS_DURATION_INFINITE_NSEC)
+        return tgprintf(s, "%sinf%s", q, q);
+      else
+        return tgprintf(s, "%d.%09u", t.sec, t.nanosec);
+    }
 
     case TG_TYPEDEF:
-      tgfreedata1(t->u.td.type, data);
-      break;
+      return tgprintjson1(s, t->u.td.type, data, q);
 
     case TG_STRUCT: {
       const struct tgtype_S *ts = &t->u.S;
-      for (unsigned i = 0; i < ts->n; i++)
-        tgfreedata1(ts->ms[i].type, data + ts->ms[i].off);
-      break;
+      unsigned i;
+      int c = tgprintf(s, "{");
+      for (i = 0; c && i < ts->n; i++) {
+        (void)tgprintf(s, "%s%s%s%s:", i == 0 ? "" : ",", q, ts->ms[i].name, q);
+        c = tgprintjson1(s, ts->ms[i].type, data + ts->ms[i].off, q);
+      }
+      return tgprintf(s, "}");
     }
 
-    case TG_ARRAY:
-      for (unsigned i = 0; i < t->u.ary.n; i++)
-        tgfreedata1(t->u.ary.type, data + i * t->u.ary.type->size);
-      break;
-
     case TG_SEQUENCE: {
       const dds_seq_t *seq = (const dds_seq_t *)data;
-      for (unsigned i = 0; i < seq->_length; i++)
-        tgfreedata1(t->u.seq.type, (char*)seq->_buffer + i * t->u.seq.type->size);
-      free(seq->_buffer);
-      break;
+      const char *data1 = (const char *)seq->_buffer;
+      const struct tgtype *st = t->u.seq.type;
+      unsigned i;
+      int c = tgprintf(s, "[");
+      for (i = 0; c && i < seq->_length; i++) {
+        if (i != 0) tgprintf(s, ",");
+        c = tgprintjson1(s, st, data1, q);
+        data1 += st->size;
+      }
+      return tgprintf(s, "]");
+    }
+
+    case TG_ARRAY: {
+      unsigned i;
+      int c = tgprintf(s, "[");
+      for (i = 0; c && i < t->u.ary.n; i++) {
+        if (i != 0) tgprintf(s, ",");
+        c = tgprintjson1(s, t->u.ary.type, data, q);
+        data += t->u.ary.type->size;
+      }
+      return tgprintf(s, "]");
     }
 
     case TG_UNION: {
       const struct tgtype_U *tu = &t->u.U;
-      uint64_t dv = loaddisc(tu->dtype, data);
+      uint64_t dv;
       unsigned i;
       int msidx;
+      tgprintf(s, "{%s_d%s:", q, q);
+      tgprintjson1(s, tu->dtype, data, q);
+      dv = loaddisc(tu->dtype, data);
       for (i = 0; i < tu->nlab; i++)
         if (dv == tu->labs[i].val)
           break;
       msidx = (i < tu->nlab) ? tu->labs[i].msidx : tu->msidxdef;
-      if (msidx >= 0)
-        tgfreedata1(tu->ms[msidx].type, data + tu->off);
-      break;
+      if (msidx >= 0) {
+        tgprintf(s, ",%s%s%s:", q, tu->ms[msidx].name, q);
+        tgprintjson1(s, tu->ms[msidx].type, data + tu->off, q);
+      }
+      return tgprintf(s, "}");
     }
   }
+  return 1;
 }
 
-void tgfreedata(const struct tgtopic *tp, void *data)
+static int tgprintcsvstr(struct tgstring *s, const char *str, size_t n)
 {
-  tgfreedata1(tp->type, data);
+  size_t i;
+  tgprintf(s, "\"");
+  for (i = 0; i < n; i++) {
+    int c = (str[i] == '"') ? tgprintf(s, "\"\"") : tgprintf(s, "%c", str[i]);
+    if (!c)
+      return 0;
+  }
+  return tgprintf(s, "\"");
 }
 
-static void skipspace(struct lexer *l)
+/* String fields are always quoted, so a CR or LF in one stays inside the
+   field; but a chopped row can end inside the quotes, and then the line
+   terminator would become part of the field: close the quote */
+static void tgcsvunchop(struct tgstring *s)
 {
-  while (isspace((unsigned char) *l->src))
-    l->src++;
+  size_t i;
+  int instr = 0;
+  if (!s->chopped)
+    return;
+  for (i = 0; i < s->pos; i++)
+    if (s->buf[i] == '"')
+      instr = !instr;
+  if (instr) {
+    if (s->size < s->pos + 2) {
+      s->size = s->pos + 2;
+      s->buf = realloc(s->buf, s->size);
+    }
+    s->buf[s->pos++] = '"';
+    s->buf[s->pos] = 0;
+  }
 }
 
-static void freetoken(struct token *tok)
+static int iskeyfield(const struct tgtopic *tp, const struct tgtype *t, size_t off)
 {
-  if (tok->kind == TOK_SYMBOL || tok->kind == TOK_STRING)
-    free(tok->val.str);
-  tok->kind = TOK_ERROR;
+  unsigned i;
+  for (i = 0; i < tp->nkeys; i++)
+    if (tp->keys[i].off == off && tp->keys[i].type == t)
+      return 1;
+  return 0;
 }
 
-static void init_lexer(struct token *tok, struct lexer *l, const char *src)
+/* One CSV field per primitive (and per array element), sequences and
+   unions are a single field containing JSON.  If keys != NULL, only
+   the key fields are printed, all others are left empty. */
+static int tgprintcsv1(struct tgstring *s, const struct tgtype *t, const char *data, size_t off, const struct tgtopic *keys, int *first)
 {
-  tok->kind = TOK_ERROR;
-  l->error = l->have_token = 0;
-  l->src = l->srcstart = src;
-}
+  t = detypedef(t);
+  switch (t->kind) {
+    case TG_STRUCT: {
+      const struct tgtype_S *ts = &t->u.S;
+      unsigned i;
+      int c = 1;
+      for (i = 0; c && i < ts->n; i++)
+        c = tgprintcsv1(s, ts->ms[i].type, data, off + ts->ms[i].off, keys, first);
+      return c;
+    }
 
-static int scanerror(struct token *tok, struct lexer *l, const char *fmt, ...)
-{
-  if (!l->error)
-  {
-    const int pos = (int) (tok->src - l->srcstart);
-    const int sz = (int) (l->src - tok->src);
-    va_list ap;
+    case TG_ARRAY: {
+      unsigned i;
+      int c = 1;
+      for (i = 0; c && i < t->u.ary.n; i++)
+        c = tgprintcsv1(s, t->u.ary.type, data, off + i * t->u.ary.type->size, keys, first);
+      return c;
+    }
 
-    {
-      int x, y, nsrc = (int) strlen(l->src);
-      while (nsrc > 0 && isspace((unsigned char)l->src[nsrc-1]))
-        nsrc--;
-      x = (pos < 20) ? pos : 20;
-      y = (nsrc < 20) ? nsrc : 20;
-      fprintf(stderr, "input error in: %*.*s\n", x+sz+y, x+sz+y, l->srcstart+pos-x);
-      fprintf(stderr, "%*.*s", 16+x, 16+x, "");
+    default:
+      break;
+  }
+
+  if (!*first)
+    (void)tgprintf(s, ",");
+  *first = 0;
+  if (keys && !iskeyfield(keys, t, off))
+    return !s->chopped;
+  switch (t->kind) {
+    case TG_CHAR:
+      return tgprintcsvstr(s, data + off, 1);
+    case TG_STRING: {
+      const char *str = *((char **)(data + off));
+      return (str == NULL) ? !s->chopped : tgprintcsvstr(s, str, strlen(str));
+    }
+    case TG_SEQUENCE:
+    case TG_UNION:
+      tgprintf(s, "\"");
+      tgprintjson1(s, t, data + off, "\"\"");
+      return tgprintf(s, "\"");
+    case TG_TIME: {
+      /* an invalid time is an empty field */
+      const DDS_Time_t *tm = (const DDS_Time_t *)(data + off);
+      if (tm->sec == DDS_TIMESTAMP_INVALID_SEC && tm->nanosec == DDS_TIMESTAMP_INVALID_NSEC)
+        return !s->chopped;
+      return tgprintjson1(s, t, data + off, "");
+    }
+    default:
+      /* enums and "inf" times are bare words in CSV */
+      return tgprintjson1(s, t, data + off, "");
+  }
+}
+
+struct fieldpath {
+  const struct fieldpath *up;
+  const char *name;
+  int idx; /* array index if name == NULL */
+};
+
+static void tgprintpath(struct tgstring *s, const struct fieldpath *p)
+{
+  if (p == NULL)
+    return;
+  tgprintpath(s, p->up);
+  if (p->name)
+    (void)tgprintf(s, "%s%s", p->up ? "." : "", p->name);
+  else
+    (void)tgprintf(s, "[%d]", p->idx);
+}
+
+static void tgprintcsvhdr1(struct tgstring *s, const struct tgtype *t, const struct fieldpath *p, int *first)
+{
+  t = detypedef(t);
+  if (t->kind == TG_STRUCT) {
+    unsigned i;
+    for (i = 0; i < t->u.S.n; i++) {
+      struct fieldpath q = { .up = p, .name = t->u.S.ms[i].name, .idx = 0 };
+      tgprintcsvhdr1(s, t->u.S.ms[i].type, &q, first);
+    }
+  } else if (t->kind == TG_ARRAY) {
+    unsigned i;
+    for (i = 0; i < t->u.ary.n; i++) {
+      struct fieldpath q = { .up = p, .name = NULL, .idx = (int) i };
+      tgprintcsvhdr1(s, t->u.ary.type, &q, first);
+    }
+  } else {
+    (void)tgprintf(s, "%s", *first ? "" : ",");
+    tgprintpath(s, p);
+    *first = 0;
+  }
+}
+
+int tgprint(struct tgstring *s, const struct tgtopic *tp, const void *data, enum tgprint_mode mode)
+{
+  if (s->chop == 0)
+    return 0;
+  else
+  {
+    int first = 1;
+    s->chopped = 0;
+    s->pos = 0;
+    s->buf[0] = 0;
+    if (mode == TGPM_JSON) {
+      (void)tgprintjson1(s, tp->type, data, "\"");
+      tgjsonunchop(s);
+    } else if (mode == TGPM_CSV) {
+      (void)tgprintcsv1(s, tp->type, data, 0, NULL, &first);
+      tgcsvunchop(s);
+    } else
+      (void)tgprint1(s, tp->type, data, 0, mode);
+    return !s->chopped;
+  }
+}
+
+static int tgprintfields(struct tgstring *s, unsigned n, const struct tgtopic_key *fields, const void *data, enum tgprint_mode mode)
+{
+  if (s->chop == 0)
+    return 0;
+  else if (mode == TGPM_JSON || mode == TGPM_CSV)
+  {
+    unsigned i;
+    int c = 1, first = 1;
+    s->chopped = 0;
+    s->pos = 0;
+    s->buf[0] = 0;
+    if (mode == TGPM_JSON)
+      c = tgprintf(s, "{");
+    for (i = 0; c && i < n; i++)
+    {
+      if (mode == TGPM_CSV)
+        c = tgprintcsv1(s, fields[i].type, data, fields[i].off, NULL, &first);
+      else
+      {
+        (void)tgprintf(s, "%s\"%s\":", i == 0 ? "" : ",", fields[i].name);
+        c = tgprintjson1(s, fields[i].type, (const char *) data + fields[i].off, "\"");
+      }
+    }
+    if (mode == TGPM_JSON) {
+      (void)tgprintf(s, "}");
+      tgjsonunchop(s);
+    } else
+      tgcsvunchop(s);
+    return !s->chopped;
+  }
+  else
+  {
+    const char *space = (mode == TGPM_DENSE) ? "" : " ";
+    const char *commaspace = (mode == TGPM_DENSE) ? "," : ", ";
+    unsigned i;
+    int c;
+    s->chopped = 0;
+    s->pos = 0;
+    s->buf[0] = 0;
+    c = tgprintf(s, "{%s", mode == TGPM_MULTILINE ? "" : space);
+    for (i = 0; c && i < n; i++)
+    {
+      if (mode == TGPM_MULTILINE)
+        (void)tgprintf(s, "%s\n%*.*s", i == 0 ? "" : ",", 4, 4, "");
+      else
+        (void)tgprintf(s, "%s", i == 0 ? "" : commaspace);
+      if (mode >= TGPM_FIELDS)
+        (void)tgprintf(s, ".%s%s=%s", fields[i].name, space, space);
+      c = tgprint1(s, fields[i].type, (const char *) data + fields[i].off, 0, mode);
+    }
+    (void)tgprintf(s, "%s}", n > 0 ? space : "");
+    return !s->chopped;
+  }
+}
+
+int tgprintkey(struct tgstring *s, const struct tgtopic *tp, const struct tgproj *proj, const void *keydata, enum tgprint_mode mode)
+{
+  if (s->chop > 0 && mode == TGPM_CSV)
+  {
+    /* same columns as a full (projected) sample, but only the key fields
+       filled in */
+    int first = 1;
+    s->chopped = 0;
+    s->pos = 0;
+    s->buf[0] = 0;
+    if (proj == NULL)
+      (void)tgprintcsv1(s, tp->type, keydata, 0, tp, &first);
+    else
+    {
+      unsigned i;
+      int c = 1;
+      for (i = 0; c && i < proj->n; i++)
+        c = tgprintcsv1(s, proj->fields[i].type, keydata, proj->fields[i].off, tp, &first);
+    }
+    tgcsvunchop(s);
+    return !s->chopped;
+  }
+  return tgprintfields(s, tp->nkeys, tp->keys, keydata, mode);
+}
+
+int tgprintproj(struct tgstring *s, const struct tgproj *proj, const void *data, enum tgprint_mode mode)
+{
+  return tgprintfields(s, proj->n, proj->fields, data, mode);
+}
+
+int tgprintcsvhdr(struct tgstring *s, const struct tgtopic *tp, const struct tgproj *proj)
+{
+  int first = 1;
+  s->chopped = 0;
+  s->pos = 0;
+  s->buf[0] = 0;
+  if (proj == NULL)
+    tgprintcsvhdr1(s, tp->type, NULL, &first);
+  else
+  {
+    unsigned i;
+    for (i = 0; i < proj->n; i++)
+    {
+      struct fieldpath p = { .up = NULL, .name = proj->fields[i].name, .idx = 0 };
+      tgprintcsvhdr1(s, proj->fields[i].type, &p, &first);
+    }
+  }
+  return !s->chopped;
+}
+
+static int tgequal1(const struct tgtype *t, const char *a, const char *b)
+{
+  switch (t->kind) {
+    case TG_STRING: {
+      const char *x = *(char **)a, *y = *(char **)b;
+      return (x == NULL || y == NULL) ? (x == y) : (strcmp(x, y) == 0);
+    }
+    case TG_TYPEDEF:
+      return tgequal1(t->u.td.type, a, b);
+    case TG_STRUCT: {
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        if (!tgequal1(t->u.S.ms[i].type, a + t->u.S.ms[i].off, b + t->u.S.ms[i].off))
+          return 0;
+      return 1;
+    }
+    case TG_ARRAY: {
+      const size_t size1 = t->u.ary.type->size;
+      unsigned i;
+      for (i = 0; i < t->u.ary.n; i++)
+        if (!tgequal1(t->u.ary.type, a + i * size1, b + i * size1))
+          return 0;
+      return 1;
+    }
+    case TG_SEQUENCE: {
+      const dds_seq_t *x = (const dds_seq_t *)a, *y = (const dds_seq_t *)b;
+      const size_t size1 = t->u.seq.type->size;
+      unsigned i;
+      if (x->_length != y->_length)
+        return 0;
+      for (i = 0; i < x->_length; i++)
+        if (!tgequal1(t->u.seq.type, (const char *)x->_buffer + i * size1, (const char *)y->_buffer + i * size1))
+          return 0;
+      return 1;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      const uint64_t dv = loaddisc(tu->dtype, a);
+      unsigned i;
+      int msidx;
+      if (dv != loaddisc(tu->dtype, b))
+        return 0;
+      for (i = 0; i < tu->nlab; i++)
+        if (dv == tu->labs[i].val)
+          break;
+      msidx = (i < tu->nlab) ? tu->labs[i].msidx : tu->msidxdef;
+      return msidx == -1 || tgequal1(tu->ms[msidx].type, a + tu->off, b + tu->off);
+    }
+    default:
+      return memcmp(a, b, t->size) == 0;
+  }
+}
+
+/* Number of bytes needed outside the fixed-size part of the sample by
+   tgflatcopy1 */
+static size_t tgflatsize1(const struct tgtype *t, const char *data)
+{
+  switch (t->kind) {
+    case TG_STRING: {
+      const char *str = *(char **)data;
+      return str ? alignup(strlen(str) + 1, 8) : 0;
+    }
+    case TG_TYPEDEF:
+      return tgflatsize1(t->u.td.type, data);
+    case TG_STRUCT: {
+      size_t n = 0;
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        n += tgflatsize1(t->u.S.ms[i].type, data + t->u.S.ms[i].off);
+      return n;
+    }
+    case TG_ARRAY: {
+      size_t n = 0;
+      unsigned i;
+      for (i = 0; i < t->u.ary.n; i++)
+        n += tgflatsize1(t->u.ary.type, data + i * t->u.ary.type->size);
+      return n;
+    }
+    case TG_SEQUENCE: {
+      const dds_seq_t *seq = (const dds_seq_t *)data;
+      const size_t size1 = t->u.seq.type->size;
+      size_t n = alignup(seq->_length * size1, 8);
+      unsigned i;
+      for (i = 0; i < seq->_length; i++)
+        n += tgflatsize1(t->u.seq.type, (const char *)seq->_buffer + i * size1);
+      return n;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      const uint64_t dv = loaddisc(tu->dtype, data);
+      unsigned i;
+      int msidx;
+      for (i = 0; i < tu->nlab; i++)
+        if (dv == tu->labs[i].val)
+          break;
+      msidx = (i < tu->nlab) ? tu->labs[i].msidx : tu->msidxdef;
+      return (msidx == -1) ? 0 : tgflatsize1(tu->ms[msidx].type, data + tu->off);
+    }
+    default:
+      return 0;
+  }
+}
+
+/* dst already contains a bitwise copy of src, redirect all pointers in
+   dst to copies in *heap */
+static void tgflatcopy1(const struct tgtype *t, char *dst, const char *src, char **heap)
+{
+  switch (t->kind) {
+    case TG_STRING: {
+      const char *str = *(char **)src;
+      if (str) {
+        const size_t n = strlen(str) + 1;
+        memcpy(*heap, str, n);
+        *(char **)dst = *heap;
+        *heap += alignup(n, 8);
+      }
+      break;
+    }
+    case TG_TYPEDEF:
+      tgflatcopy1(t->u.td.type, dst, src, heap);
+      break;
+    case TG_STRUCT: {
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        tgflatcopy1(t->u.S.ms[i].type, dst + t->u.S.ms[i].off, src + t->u.S.ms[i].off, heap);
+      break;
+    }
+    case TG_ARRAY: {
+      const size_t size1 = t->u.ary.type->size;
+      unsigned i;
+      for (i = 0; i < t->u.ary.n; i++)
+        tgflatcopy1(t->u.ary.type, dst + i * size1, src + i * size1, heap);
+      break;
+    }
+    case TG_SEQUENCE: {
+      const dds_seq_t *sseq = (const dds_seq_t *)src;
+      dds_seq_t *dseq = (dds_seq_t *)dst;
+      const size_t size1 = t->u.seq.type->size;
+      char *buf = *heap;
+      unsigned i;
+      memcpy(buf, sseq->_buffer, sseq->_length * size1);
+      dseq->_buffer = (void *) buf;
+      dseq->_maximum = dseq->_length;
+      dseq->_release = 0;
+      *heap += alignup(sseq->_length * size1, 8);
+      for (i = 0; i < sseq->_length; i++)
+        tgflatcopy1(t->u.seq.type, buf + i * size1, (const char *)sseq->_buffer + i * size1, heap);
+      break;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      const uint64_t dv = loaddisc(tu->dtype, src);
+      unsigned i;
+      int msidx;
+      for (i = 0; i < tu->nlab; i++)
+        if (dv == tu->labs[i].val)
+          break;
+      msidx = (i < tu->nlab) ? tu->labs[i].msidx : tu->msidxdef;
+      if (msidx != -1)
+        tgflatcopy1(tu->ms[msidx].type, dst + tu->off, src + tu->off, heap);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+size_t tgcopysize(const struct tgtopic *tp, const void *data)
+{
+  return alignup(tp->size, 8) + tgflatsize1(tp->type, data);
+}
+
+void tgcopy(const struct tgtopic *tp, void *dst, const void *data)
+{
+  char *heap = (char *) dst + alignup(tp->size, 8);
+  memcpy(dst, data, tp->size);
+  tgflatcopy1(tp->type, dst, data, &heap);
+}
+
+static int tgprimitive(const struct tgtype *t)
+{
+  switch (detypedef(t)->kind) {
+    case TG_BOOLEAN: case TG_CHAR: case TG_INT: case TG_UINT:
+    case TG_FLOAT: case TG_ENUM: case TG_TIME:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int tgselectmember(const struct tgtype_U *tu, const char *data)
+{
+  const uint64_t dv = loaddisc(tu->dtype, data);
+  unsigned i;
+  for (i = 0; i < tu->nlab; i++)
+    if (dv == tu->labs[i].val)
+      return tu->labs[i].msidx;
+  return tu->msidxdef;
+}
+
+static size_t tgencodesize1(const struct tgtype *t, const char *data)
+{
+  switch (t->kind) {
+    case TG_STRING: {
+      const char *str = *(char **)data;
+      return sizeof(uint32_t) + (str ? strlen(str) : 0);
+    }
+    case TG_TYPEDEF:
+      return tgencodesize1(t->u.td.type, data);
+    case TG_STRUCT: {
+      size_t n = 0;
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        n += tgencodesize1(t->u.S.ms[i].type, data + t->u.S.ms[i].off);
+      return n;
+    }
+    case TG_ARRAY: {
+      const size_t size1 = t->u.ary.type->size;
+      size_t n = 0;
+      unsigned i;
+      if (tgprimitive(t->u.ary.type))
+        return t->u.ary.n * size1;
+      for (i = 0; i < t->u.ary.n; i++)
+        n += tgencodesize1(t->u.ary.type, data + i * size1);
+      return n;
+    }
+    case TG_SEQUENCE: {
+      const dds_seq_t *seq = (const dds_seq_t *)data;
+      const size_t size1 = t->u.seq.type->size;
+      size_t n = sizeof(uint32_t);
+      unsigned i;
+      if (tgprimitive(t->u.seq.type))
+        return n + seq->_length * size1;
+      for (i = 0; i < seq->_length; i++)
+        n += tgencodesize1(t->u.seq.type, (const char *)seq->_buffer + i * size1);
+      return n;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      const int msidx = tgselectmember(tu, data);
+      return tu->dtype->size + ((msidx == -1) ? 0 : tgencodesize1(tu->ms[msidx].type, data + tu->off));
+    }
+    default:
+      return t->size;
+  }
+}
+
+static char *tgencode1(const struct tgtype *t, char *dst, const char *data)
+{
+  switch (t->kind) {
+    case TG_STRING: {
+      const char *str = *(char **)data;
+      const uint32_t n = str ? (uint32_t)strlen(str) : 0;
+      memcpy(dst, &n, sizeof(n));
+      if (n > 0)
+        memcpy(dst + sizeof(n), str, n);
+      return dst + sizeof(n) + n;
+    }
+    case TG_TYPEDEF:
+      return tgencode1(t->u.td.type, dst, data);
+    case TG_STRUCT: {
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        dst = tgencode1(t->u.S.ms[i].type, dst, data + t->u.S.ms[i].off);
+      return dst;
+    }
+    case TG_ARRAY: {
+      const size_t size1 = t->u.ary.type->size;
+      unsigned i;
+      if (tgprimitive(t->u.ary.type)) {
+        memcpy(dst, data, t->u.ary.n * size1);
+        return dst + t->u.ary.n * size1;
+      }
+      for (i = 0; i < t->u.ary.n; i++)
+        dst = tgencode1(t->u.ary.type, dst, data + i * size1);
+      return dst;
+    }
+    case TG_SEQUENCE: {
+      const dds_seq_t *seq = (const dds_seq_t *)data;
+      const size_t size1 = t->u.seq.type->size;
+      const uint32_t n = seq->_length;
+      unsigned i;
+      memcpy(dst, &n, sizeof(n));
+      dst += sizeof(n);
+      if (n > 0 && tgprimitive(t->u.seq.type)) {
+        memcpy(dst, seq->_buffer, n * size1);
+        return dst + n * size1;
+      }
+      for (i = 0; i < n; i++)
+        dst = tgencode1(t->u.seq.type, dst, (const char *)seq->_buffer + i * size1);
+      return dst;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      const int msidx = tgselectmember(tu, data);
+      dst = tgencode1(tu->dtype, dst, data);
+      return (msidx == -1) ? dst : tgencode1(tu->ms[msidx].type, dst, data + tu->off);
+    }
+    default:
+      memcpy(dst, data, t->size);
+      return dst + t->size;
+  }
+}
+
+static const void *tgkeysample(const struct tgtopic *tp, const void *data, void **tmp)
+{
+  /* a zero-initialised sample with only the key fields copied from data */
+  unsigned i;
+  *tmp = calloc(1, tp->size);
+  for (i = 0; i < tp->nkeys; i++)
+    memcpy((char *)*tmp + tp->keys[i].off, (const char *)data + tp->keys[i].off, tp->keys[i].type->size);
+  return *tmp;
+}
+
+size_t tgencodesize(const struct tgtopic *tp, const void *data, int keyonly)
+{
+  void *tmp = NULL;
+  size_t n;
+  if (keyonly)
+    data = tgkeysample(tp, data, &tmp);
+  n = tgencodesize1(tp->type, data);
+  free(tmp);
+  return n;
+}
+
+void tgencode(const struct tgtopic *tp, void *dst, const void *data, int keyonly)
+{
+  void *tmp = NULL;
+  if (keyonly)
+    data = tgkeysample(tp, data, &tmp);
+  (void)tgencode1(tp->type, dst, data);
+  free(tmp);
+}
+
+/* JSON variant of tgprintdiff1: a struct that changed becomes a nested
+   object with only the members that changed, anything else that
+   changed (including arrays, JSON having no sparse arrays) is printed
+   as a whole; NAME is NULL for the top-level struct, whose members go
+   directly into the enclosing object */
+static int tgprintdiffjson1(struct tgstring *s, const struct tgtype *t, const char *old, const char *new, const char *name, int *first)
+{
+  t = detypedef(t);
+  if (tgequal1(t, old, new))
+    return 1;
+  if (name != NULL) {
+    (void)tgprintf(s, "%s\"%s\":", *first ? "" : ",", name);
+    *first = 0;
+  }
+  if (t->kind == TG_STRUCT) {
+    int c = 1, firstm = 1;
+    int *pfirst = (name != NULL) ? &firstm : first;
+    unsigned i;
+    if (name != NULL)
+      (void)tgprintf(s, "{");
+    for (i = 0; c && i < t->u.S.n; i++)
+      c = tgprintdiffjson1(s, t->u.S.ms[i].type, old + t->u.S.ms[i].off, new + t->u.S.ms[i].off, t->u.S.ms[i].name, pfirst);
+    if (name != NULL)
+      c = tgprintf(s, "}");
+    return c;
+  }
+  return tgprintjson1(s, t, new, "\"");
+}
+
+/* Prints the primitive fields (and array elements) that differ between
+   old and new, sequences and unions are compared and printed as a
+   whole */
+static int tgprintdiff1(struct tgstring *s, const struct tgtype *t, const char *old, const char *new, const struct fieldpath *p, int *first, enum tgprint_mode mode)
+{
+  t = detypedef(t);
+  if (t->kind == TG_STRUCT) {
+    unsigned i;
+    int c = 1;
+    for (i = 0; c && i < t->u.S.n; i++) {
+      struct fieldpath q = { .up = p, .name = t->u.S.ms[i].name, .idx = 0 };
+      c = tgprintdiff1(s, t->u.S.ms[i].type, old + t->u.S.ms[i].off, new + t->u.S.ms[i].off, &q, first, mode);
+    }
+    return c;
+  } else if (t->kind == TG_ARRAY) {
+    const size_t size1 = t->u.ary.type->size;
+    unsigned i;
+    int c = 1;
+    for (i = 0; c && i < t->u.ary.n; i++) {
+      struct fieldpath q = { .up = p, .name = NULL, .idx = (int) i };
+      c = tgprintdiff1(s, t->u.ary.type, old + i * size1, new + i * size1, &q, first, mode);
+    }
+    return c;
+  } else if (tgequal1(t, old, new)) {
+    return 1;
+  } else {
+    const char *space = (mode == TGPM_DENSE) ? "" : " ";
+    if (mode == TGPM_MULTILINE)
+      (void)tgprintf(s, "%s\n%*.*s.", *first ? "" : ",", 4, 4, "");
+    else
+      (void)tgprintf(s, "%s.", *first ? "" : (mode == TGPM_DENSE) ? "," : ", ");
+    tgprintpath(s, p);
+    (void)tgprintf(s, "%s=%s", space, space);
+    *first = 0;
+    return tgprint1(s, t, new, 4, mode);
+  }
+}
+
+struct tgdelta_inst {
+  DDS_InstanceHandle_t ih;
+  struct tgdelta_inst *lrunext, *lruprev;
+  size_t cap;
+  char *data; /* flattened copy of the last sample */
+};
+
+struct tgdelta {
+  const struct tgtopic *tp;
+  const struct tgproj *proj;
+  unsigned maxinst, ninst;
+  unsigned hmask;
+  struct tgdelta_inst **htab; /* open addressing, linear probing */
+  struct tgdelta_inst lru; /* sentinel: lru.lrunext is most recently used */
+};
+
+static unsigned tgdelta_hash(const struct tgdelta *d, DDS_InstanceHandle_t ih)
+{
+  return (unsigned) (((uint64_t) ih * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & d->hmask;
+}
+
+static unsigned tgdelta_lookup(const struct tgdelta *d, DDS_InstanceHandle_t ih)
+{
+  unsigned i = tgdelta_hash(d, ih);
+  while (d->htab[i] != NULL && d->htab[i]->ih != ih)
+    i = (i + 1) & d->hmask;
+  return i;
+}
+
+static void tgdelta_remove(struct tgdelta *d, unsigned i)
+{
+  struct tgdelta_inst *inst = d->htab[i];
+  unsigned j = i;
+  inst->lruprev->lrunext = inst->lrunext;
+  inst->lrunext->lruprev = inst->lruprev;
+  free(inst->data);
+  free(inst);
+  d->ninst--;
+  /* backward shift deletion keeps probe sequences intact */
+  d->htab[i] = NULL;
+  for (;;) {
+    unsigned h;
+    j = (j + 1) & d->hmask;
+    if (d->htab[j] == NULL)
+      break;
+    h = tgdelta_hash(d, d->htab[j]->ih);
+    if (((j - h) & d->hmask) >= ((j - i) & d->hmask)) {
+      d->htab[i] = d->htab[j];
+      d->htab[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+struct tgdelta *tgdelta_new(const struct tgtopic *tp, const struct tgproj *proj, unsigned maxinst)
+{
+  struct tgdelta *d = malloc(sizeof(*d));
+  unsigned hsize = 16;
+  /* at most half full, so lookups always terminate */
+  if (maxinst > TG_MAXINST)
+    maxinst = TG_MAXINST;
+  while (hsize / 2 < maxinst)
+    hsize *= 2;
+  d->tp = tp;
+  d->proj = proj;
+  d->maxinst = maxinst;
+  d->ninst = 0;
+  d->hmask = hsize - 1;
+  d->htab = calloc(hsize, sizeof(*d->htab));
+  d->lru.lrunext = d->lru.lruprev = &d->lru;
+  return d;
+}
+
+void tgdelta_free(struct tgdelta *d)
+{
+  unsigned i;
+  for (i = 0; i <= d->hmask; i++) {
+    if (d->htab[i]) {
+      free(d->htab[i]->data);
+      free(d->htab[i]);
+    }
+  }
+  free(d->htab);
+  free(d);
+}
+
+void tgdelta_forget(struct tgdelta *d, DDS_InstanceHandle_t ih)
+{
+  unsigned i = tgdelta_lookup(d, ih);
+  if (d->htab[i])
+    tgdelta_remove(d, i);
+}
+
+int tgprintdelta(struct tgstring *s, struct tgdelta *d, DDS_InstanceHandle_t ih, const void *data, enum tgprint_mode mode)
+{
+  const struct tgtopic *tp = d->tp;
+  unsigned i = tgdelta_lookup(d, ih);
+  struct tgdelta_inst *inst = d->htab[i];
+  const char *space = (mode == TGPM_DENSE || mode == TGPM_JSON) ? "" : " ";
+  size_t sz;
+  int first = 1;
+
+  s->chopped = 0;
+  s->pos = 0;
+  s->buf[0] = 0;
+  if (inst == NULL) {
+    if (d->proj)
+      (void)tgprintproj(s, d->proj, data, mode);
+    else
+      (void)tgprint(s, tp, data, mode);
+    if (d->ninst == d->maxinst) {
+      tgdelta_remove(d, tgdelta_lookup(d, d->lru.lruprev->ih));
+      i = tgdelta_lookup(d, ih);
+    }
+    inst = malloc(sizeof(*inst));
+    inst->ih = ih;
+    inst->cap = 0;
+    inst->data = NULL;
+    d->htab[i] = inst;
+    d->ninst++;
+  } else {
+    inst->lruprev->lrunext = inst->lrunext;
+    inst->lrunext->lruprev = inst->lruprev;
+    (void)tgprintf(s, "{%s", mode == TGPM_MULTILINE ? "" : space);
+    if (d->proj == NULL) {
+      if (mode == TGPM_JSON)
+        (void)tgprintdiffjson1(s, tp->type, inst->data, data, NULL, &first);
+      else
+        (void)tgprintdiff1(s, tp->type, inst->data, data, NULL, &first, mode);
+    } else {
+      /* projected fields are keyed by their projection path, as in
+         tgprintproj */
+      unsigned k;
+      for (k = 0; k < d->proj->n; k++) {
+        const struct tgtopic_key *f = &d->proj->fields[k];
+        struct fieldpath p = { .up = NULL, .name = f->name, .idx = 0 };
+        if (mode == TGPM_JSON)
+          (void)tgprintdiffjson1(s, f->type, inst->data + f->off, (const char *) data + f->off, f->name, &first);
+        else
+          (void)tgprintdiff1(s, f->type, inst->data + f->off, (const char *) data + f->off, &p, &first, mode);
+      }
+    }
+    (void)tgprintf(s, "%s}", first ? "" : space);
+    if (mode == TGPM_JSON)
+      tgjsonunchop(s);
+  }
+  inst->lrunext = d->lru.lrunext;
+  inst->lruprev = &d->lru;
+  d->lru.lrunext->lruprev = inst;
+  d->lru.lrunext = inst;
+
+  if (!first || inst->data == NULL) {
+    sz = tgcopysize(tp, data);
+    if (sz > inst->cap) {
+      inst->data = realloc(inst->data, sz);
+      inst->cap = sz;
+    }
+    tgcopy(tp, inst->data, data);
+    return 1;
+  }
+  return 0;
+}
+
+struct tgkeycache_inst {
+  uint64_t hash;
+  DDS_InstanceHandle_t ih;
+  struct tgkeycache_inst *lrunext, *lruprev;
+  size_t len;
+  char key[]; /* key fields in tgencode format */
+};
+
+struct tgkeycache {
+  const struct tgtopic *tp;
+  unsigned maxinst, ninst;
+  unsigned hmask;
+  struct tgkeycache_inst **htab; /* open addressing, linear probing */
+  struct tgkeycache_inst lru; /* sentinel: lru.lrunext is most recently used */
+  char *kbuf;
+  size_t kbufsize;
+};
+
+static size_t tgkeycache_encode(struct tgkeycache *c, const char *data, uint64_t *hash)
+{
+  const struct tgtopic *tp = c->tp;
+  size_t n = 0, i;
+  unsigned k;
+  char *p;
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+  for (k = 0; k < tp->nkeys; k++)
+    n += tgencodesize1(tp->keys[k].type, data + tp->keys[k].off);
+  if (n > c->kbufsize) {
+    c->kbuf = realloc(c->kbuf, n);
+    c->kbufsize = n;
+  }
+  p = c->kbuf;
+  for (k = 0; k < tp->nkeys; k++)
+    p = tgencode1(tp->keys[k].type, p, data + tp->keys[k].off);
+  /* FNV-1a */
+  for (i = 0; i < n; i++)
+    h = (h ^ (unsigned char)c->kbuf[i]) * UINT64_C(0x100000001b3);
+  *hash = h;
+  return n;
+}
+
+static unsigned tgkeycache_probe(const struct tgkeycache *c, uint64_t hash, size_t len)
+{
+  unsigned i = (unsigned)(hash >> 32) & c->hmask;
+  const struct tgkeycache_inst *inst;
+  while ((inst = c->htab[i]) != NULL &&
+         !(inst->hash == hash && inst->len == len && memcmp(inst->key, c->kbuf, len) == 0))
+    i = (i + 1) & c->hmask;
+  return i;
+}
+
+static void tgkeycache_remove(struct tgkeycache *c, unsigned i)
+{
+  struct tgkeycache_inst *inst = c->htab[i];
+  unsigned j = i;
+  inst->lruprev->lrunext = inst->lrunext;
+  inst->lrunext->lruprev = inst->lruprev;
+  free(inst);
+  c->ninst--;
+  /* backward shift deletion, as for tgdelta */
+  c->htab[i] = NULL;
+  for (;;) {
+    unsigned h;
+    j = (j + 1) & c->hmask;
+    if (c->htab[j] == NULL)
+      break;
+    h = (unsigned)(c->htab[j]->hash >> 32) & c->hmask;
+    if (((j - h) & c->hmask) >= ((j - i) & c->hmask)) {
+      c->htab[i] = c->htab[j];
+      c->htab[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+struct tgkeycache *tgkeycache_new(const struct tgtopic *tp, unsigned maxinst)
+{
+  struct tgkeycache *c = malloc(sizeof(*c));
+  unsigned hsize = 16;
+  if (maxinst > TG_MAXINST)
+    maxinst = TG_MAXINST;
+  while (hsize / 2 < maxinst)
+    hsize *= 2;
+  c->tp = tp;
+  c->maxinst = maxinst;
+  c->ninst = 0;
+  c->hmask = hsize - 1;
+  c->htab = calloc(hsize, sizeof(*c->htab));
+  c->lru.lrunext = c->lru.lruprev = &c->lru;
+  c->kbuf = NULL;
+  c->kbufsize = 0;
+  return c;
+}
+
+void tgkeycache_free(struct tgkeycache *c)
+{
+  unsigned i;
+  for (i = 0; i <= c->hmask; i++)
+    free(c->htab[i]);
+  free(c->htab);
+  free(c->kbuf);
+  free(c);
+}
+
+DDS_InstanceHandle_t *tgkeycache_lookup(struct tgkeycache *c, const void *data, int create)
+{
+  uint64_t hash;
+  const size_t len = tgkeycache_encode(c, data, &hash);
+  unsigned i = tgkeycache_probe(c, hash, len);
+  struct tgkeycache_inst *inst = c->htab[i];
+  if (inst != NULL) {
+    inst->lruprev->lrunext = inst->lrunext;
+    inst->lrunext->lruprev = inst->lruprev;
+  } else if (!create) {
+    return NULL;
+  } else {
+    if (c->ninst == c->maxinst) {
+      struct tgkeycache_inst *old = c->lru.lruprev;
+      unsigned j = (unsigned)(old->hash >> 32) & c->hmask;
+      while (c->htab[j] != old)
+        j = (j + 1) & c->hmask;
+      tgkeycache_remove(c, j);
+      i = tgkeycache_probe(c, hash, len);
+    }
+    inst = malloc(sizeof(*inst) + len);
+    inst->hash = hash;
+    inst->ih = DDS_HANDLE_NIL;
+    inst->len = len;
+    if (len > 0)
+      memcpy(inst->key, c->kbuf, len);
+    c->htab[i] = inst;
+    c->ninst++;
+  }
+  inst->lrunext = c->lru.lrunext;
+  inst->lruprev = &c->lru;
+  c->lru.lrunext->lruprev = inst;
+  c->lru.lrunext = inst;
+  return &inst->ih;
+}
+
+void tgkeycache_forget(struct tgkeycache *c, const void *data)
+{
+  uint64_t hash;
+  const size_t len = tgkeycache_encode(c, data, &hash);
+  unsigned i = tgkeycache_probe(c, hash, len);
+  if (c->htab[i])
+    tgkeycache_remove(c, i);
+}
+
+static void tgfreedata1(const struct tgtype *t, char *data)
+{
+  switch(t->kind) {
+    case TG_BOOLEAN:
+    case TG_CHAR:
+    case TG_INT:
+    case TG_UINT:
+    case TG_FLOAT:
+    case TG_ENUM:
+    case TG_TIME:
+      break;
+
+    case TG_STRING:
+      free(*(char **)data);
+      break;
+
+    case TG_TYPEDEF:
+      tgfreedata1(t->u.td.type, data);
+      break;
+
+    case TG_STRUCT: {
+      const struct tgtype_S *ts = &t->u.S;
+      for (unsigned i = 0; i < ts->n; i++)
+        tgfreedata1(ts->ms[i].type, data + ts->ms[i].off);
+      break;
+    }
+
+    case TG_ARRAY:
+      for (unsigned i = 0; i < t->u.ary.n; i++)
+        tgfreedata1(t->u.ary.type, data + i * t->u.ary.type->size);
+      break;
+
+    case TG_SEQUENCE: {
+      const dds_seq_t *seq = (const dds_seq_t *)data;
+      for (unsigned i = 0; i < seq->_length; i++)
+        tgfreedata1(t->u.seq.type, (char*)seq->_buffer + i * t->u.seq.type->size);
+      free(seq->_buffer);
+      break;
+    }
+
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      uint64_t dv = loaddisc(tu->dtype, data);
+      unsigned i;
+      int msidx;
+      for (i = 0; i < tu->nlab; i++)
+        if (dv == tu->labs[i].val)
+          break;
+      msidx = (i < tu->nlab) ? tu->labs[i].msidx : tu->msidxdef;
+      if (msidx >= 0)
+        tgfreedata1(tu->ms[msidx].type, data + tu->off);
+      break;
+    }
+  }
+}
+
+void tgfreedata(const struct tgtopic *tp, void *data)
+{
+  tgfreedata1(tp->type, data);
+}
+
+static void skipspace(struct lexer *l)
+{
+  /* a newline ends the input as much as a NUL does, so scanning from a
+     buffer holding many lines never runs into the next one */
+  while (isspace((unsigned char) *l->src) && *l->src != '\n')
+    l->src++;
+}
+
+static void freetoken(struct token *tok)
+{
+  if (tok->kind == TOK_SYMBOL || tok->kind == TOK_STRING)
+    free(tok->val.str);
+  tok->kind = TOK_ERROR;
+}
+
+static void init_lexer(struct token *tok, struct lexer *l, const char *src)
+{
+  tok->kind = TOK_ERROR;
+  l->error = l->have_token = 0;
+  l->src = l->srcstart = src;
+  l->tmpl = NULL;
+}
+
+static int scanerror(struct token *tok, struct lexer *l, const char *fmt, ...)
+{
+  if (!l->error)
+  {
+    const int pos = (int) (tok->src - l->srcstart);
+    const int sz = (int) (l->src - tok->src);
+    va_list ap;
+
+    {
+      int x, y, nsrc = (int) strcspn(l->src, "\n");
+      while (nsrc > 0 && isspace((unsigned char)l->src[nsrc-1]))
+        nsrc--;
+      x = (pos < 20) ? pos : 20;
+      y = (nsrc < 20) ? nsrc : 20;
+      fprintf(stderr, "input error in: %*.*s\n", x+sz+y, x+sz+y, l->srcstart+pos-x);
+      fprintf(stderr, "%*.*s", 16+x, 16+x, "");
       for (int i = 0; i < (sz ? sz : 1); i++)
         fputc('^', stderr);
       fprintf(stderr, "\n");
@@ -1420,7 +2821,7 @@ static int scanbarechar(char *x, struct lexer *l)
     l->src++;
     if (!scancharesc(x, l))
       return 0;
-  } else if (*l->src == 0) {
+  } else if (*l->src == 0 || *l->src == '\n') {
     scanerror (&tok, l, "unexpected end of input");
     return 0;
   } else {
@@ -1470,14 +2871,14 @@ static enum tokenkind scanstring(struct token *tok, struct lexer *l)
   }
   tok->val.str = NULL;
   l->src++;
-  while (*l->src && *l->src != '"') {
+  while (*l->src && *l->src != '\n' && *l->src != '"') {
     char x;
     if (!scanbarechar(&x, l)) {
       free(tok->val.str);
       return TOK_ERROR;
     }
     if (n == sz)
-      tok->val.str = realloc(tok->val.str, sz += 256);
+      tok->val.str = realloc(tok->val.str, sz = sz ? 2 * sz : 64);
     tok->val.str[n++] = (char)x;
   }
   if (n == sz)
@@ -1504,7 +2905,7 @@ static enum tokenkind scantoken(struct token *tok, struct lexer *l)
     tok->src = l->src;
     switch (*l->src)
     {
-      case 0:
+      case 0: case '\n':
         return tok->kind = TOK_EOF;
       case '-':
       case '0': case '1': case '2': case '3': case '4':
@@ -1543,6 +2944,13 @@ static enum tokenkind scantoken(struct token *tok, struct lexer *l)
       case ']':
         l->src++;
         return tok->kind = TOK_RBRACKET;
+      case '$':
+        if (l->tmpl && l->src[1] == 'i' && !isalnum((unsigned char) l->src[2]) && l->src[2] != '_') {
+          l->src += 2;
+          return tok->kind = TOK_COUNTER;
+        }
+        tok->val.ch = *l->src++;
+        return tok->kind = TOK_LITERAL;
       default:
         if (isalpha((unsigned char) *l->src) || *l->src == '_')
           return tok->kind = scanword(tok, l);
@@ -1655,7 +3063,144 @@ static int tgscan1fieldsel (const struct tgtype_S *ts, struct lexer *l, unsigned
   return 1;
 }
 
-static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
+struct tgarena_block {
+  struct tgarena_block *next;
+  size_t size, pos;
+  char *data;
+};
+
+struct tgarena {
+  struct tgarena_block *first, *cur;
+  void *last; /* most recent allocation, can be grown in place */
+};
+
+#define TGARENA_BLOCKSIZE 65536
+#define TGARENA_ALIGN 8
+
+static struct tgarena_block *tgarena_newblock(size_t size)
+{
+  struct tgarena_block *b = malloc(sizeof(*b));
+  b->next = NULL;
+  b->size = size;
+  b->pos = 0;
+  b->data = malloc(size);
+  return b;
+}
+
+struct tgarena *tgarena_new(void)
+{
+  struct tgarena *a = malloc(sizeof(*a));
+  a->first = a->cur = tgarena_newblock(TGARENA_BLOCKSIZE);
+  a->last = NULL;
+  return a;
+}
+
+void tgarena_reset(struct tgarena *a)
+{
+  /* blocks after the first are reset when they are reached again */
+  a->cur = a->first;
+  a->cur->pos = 0;
+  a->last = NULL;
+}
+
+void tgarena_free(struct tgarena *a)
+{
+  struct tgarena_block *b = a->first;
+  while (b)
+  {
+    struct tgarena_block *next = b->next;
+    free(b->data);
+    free(b);
+    b = next;
+  }
+  free(a);
+}
+
+static void *tgarena_alloc(struct tgarena *a, size_t size)
+{
+  struct tgarena_block *b = a->cur;
+  size_t pos = alignup(b->pos, TGARENA_ALIGN);
+  while (pos + size > b->size)
+  {
+    if (b->next == NULL || b->next->size < size)
+    {
+      /* oversized requests get a block of their own, inserted here */
+      struct tgarena_block *nb = tgarena_newblock(size > TGARENA_BLOCKSIZE ? size : TGARENA_BLOCKSIZE);
+      nb->next = b->next;
+      b->next = nb;
+    }
+    b = a->cur = b->next;
+    b->pos = pos = 0;
+  }
+  b->pos = pos + size;
+  return a->last = b->data + pos;
+}
+
+static void *tgarena_realloc(struct tgarena *a, void *old, size_t oldsize, size_t newsize)
+{
+  struct tgarena_block *b = a->cur;
+  void *new;
+  if (old != NULL && old == a->last && (char *) old + newsize <= b->data + b->size)
+  {
+    b->pos = (size_t) ((char *) old - b->data) + newsize;
+    return old;
+  }
+  new = tgarena_alloc(a, newsize);
+  if (oldsize)
+    memcpy(new, old, oldsize);
+  return new;
+}
+
+static void *scanalloc(struct tgarena *a, size_t size)
+{
+  return a ? tgarena_alloc(a, size) : malloc(size);
+}
+
+static void *scanrealloc(struct tgarena *a, void *old, size_t oldsize, size_t newsize)
+{
+  return a ? tgarena_realloc(a, old, oldsize, newsize) : realloc(old, newsize);
+}
+
+/* A template is a sample scanned once, with the locations of $i (numeric
+   fields and string literals containing $i) recorded so that a counter
+   value can be substituted in place */
+struct tgpatch {
+  enum tgkind kind; /* TG_INT, TG_UINT, TG_FLOAT or TG_STRING */
+  size_t size;
+  char *ptr; /* value, or for strings the buffer holding the result */
+  const char *fmt; /* strings only */
+};
+
+struct tgtemplate {
+  unsigned n, max;
+  struct tgpatch *ps;
+};
+
+static struct tgpatch *tgtemplate_add(struct tgtemplate *tmpl, enum tgkind kind, size_t size, char *ptr)
+{
+  struct tgpatch *p;
+  if (tmpl->n == tmpl->max) {
+    tmpl->max = tmpl->max ? 2 * tmpl->max : 4;
+    tmpl->ps = realloc(tmpl->ps, tmpl->max * sizeof(*tmpl->ps));
+  }
+  p = &tmpl->ps[tmpl->n++];
+  p->kind = kind;
+  p->size = size;
+  p->ptr = ptr;
+  p->fmt = NULL;
+  return p;
+}
+
+static void tgtemplate_rebase(struct tgtemplate *tmpl, const char *old, size_t size, char *new)
+{
+  /* sequence buffer moved while scanning its elements */
+  unsigned i;
+  for (i = 0; i < tmpl->n; i++)
+    if (tmpl->ps[i].kind != TG_STRING && tmpl->ps[i].ptr >= old && tmpl->ps[i].ptr < old + size)
+      tmpl->ps[i].ptr = new + (tmpl->ps[i].ptr - old);
+}
+
+static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l, struct tgarena *a)
 {
   struct token tok = TOKEN_INIT(l->src);
   enum tokenkind tk;
@@ -1663,6 +3208,13 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
 
   t = detypedef(t);
   tk = scantoken(&tok, l);
+  if (tk == TOK_COUNTER) {
+    if (t->kind != TG_INT && t->kind != TG_UINT && t->kind != TG_FLOAT)
+      return scanerror(&tok, l, "$i is allowed only for integer and floating-point fields");
+    (void)tgtemplate_add(l->tmpl, t->kind, t->size, dst);
+    memset(dst, 0, t->size);
+    return 1;
+  }
   switch(t->kind) {
     case TG_BOOLEAN:
       if (!lookupenum(&v, &tok, l, &boolean_as_enum))
@@ -1723,7 +3275,28 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
     case TG_STRING:
       if (tk != TOK_STRING)
         return scanerror(&tok, l, "string literal expected");
-      *((char **)dst) = strdup(tok.val.str);
+      if (l->tmpl && strstr(tok.val.str, "$i")) {
+        /* room for the longest int64 at each occurrence */
+        const char *q = tok.val.str;
+        size_t n = strlen(tok.val.str) + 1, fmtlen = n;
+        struct tgpatch *p;
+        char *fmt;
+        while ((q = strstr(q, "$i")) != NULL) {
+          n += 20;
+          q += 2;
+        }
+        fmt = memcpy(tgarena_alloc(a, fmtlen), tok.val.str, fmtlen);
+        p = tgtemplate_add(l->tmpl, TG_STRING, n, tgarena_alloc(a, n));
+        p->fmt = fmt;
+        strcpy(p->ptr, fmt);
+        *((char **)dst) = p->ptr;
+      } else if (a) {
+        size_t n = strlen(tok.val.str) + 1;
+        *((char **)dst) = memcpy(tgarena_alloc(a, n), tok.val.str, n);
+      } else {
+        *((char **)dst) = tok.val.str;
+        tok.kind = TOK_ERROR; /* string now owned by dst */
+      }
       break;
 
     case TG_TIME:
@@ -1748,7 +3321,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
       if (tk == TOK_DOT) {
         if (!tgscan1fieldsel (ts, l, &fidx))
           return scanerror (&tok, l, "(unwinding)");
-        if (!tgscan1(dst + ts->ms[fidx].off, ts->ms[fidx].type, l))
+        if (!tgscan1(dst + ts->ms[fidx].off, ts->ms[fidx].type, l, a))
           return scanerror (&tok, l, "(unwinding)");
       } else {
         if (tk != TOK_LBRACE)
@@ -1767,7 +3340,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
             return scanerror (&tok, l, "(unwinding)");
           if (fidx == ts->n)
             return scanerror (&tok, l, "fields beyond end of struct present");
-          if (!tgscan1(dst + ts->ms[fidx].off, ts->ms[fidx].type, l))
+          if (!tgscan1(dst + ts->ms[fidx].off, ts->ms[fidx].type, l, a))
             return scanerror (&tok, l, "(unwinding)");
           first = 0;
           fidx++;
@@ -1780,7 +3353,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
       dds_seq_t tmpseq, *dstseq;
       const struct tgtype *st = t->u.seq.type;
       const size_t size1 = st->size;
-      unsigned maxn;
+      unsigned maxn, cap = 0;
       if (t->kind == TG_SEQUENCE) {
         dstseq = (dds_seq_t *) dst;
         memset(dstseq, 0, sizeof (*dstseq));
@@ -1801,9 +3374,18 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
             return scanerror(&tok, l, "',' expected");
           if (maxn && dstseq->_length == maxn)
             return scanerror(&tok, l, "too many elements");
-          if (t->kind == TG_SEQUENCE)
-            dstseq->_buffer = realloc(dstseq->_buffer, (dstseq->_length+1) * size1);
-          if (!tgscan1((char *)dstseq->_buffer + dstseq->_length * size1, st, l))
+          if (t->kind == TG_SEQUENCE && dstseq->_length == cap) {
+            unsigned newcap = cap ? 2 * cap : 4;
+            void *old = dstseq->_buffer;
+            if (maxn && newcap > maxn)
+              newcap = maxn;
+            dstseq->_buffer = scanrealloc(a, dstseq->_buffer, cap * size1, newcap * size1);
+            if (l->tmpl && old && dstseq->_buffer != old)
+              tgtemplate_rebase(l->tmpl, old, cap * size1, (char *)dstseq->_buffer);
+            memset((char *)dstseq->_buffer + cap * size1, 0, (newcap - cap) * size1);
+            cap = newcap;
+          }
+          if (!tgscan1((char *)dstseq->_buffer + dstseq->_length * size1, st, l, a))
             return scanerror(&tok, l, "(unwinding)");
           dstseq->_length++;
         }
@@ -1813,7 +3395,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
         if (len > maxn && !(t->kind == TG_SEQUENCE && maxn == 0))
           return scanerror(&tok, l, "too many elements");
         if (t->kind == TG_SEQUENCE)
-          dstseq->_buffer = realloc(dstseq->_buffer, len);
+          dstseq->_buffer = scanalloc(a, len);
         memcpy (dstseq->_buffer, tok.val.str, len);
         dstseq->_length = dstseq->_maximum = (unsigned)len;
       } else {
@@ -1849,7 +3431,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
           return scanerror(&tok, l, "'=' expected");
       } else { /* DISC:VALUE or DISC:.MEMBER=VALUE */
         pushbacktoken(&tok, l);
-        if (!tgscan1(dst, tu->dtype, l))
+        if (!tgscan1(dst, tu->dtype, l, a))
           return scanerror(&tok, l, "(unwinding)");
         dv = loaddisc(tu->dtype, dst);
         for (i = 0; i < tu->nlab; i++)
@@ -1878,7 +3460,7 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
             return scanerror(&tok, l, "'=' expected");
         }
       }
-      if (!tgscan1(dst + tu->off, tu->ms[msidx].type, l))
+      if (!tgscan1(dst + tu->off, tu->ms[msidx].type, l, a))
         return scanerror(&tok, l, "(unwinding)");
       break;
     }
@@ -1888,13 +3470,14 @@ static int tgscan1(char *dst, const struct tgtype *t, struct lexer *l)
   return 1;
 }
 
-void *tgscan(const struct tgtopic *tp, const char *src, char **endp)
+static void *tgscan_common(const struct tgtopic *tp, const char *src, char **endp, struct tgarena *a, struct tgtemplate *tmpl)
 {
   struct lexer l;
   struct token tok;
-  void *dst = malloc (tp->size);
+  void *dst = scanalloc(a, tp->size);
   memset(dst, 0, tp->size);
   init_lexer(&tok, &l, src);
+  l.tmpl = tmpl;
 
 #if 0
   {
@@ -1915,7 +3498,7 @@ void *tgscan(const struct tgtopic *tp, const char *src, char **endp)
   }
 #endif
 
-  if (!tgscan1(dst, tp->type, &l))
+  if (!tgscan1(dst, tp->type, &l, a))
     goto error;
   if (endp) {
     *endp = (char *) (l.have_token ? l.token.src : l.src);
@@ -1930,6 +3513,178 @@ error:
   if (endp)
     *endp = NULL;
   freetoken(&tok);
-  tgfreedata(tp, dst);
+  if (a == NULL)
+    tgfreedata(tp, dst);
   return NULL;
 }
+
+void *tgscan(const struct tgtopic *tp, const char *src, char **endp)
+{
+  return tgscan_common(tp, src, endp, NULL, NULL);
+}
+
+void *tgscan_arena(const struct tgtopic *tp, const char *src, char **endp, struct tgarena *a)
+{
+  return tgscan_common(tp, src, endp, a, NULL);
+}
+
+void *tgscan_template(const struct tgtopic *tp, const char *src, char **endp, struct tgarena *a, struct tgtemplate **tmpl)
+{
+  struct tgtemplate *t = malloc(sizeof(*t));
+  void *dst;
+  t->n = t->max = 0;
+  t->ps = NULL;
+  if ((dst = tgscan_common(tp, src, endp, a, t)) == NULL || t->n == 0) {
+    tgtemplate_free(t);
+    t = NULL;
+  }
+  *tmpl = t;
+  return dst;
+}
+
+void tgtemplate_apply(const struct tgtemplate *tmpl, int64_t i)
+{
+  unsigned k;
+  for (k = 0; k < tmpl->n; k++) {
+    const struct tgpatch *p = &tmpl->ps[k];
+    switch (p->kind) {
+      case TG_INT:
+        switch (p->size) {
+          case 1: *(int8_t *)p->ptr = (int8_t)i; break;
+          case 2: *(int16_t *)p->ptr = (int16_t)i; break;
+          case 4: *(int32_t *)p->ptr = (int32_t)i; break;
+          case 8: *(int64_t *)p->ptr = i; break;
+        }
+        break;
+      case TG_UINT:
+        switch (p->size) {
+          case 1: *(uint8_t *)p->ptr = (uint8_t)i; break;
+          case 2: *(uint16_t *)p->ptr = (uint16_t)i; break;
+          case 4: *(uint32_t *)p->ptr = (uint32_t)i; break;
+          case 8: *(uint64_t *)p->ptr = (uint64_t)i; break;
+        }
+        break;
+      case TG_FLOAT:
+        if (p->size == 4)
+          *(float *)p->ptr = (float)i;
+        else
+          *(double *)p->ptr = (double)i;
+        break;
+      case TG_STRING: {
+        const char *f = p->fmt, *q;
+        char *d = p->ptr;
+        while ((q = strstr(f, "$i")) != NULL) {
+          memcpy(d, f, (size_t)(q - f));
+          d += q - f;
+          d += sprintf(d, "%" PRId64, i);
+          f = q + 2;
+        }
+        strcpy(d, f);
+        break;
+      }
+      default:
+        assert(0);
+    }
+  }
+}
+
+void tgtemplate_free(struct tgtemplate *tmpl)
+{
+  if (tmpl) {
+    free(tmpl->ps);
+    free(tmpl);
+  }
+}
+
+static int tgdecode1(char *dst, const struct tgtype *t, const char **src, const char *end, struct tgarena *a)
+{
+  t = detypedef(t);
+  switch (t->kind) {
+    case TG_STRING: {
+      uint32_t n;
+      char *str;
+      if ((size_t)(end - *src) < sizeof(n))
+        return 0;
+      memcpy(&n, *src, sizeof(n));
+      *src += sizeof(n);
+      if (n > (size_t)(end - *src) || (t->u.str.maxn && n > t->u.str.maxn))
+        return 0;
+      str = tgarena_alloc(a, n + 1);
+      memcpy(str, *src, n);
+      str[n] = 0;
+      *(char **)dst = str;
+      *src += n;
+      return 1;
+    }
+    case TG_STRUCT: {
+      unsigned i;
+      for (i = 0; i < t->u.S.n; i++)
+        if (!tgdecode1(dst + t->u.S.ms[i].off, t->u.S.ms[i].type, src, end, a))
+          return 0;
+      return 1;
+    }
+    case TG_SEQUENCE: case TG_ARRAY: {
+      const struct tgtype *st = (t->kind == TG_SEQUENCE) ? t->u.seq.type : t->u.ary.type;
+      const size_t size1 = st->size;
+      char *buf;
+      uint32_t n, i;
+      if (t->kind == TG_ARRAY) {
+        n = t->u.ary.n;
+        buf = dst;
+      } else {
+        dds_seq_t *seq = (dds_seq_t *)dst;
+        if ((size_t)(end - *src) < sizeof(n))
+          return 0;
+        memcpy(&n, *src, sizeof(n));
+        *src += sizeof(n);
+        /* every element takes at least one byte */
+        if (n > (size_t)(end - *src) || (t->u.seq.maxn && n > t->u.seq.maxn))
+          return 0;
+        buf = (n == 0) ? NULL : tgarena_alloc(a, n * size1);
+        seq->_buffer = (void *)buf;
+        seq->_length = seq->_maximum = n;
+        seq->_release = 0;
+        if (n == 0)
+          return 1;
+      }
+      if (tgprimitive(st)) {
+        if (n * size1 > (size_t)(end - *src))
+          return 0;
+        memcpy(buf, *src, n * size1);
+        *src += n * size1;
+        return 1;
+      }
+      if (t->kind == TG_SEQUENCE)
+        memset(buf, 0, n * size1);
+      for (i = 0; i < n; i++)
+        if (!tgdecode1(buf + i * size1, st, src, end, a))
+          return 0;
+      return 1;
+    }
+    case TG_UNION: {
+      const struct tgtype_U *tu = &t->u.U;
+      int msidx;
+      if (!tgdecode1(dst, tu->dtype, src, end, a))
+        return 0;
+      msidx = tgselectmember(tu, dst);
+      return (msidx == -1) || tgdecode1(dst + tu->off, tu->ms[msidx].type, src, end, a);
+    }
+    default:
+      if (t->size > (size_t)(end - *src))
+        return 0;
+      memcpy(dst, *src, t->size);
+      *src += t->size;
+      return 1;
+  }
+}
+
+void *tgdecode_arena(const struct tgtopic *tp, const void *src, size_t len, struct tgarena *a)
+{
+  /* returns NULL if SRC is not exactly one encoded sample */
+  const char *p = src, *end = p + len;
+  void *dst = tgarena_alloc(a, tp->size);
+  memset(dst, 0, tp->size);
+  if (!tgdecode1(dst, tp->type, &p, end, a) || p != end)
+    return NULL;
+  return dst;
+}
@@ -15,9 +15,11 @@
 #define __ospli_osplo__tglib__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <dds_dcps.h>
 
 struct tgtype;
+struct tgtypegraph;
 
 struct tgtopic_key {
   char *name; /* field name */
@@ -28,16 +30,26 @@ struct tgtopic_key {
 struct tgtopic {
   char *name;
   size_t size;
-  struct tgtype *type;
+  struct tgtype *type; /* aliases graph */
+  struct tgtypegraph *graph; /* shared with other topics of the same type */
   unsigned nkeys;
   struct tgtopic_key *keys;
 };
 
+/* Subset of the fields of a topic, for printing only those: the
+   fields are arbitrary member paths, e.g., "pos.x" or "a[3].b" */
+struct tgproj {
+  unsigned n;
+  struct tgtopic_key *fields; /* types alias tgtopic::type */
+};
+
 enum tgprint_mode {
   TGPM_DENSE,
   TGPM_SPACE,
   TGPM_FIELDS,
-  TGPM_MULTILINE
+  TGPM_MULTILINE,
+  TGPM_JSON, /* one JSON object per sample, no newlines */
+  TGPM_CSV   /* flattened, see tgprintcsvhdr for the column names */
 };
 
 struct tgstring {
@@ -52,11 +64,75 @@ void tgstring_init(struct tgstring *s, size_t chop);
 void tgstring_fini(struct tgstring *s);
 
 struct tgtopic *tgnew(DDS_Topic tp, int printtype);
+struct tgtopic *tgnewmd(const char *topicname, const char *typename, const char *keylist, const char *md, int printtype);
 void tgfree(struct tgtopic *tp);
 int tgprint(struct tgstring *s, const struct tgtopic *tp, const void *data, enum tgprint_mode mode);
-int tgprintkey(struct tgstring *s, const struct tgtopic *tp, const void *keydata, enum tgprint_mode mode);
+int tgprintkey(struct tgstring *s, const struct tgtopic *tp, const struct tgproj *proj, const void *keydata, enum tgprint_mode mode);
+
+struct tgproj *tgprojnew(const struct tgtopic *tp, const char *paths);
+void tgprojfree(struct tgproj *proj);
+int tgprintproj(struct tgstring *s, const struct tgproj *proj, const void *data, enum tgprint_mode mode);
+int tgprintcsvhdr(struct tgstring *s, const struct tgtopic *tp, const struct tgproj *proj);
+
+/* Upper bound on maxinst for tgdelta_new and tgkeycache_new, larger
+   values are reduced to it */
+#define TG_MAXINST (1u << 24)
+
+/* Change-only printing: remembers the last sample of (at most maxinst,
+   least-recently used ones are dropped) instances and prints only the
+   fields that changed.  tgprintdelta returns 0 if nothing changed. */
+struct tgdelta;
+struct tgdelta *tgdelta_new(const struct tgtopic *tp, const struct tgproj *proj, unsigned maxinst);
+void tgdelta_free(struct tgdelta *d);
+void tgdelta_forget(struct tgdelta *d, DDS_InstanceHandle_t ih);
+int tgprintdelta(struct tgstring *s, struct tgdelta *d, DDS_InstanceHandle_t ih, const void *data, enum tgprint_mode mode);
 
+/* Key-to-instance-handle cache for writers: maps the key fields of a
+   sample to a handle slot, holding at most maxinst keys (least-recently
+   used ones are dropped).  tgkeycache_lookup returns NULL if the key is
+   absent and CREATE is 0, a new slot contains DDS_HANDLE_NIL. */
+struct tgkeycache;
+struct tgkeycache *tgkeycache_new(const struct tgtopic *tp, unsigned maxinst);
+void tgkeycache_free(struct tgkeycache *c);
+DDS_InstanceHandle_t *tgkeycache_lookup(struct tgkeycache *c, const void *data, int create);
+void tgkeycache_forget(struct tgkeycache *c, const void *data);
+
+/* Deep copy of a sample into a single block of tgcopysize() bytes,
+   the copy must not be passed to tgfreedata */
+size_t tgcopysize(const struct tgtopic *tp, const void *data);
+void tgcopy(const struct tgtopic *tp, void *dst, const void *data);
+
+/* Flat binary encoding of a sample: primitives in native representation
+   without padding, strings and sequences as a uint32_t length followed by
+   the contents, unions as the discriminant followed by the selected
+   member; if KEYONLY, only the key fields of DATA are used and the others
+   are encoded as if zero (as for invalid samples) */
+size_t tgencodesize(const struct tgtopic *tp, const void *data, int keyonly);
+void tgencode(const struct tgtopic *tp, void *dst, const void *data, int keyonly);
+
+/* Scanning stops at the end of the line: a newline ends the input like
+   the terminating NUL, and *ENDP (if ENDP is non-null) then points to
+   that newline */
 void *tgscan(const struct tgtopic *tp, const char *src, char **endp);
 void tgfreedata(const struct tgtopic *tp, void *data);
 
+/* Bump allocator for tgscan_arena: the sample and everything it points
+   to live in the arena and are released together by tgarena_reset, the
+   result must not be passed to tgfreedata */
+struct tgarena;
+struct tgarena *tgarena_new(void);
+void tgarena_reset(struct tgarena *a);
+void tgarena_free(struct tgarena *a);
+void *tgscan_arena(const struct tgtopic *tp, const char *src, char **endp, struct tgarena *a);
+void *tgdecode_arena(const struct tgtopic *tp, const void *src, size_t len, struct tgarena *a);
+
+/* Templates: tgscan_template accepts $i in place of integer and
+   floating-point values and inside string literals, tgtemplate_apply
+   substitutes a counter value for it in the sample in place; *tmpl is
+   set to NULL if there are no occurrences of $i */
+struct tgtemplate;
+void *tgscan_template(const struct tgtopic *tp, const char *src, char **endp, struct tgarena *a, struct tgtemplate **tmpl);
+void tgtemplate_apply(const struct tgtemplate *tmpl, int64_t i);
+void tgtemplate_free(struct tgtemplate *tmpl);
+
 #endif /* defined(__ospli_osplo__tglib__) */